@@ -0,0 +1,942 @@
+#ifndef STREAM_INCLUDE_COMPARE_ARITHMETIC_H_
+#define STREAM_INCLUDE_COMPARE_ARITHMETIC_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "palm_arithmetic.h"
+
+namespace StreamPalm {
+
+enum CompareErrorCode {
+  kCompareNoMatch = 0x26001,          // No template reaches the recognition threshold.
+  kCompareDimensionMismatch = 0x26002,
+  kCompareIdExists = 0x26003,
+  kCompareIdNotFound = 0x26004,
+  kCompareEmptyGallery = 0x26005,
+  kCompareGalleryMismatch = 0x26006,  // Gallery file of another model version or configuration.
+  kCompareGalleryCorrupt = 0x26007,   // Gallery file truncated or failing its checksum.
+  kCompareGalleryFull = 0x26008,      // CompareConfig::memory_budget reached.
+};
+
+enum class CompareMetric {
+  kCosine = 0,  // Cosine similarity, features are L2-normalized when they are added.
+  kL2,          // Negative squared euclidean distance, so that a larger score is closer.
+};
+
+enum class FeatureStorage {
+  kFloat32 = 0,  // Full precision.
+  kFloat16,      // IEEE half precision, half the memory of kFloat32.
+  kInt8,         // Symmetric int8 with one scale per template, a quarter of the memory.
+};
+
+enum class CompareIndexType {
+  kFlat = 0,  // Exhaustive scan, exact.
+  kHnsw,      // Hierarchical navigable small world graph, approximate.
+  kIvfPq,     // Inverted lists of product quantization codes, trained with TrainIvfPq().
+};
+
+struct ProjectionParam {
+  // Projection written by TrainProjection() and loaded by PalmCompare::Create(). Templates and
+  // probes are projected before they reach the gallery, which then keeps ir_dim/rgb_dim values
+  // per template whatever the index type. Scores change with the projection, the recognition
+  // thresholds of PalmCapture::GetRecognitionThreshold() do not apply to them. Empty for none.
+  std::string file;
+
+  // Lengths after the projection, the principal components kept. Used by TrainProjection().
+  uint32_t ir_dim{128};
+  uint32_t rgb_dim{128};
+
+  // Scale the components to unit variance. Used by TrainProjection().
+  bool whiten{false};
+};
+
+struct HnswParam {
+  // Links per node on the upper layers, twice as many on the bottom layer.
+  uint32_t m{16};
+
+  // Candidate list size while inserting. Larger builds a better graph, slower.
+  uint32_t ef_construction{200};
+
+  // Candidate list size while searching, the recall/latency knob.
+  uint32_t ef_search{64};
+};
+
+struct IvfPqParam {
+  // Number of coarse clusters, and the number of them searched per query.
+  uint32_t nlist{1024};
+  uint32_t nprobe{16};
+
+  // Sub-quantizers per modality, each encodes dim / pq_m values in one byte.
+  uint32_t pq_m{32};
+
+  // Codebooks written by TrainIvfPq() and loaded by PalmCompare::Create(). The gallery keeps
+  // only the codes, set rerank_file to re-score the candidates in full precision.
+  std::string codebook_file;
+};
+
+enum class BinaryCodeSource {
+  kFeatureSign = 0,  // Sign bits of the features, available for every probe.
+  kRegisterHash,     // hash_ir_output/hash_rgb_output of RegisterPalm(), probes need one too.
+};
+
+struct HammingParam {
+  // Rows the binary pass hands to the float scan, zero disables the prefilter. Only used by a
+  // CompareIndexType::kFlat gallery.
+  uint32_t candidates{0};
+
+  BinaryCodeSource source{BinaryCodeSource::kFeatureSign};
+};
+
+struct CascadeParam {
+  // Search a kBiModal gallery with the ir features first. The rgb and fused scores are only
+  // computed for templates whose ir score reaches the ir threshold minus ir_margin, templates
+  // below it could not be accepted anyway. Until SetRecognitionThreshold() or
+  // LoadRecognitionThreshold() there is no bound, and queries score every template.
+  bool enable{false};
+  float ir_margin{0.05f};
+
+  // Every audit_interval-th cascaded query is repeated with a full bimodal scan to count how
+  // often the cascade changes the top-1 result, zero disables the audit.
+  uint32_t audit_interval{64};
+};
+
+struct CascadeStats {
+  uint64_t queries{0};       // Cascaded queries.
+  uint64_t survivors{0};     // Templates that passed the ir stage, summed over the queries.
+  uint64_t audited{0};       // Queries repeated with a full bimodal scan.
+  uint64_t top1_changed{0};  // Audited queries whose top-1 differs from the full scan.
+  uint64_t decision_changed{0};  // Of those, queries where QueryFeaturesId() would differ.
+};
+
+enum class TemplateFusion {
+  kNone = 0,  // One template per features id.
+  kMax,       // Several templates per features id, scored by the best one.
+  kMean,      // Scored by the mean of all of them.
+  kTop2Mean,  // Scored by the mean of the best two.
+};
+
+struct PalmTypeParam {
+  // Keep the templates of each palm_type of RegisterPalm() or ExtractPalmFeaturesFromImg() in a
+  // partition of their own, a query with a palm type scans only its partition. Templates are then
+  // added with AddFeaturesWithPalmType(). Needs a kFlat index.
+  bool partition{false};
+
+  // Scan the other partition too when the best template of the own partition does not reach the
+  // recognition thresholds, e.g. for a hand enrolled or classified as the other one.
+  bool fallback{true};
+};
+
+struct GeometryParam {
+  // Keep a descriptor of the palm skeleton of RegisterPalm() or ExtractPalmFeaturesFromImg() per
+  // template, the finger segment lengths and palm width relative to each other, and compare the
+  // features of a probe with a skeleton only against templates of a similar hand shape.
+  // Templates are then added with AddFeaturesWithSkeleton(). Needs a kFlat index without
+  // prefilter, cascade, template fusion or early exit.
+  bool enable{false};
+
+  // Largest mean absolute difference of two descriptors, whose values average one.
+  float max_distance{0.1f};
+};
+
+struct EarlyExitParam {
+  // Abandon a template's inner product part way once it can no longer enter the top-K or reach
+  // the recognition thresholds. Queries then only return candidates that reach the threshold of
+  // every compared modality, once SetRecognitionThreshold() or LoadRecognitionThreshold() was
+  // called.
+  bool prune{false};
+
+  // Stop at the first template that reaches the accept thresholds on every compared modality,
+  // the query returns that template alone. Meant for attendance, where an enrolled palm
+  // usually scores far above the recognition threshold.
+  bool accept_first{false};
+  float accept_ir_threshold{0.8f};
+  float accept_rgb_threshold{0.8f};
+};
+
+struct ScanThreadParam {
+  // Worker threads of the sharded flat scan, zero scans on the calling thread only.
+  uint32_t threads{0};
+
+  // Cores the workers may run on, empty for every core the process may run on.
+  std::vector<int> cpus;
+
+  // Cores left to the model inference threads, see LoadModelCpuList().
+  std::vector<int> excluded_cpus;
+
+  // Template bytes per shard, about the size of a core's L2 cache.
+  uint32_t shard_bytes{1u << 20};
+};
+
+struct JournalParam {
+  // Snapshot of the gallery in the format of SaveGallery() and write-ahead log of every
+  // AddFeatures*() and DeleteID() since, recovered and kept up to date by
+  // PalmCompare::OpenJournal(). Empty for none.
+  std::string snapshot_file;
+  std::string log_file;
+
+  // Fold the log into a new snapshot once it holds this many records, zero leaves it to
+  // PalmCompare::CompactJournal(). The gallery is locked while the snapshot is written.
+  uint32_t compact_records{4096};
+};
+
+struct TierParam {
+  // Ids whose templates are kept in a small hot tier, zero for none. QueryFeaturesId*() compares
+  // the probe with the hot templates first and searches the whole gallery only when none of them
+  // reaches the recognition thresholds, an id matched there replaces the least recently matched
+  // one. Pays off where the same few hundred people come every day out of a large gallery. Not
+  // for a kIvfPq index, with fusion or with rerank_file.
+  uint32_t hot_capacity{0};
+};
+
+// Counters of the hot tier, e.g. to size TierParam::hot_capacity for a site.
+struct TierStats {
+  uint64_t queries{0};    // QueryFeaturesId*() calls that searched the hot tier.
+  uint64_t hot_hits{0};   // Of those, accepted from the hot tier alone.
+  uint64_t cold_hits{0};  // Accepted from the whole gallery.
+  uint64_t hot_ids{0};    // Ids in the hot tier now.
+  uint64_t cache_hits{0};  // QueryFeaturesId*() calls answered by the probe cache.
+};
+
+struct ProbeCacheParam {
+  // Probes of the last matches kept, zero for none. QueryFeaturesId*() answers a probe that is
+  // as close as similarity to one of them with its features id and score, without a search,
+  // e.g. for the frames of a hand held still over the sensor or a repeated tap. A PalmCompare
+  // per device keeps the cache to the probes of that device.
+  uint32_t entries{0};
+
+  // Age of a match after which its probe is no longer used.
+  uint32_t ttl_ms{2000};
+
+  // Cosine similarity to the cached probe on every compared modality, features as given.
+  float similarity{0.97f};
+};
+
+struct CompareConfig {
+  // Recognition mode, decides which of the ir/rgb features are stored and compared.
+  RecognizeMode recog_mode{kBiModal};
+
+  CompareMetric metric{CompareMetric::kCosine};
+
+  // Feature lengths as given to AddFeatures(). Zero means the length is taken from the first
+  // added template.
+  uint32_t ir_dim{0};
+  uint32_t rgb_dim{0};
+
+  // Weight of the ir score in the fused kBiModal score, the rgb score gets 1 - ir_weight.
+  float ir_weight{0.5f};
+
+  // Number of templates to reserve memory for.
+  uint32_t reserve{0};
+
+  // Bytes the stored templates may take, zero for no limit. AddFeatures*() fail with
+  // kCompareGalleryFull once another template would exceed it, e.g. for the tenants of a
+  // TenantCompare. A hot_swap gallery takes the budget twice.
+  uint64_t memory_budget{0};
+
+  // In-memory representation of the templates.
+  FeatureStorage storage{FeatureStorage::kFloat32};
+
+  // Dimensionality reduction of the features, e.g. to a quarter of the memory and bandwidth per
+  // template at little loss of accuracy.
+  ProjectionParam projection;
+
+  // File that keeps the full precision templates of a kFloat16/kInt8 gallery. When set, the
+  // best rerank_count candidates of the quantized scan are re-scored from it in float.
+  std::string rerank_file;
+  uint32_t rerank_count{32};
+
+  // Search structure over the gallery.
+  CompareIndexType index_type{CompareIndexType::kFlat};
+  HnswParam hnsw;
+  IvfPqParam ivf_pq;
+
+  // Hamming distance prefilter ahead of the float scan.
+  HammingParam hamming;
+
+  // Ir-then-rgb cascade for kBiModal with a kFlat index.
+  CascadeParam cascade;
+
+  // Templates per features id, e.g. both palms or several RegisterPalm() captures of a person.
+  // With fusion set, AddFeatures() with an existing id adds another template stored next to the
+  // others, and queries return every id once with the fused score. Needs a kFlat index without
+  // prefilter, cascade, early exit or rerank_file.
+  TemplateFusion fusion{TemplateFusion::kNone};
+
+  // Left/right palm partitions.
+  PalmTypeParam palm_type;
+
+  // Hand shape filter ahead of the feature comparison.
+  GeometryParam geometry;
+
+  // Early termination of the kFlat scan.
+  EarlyExitParam early_exit;
+
+  // Parallel flat scan.
+  ScanThreadParam scan;
+
+  // Crash safe persistence of enrollments and deletions, not for a kIvfPq index or with
+  // rerank_file.
+  JournalParam journal;
+
+  // Keep the gallery twice, so that AddFeatures*() and DeleteID() change one copy while the
+  // queries go on with the other, e.g. to enroll in bulk on a device that recognizes meanwhile.
+  // Doubles the memory of the gallery and the time of a change. Without it the queries wait
+  // for each change.
+  bool hot_swap{false};
+
+  // Recently matched ids searched ahead of the whole gallery.
+  TierParam tier;
+
+  // Answers for repeated probes of the same hand.
+  ProbeCacheParam probe_cache;
+};
+
+struct CompareCandidate {
+  // Features id given to AddFeatures().
+  int features_id{-1};
+
+  // Fused score used for ranking.
+  float score{0.0f};
+
+  // Per modality scores, zero if the modality is not used by the recognition mode.
+  float ir_score{0.0f};
+  float rgb_score{0.0f};
+};
+
+class PalmCompare {
+ public:
+  virtual ~PalmCompare() = default;
+
+  /**
+   * Create a local 1:N palm compare object.
+   *
+   * @param[in] config Gallery and scoring configuration.
+   *
+   * @param[out] compare shared_ptr point to Object PalmCompare.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  static int Create(const CompareConfig& config, std::shared_ptr<PalmCompare>* compare);
+
+  /**
+   * Set the thresholds used to accept a match in QueryFeaturesId().
+   *
+   * @param[in] ir_threshold the ir threshold for recognition feature comparison.
+   *
+   * @param[in] rgb_threshold the rgb threshold for recognition feature comparison.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int SetRecognitionThreshold(float ir_threshold, float rgb_threshold) = 0;
+
+  /**
+   * Load the thresholds from PalmCapture::GetRecognitionThreshold() for the configured mode.
+   *
+   * @param[in] palm palm arithmetic object.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int LoadRecognitionThreshold(std::shared_ptr<PalmCapture> palm) = 0;
+
+  /**
+   * Add a template to the local gallery.
+   *
+   * @param[in] features_id features id, must be unique within the gallery unless
+   *            CompareConfig::fusion is set, then it adds another template to the id.
+   *
+   * @param[in] ir_features ir features from ExtractPalmFeaturesFromImg() or RegisterPalm().
+   *
+   * @param[in] rgb_features rgb features from ExtractPalmFeaturesFromImg() or RegisterPalm().
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int AddFeatures(int features_id,
+                          const std::vector<float>& ir_features,
+                          const std::vector<float>& rgb_features) = 0;
+
+  /**
+   * Add a template together with the hashes returned by PalmCapture::RegisterPalm(). They are
+   * packed into bit vectors for a BinaryCodeSource::kRegisterHash prefilter.
+   *
+   * @param[in] features_id features id, must be unique within the gallery.
+   *
+   * @param[in] ir_features ir features from RegisterPalm().
+   *
+   * @param[in] rgb_features rgb features from RegisterPalm().
+   *
+   * @param[in] hash_ir hash_ir_output of RegisterPalm().
+   *
+   * @param[in] hash_rgb hash_rgb_output of RegisterPalm().
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int AddFeaturesWithHash(int features_id,
+                                  const std::vector<float>& ir_features,
+                                  const std::vector<float>& rgb_features,
+                                  const std::string& hash_ir,
+                                  const std::string& hash_rgb) = 0;
+
+  /**
+   * AddFeatures() into the partition of a palm type, see PalmTypeParam.
+   *
+   * @param[in] features_id features id.
+   *
+   * @param[in] palm_type palm_type of RegisterPalm(), 0 or 1.
+   *
+   * @param[in] ir_features ir features from RegisterPalm().
+   *
+   * @param[in] rgb_features rgb features from RegisterPalm().
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int AddFeaturesWithPalmType(int features_id,
+                                      int palm_type,
+                                      const std::vector<float>& ir_features,
+                                      const std::vector<float>& rgb_features) = 0;
+
+  /**
+   * AddFeaturesWithPalmType() with the palm skeleton for the hand shape filter, see
+   * GeometryParam.
+   *
+   * @param[in] features_id features id.
+   *
+   * @param[in] palm_type palm_type of RegisterPalm(), 0 or 1, or -1 for a gallery that is not
+   *            partitioned.
+   *
+   * @param[in] ir_features ir features from RegisterPalm().
+   *
+   * @param[in] rgb_features rgb features from RegisterPalm().
+   *
+   * @param[in] skeleton skeleton from RegisterPalm(), (x, y) keypoints.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int AddFeaturesWithSkeleton(int features_id,
+                                      int palm_type,
+                                      const std::vector<float>& ir_features,
+                                      const std::vector<float>& rgb_features,
+                                      const std::vector<float>& skeleton) = 0;
+
+  /**
+   * Delete the specified feature value ID, with all of its templates, from the local gallery.
+   *
+   * @param[in] features_id features id.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int DeleteID(const int& features_id) = 0;
+
+  /**
+   * Write the gallery to a file for LoadGallery(), e.g. after enrolling. The file is replaced
+   * atomically, a power cut leaves either the old or the new gallery. Not available for a kIvfPq
+   * index or with rerank_file, whose templates live outside of the gallery.
+   *
+   * @param[in] path gallery file.
+   *
+   * @param[in] model_version version of PalmCapture::GetAlgorithmVersion() that extracted the
+   *            features, at most 127 characters.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int SaveGallery(const std::string& path, const std::string& model_version) = 0;
+
+  /**
+   * Replace the gallery with a file of SaveGallery(), e.g. at startup instead of adding every
+   * template again. The templates are memory mapped and scanned in place, a kHnsw graph is
+   * rebuilt. The file must come from a PalmCompare with the same configuration and projection.
+   *
+   * @param[in] path gallery file.
+   *
+   * @param[in] model_version version of PalmCapture::GetAlgorithmVersion() the probes come from.
+   *
+   * @return Zero on success, kCompareGalleryMismatch if the file is of another model version or
+   *         configuration, kCompareGalleryCorrupt if it is truncated or fails its checksum.
+   */
+  virtual int LoadGallery(const std::string& path, const std::string& model_version) = 0;
+
+  /**
+   * Share the gallery file of another process, e.g. one capture process per palm device next to
+   * the one that enrolls. The file is mapped read-only, so every process on the host scans the
+   * same physical pages. The publisher writes each new generation with SaveGallery() or
+   * CompactJournal(), which rename it over path, and a background thread checks path every
+   * poll_ms and installs the new generation; with CompareConfig::hot_swap queries do not wait
+   * meanwhile. Not available for a kIvfPq index, with rerank_file or with a journal. The
+   * gallery is read-only afterwards, AddFeatures*() and DeleteID() fail.
+   *
+   * @param[in] path gallery file of the publisher.
+   *
+   * @param[in] model_version version of PalmCapture::GetAlgorithmVersion() the probes come from.
+   *
+   * @param[in] poll_ms interval to check path for a new generation, greater than zero.
+   *
+   * @return Zero on success, error code of LoadGallery() for the first generation otherwise.
+   */
+  virtual int FollowGallery(const std::string& path, const std::string& model_version,
+                            uint32_t poll_ms) = 0;
+
+  /**
+   * Recover the gallery of CompareConfig::journal: load its snapshot, if there is one, and replay
+   * the log records after it. From then on every AddFeatures*() and DeleteID() is appended to
+   * the log and returns once it is on disk, concurrent calls share one flush. Call before the
+   * first template is added, later calls with the same model_version do nothing. LoadGallery()
+   * is not available afterwards.
+   *
+   * @param[in] model_version version of PalmCapture::GetAlgorithmVersion() that extracted the
+   *            features, at most 127 characters.
+   *
+   * @return Zero on success, kCompareGalleryMismatch if the files are of another model version
+   *         or configuration, kCompareGalleryCorrupt if the snapshot is damaged or a record does
+   *         not apply.
+   */
+  virtual int OpenJournal(const std::string& model_version) = 0;
+
+  /**
+   * Write a snapshot with every logged change and empty the log, e.g. after a bulk enrollment.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int CompactJournal() = 0;
+
+  /**
+   * Search the K most similar templates.
+   *
+   * @param[in] ir_features probe ir features.
+   *
+   * @param[in] rgb_features probe rgb features.
+   *
+   * @param[in] top_k number of candidates to return.
+   *
+   * @param[out] candidates candidates sorted by descending score.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int QueryTopK(const std::vector<float>& ir_features,
+                        const std::vector<float>& rgb_features,
+                        uint32_t top_k,
+                        std::vector<CompareCandidate>& candidates) = 0;
+
+  /**
+   * QueryTopK() with probe hashes for a BinaryCodeSource::kRegisterHash prefilter.
+   *
+   * @param[in] ir_features probe ir features.
+   *
+   * @param[in] rgb_features probe rgb features.
+   *
+   * @param[in] hash_ir probe ir hash.
+   *
+   * @param[in] hash_rgb probe rgb hash.
+   *
+   * @param[in] top_k number of candidates to return.
+   *
+   * @param[out] candidates candidates sorted by descending score.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int QueryTopKWithHash(const std::vector<float>& ir_features,
+                                const std::vector<float>& rgb_features,
+                                const std::string& hash_ir,
+                                const std::string& hash_rgb,
+                                uint32_t top_k,
+                                std::vector<CompareCandidate>& candidates) = 0;
+
+  /**
+   * QueryTopK() in the partition of the probe's palm type, see PalmTypeParam.
+   *
+   * @param[in] ir_features probe ir features.
+   *
+   * @param[in] rgb_features probe rgb features.
+   *
+   * @param[in] palm_type palm_type of ExtractPalmFeaturesFromImg(), 0 or 1.
+   *
+   * @param[in] top_k number of candidates to return.
+   *
+   * @param[out] candidates candidates sorted by descending score.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int QueryTopKWithPalmType(const std::vector<float>& ir_features,
+                                    const std::vector<float>& rgb_features,
+                                    int palm_type,
+                                    uint32_t top_k,
+                                    std::vector<CompareCandidate>& candidates) = 0;
+
+  /**
+   * QueryTopKWithPalmType() among the templates of a similar hand shape, see GeometryParam.
+   *
+   * @param[in] ir_features probe ir features.
+   *
+   * @param[in] rgb_features probe rgb features.
+   *
+   * @param[in] palm_type palm_type of ExtractPalmFeaturesFromImg(), 0 or 1, or -1 to search
+   *            every partition.
+   *
+   * @param[in] skeleton skeleton of ExtractPalmFeaturesFromImg().
+   *
+   * @param[in] top_k number of candidates to return.
+   *
+   * @param[out] candidates candidates sorted by descending score.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int QueryTopKWithSkeleton(const std::vector<float>& ir_features,
+                                    const std::vector<float>& rgb_features,
+                                    int palm_type,
+                                    const std::vector<float>& skeleton,
+                                    uint32_t top_k,
+                                    std::vector<CompareCandidate>& candidates) = 0;
+
+  /**
+   * QueryTopK() for a batch of probes, e.g. a burst of queries from many terminals. A flat
+   * gallery is scanned once for the whole batch.
+   *
+   * @param[in] ir_probes probe ir features.
+   *
+   * @param[in] rgb_probes probe rgb features, same count as ir_probes.
+   *
+   * @param[in] top_k number of candidates to return per probe.
+   *
+   * @param[out] results candidates of every probe, sorted by descending score.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int QueryTopKBatch(const std::vector<std::vector<float>>& ir_probes,
+                             const std::vector<std::vector<float>>& rgb_probes,
+                             uint32_t top_k,
+                             std::vector<std::vector<CompareCandidate>>& results) = 0;
+
+  /**
+   * QueryTopKWithPalmType() within a latency budget, e.g. what is left of a turnstile's budget
+   * from kPalmDetected to the door opening. The hot tier of TierParam and the partition of the
+   * palm type are searched first, then the rest of a flat gallery block by block while the
+   * budget lasts, and the best templates found by then are returned. A kHnsw or kIvfPq index
+   * is always searched completely.
+   *
+   * @param[in] ir_features probe ir features.
+   *
+   * @param[in] rgb_features probe rgb features.
+   *
+   * @param[in] palm_type palm_type of ExtractPalmFeaturesFromImg(), 0 or 1, or -1 to search
+   *            every partition.
+   *
+   * @param[in] top_k number of candidates to return.
+   *
+   * @param[in] budget_us microseconds from the call, at least one block is searched.
+   *
+   * @param[out] candidates candidates sorted by descending score.
+   *
+   * @param[out] complete true if every template was compared, false if the result is the best
+   *             of those searched before the deadline.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int QueryTopKWithDeadline(const std::vector<float>& ir_features,
+                                    const std::vector<float>& rgb_features,
+                                    int palm_type,
+                                    uint32_t top_k,
+                                    uint32_t budget_us,
+                                    std::vector<CompareCandidate>& candidates,
+                                    bool& complete) = 0;
+
+  /**
+   * Query, the local counterpart of PalmClient::QueryFeaturesIdFromServer().
+   *
+   * @param[in] ir_features probe ir features.
+   *
+   * @param[in] rgb_features probe rgb features.
+   *
+   * @param[out] features_id features id of the best match.
+   *
+   * @param[out] score fused score of the best match.
+   *
+   * @return Zero on success, kCompareNoMatch if the best match is below the threshold.
+   */
+  virtual int QueryFeaturesId(const std::vector<float>& ir_features,
+                              const std::vector<float>& rgb_features,
+                              int& features_id,
+                              float& score) = 0;
+
+  /**
+   * QueryFeaturesId() in the partition of the probe's palm type, see PalmTypeParam.
+   *
+   * @param[in] ir_features probe ir features.
+   *
+   * @param[in] rgb_features probe rgb features.
+   *
+   * @param[in] palm_type palm_type of ExtractPalmFeaturesFromImg(), 0 or 1.
+   *
+   * @param[out] features_id features id of the best match.
+   *
+   * @param[out] score fused score of the best match.
+   *
+   * @return Zero on success, kCompareNoMatch if the best match is below the threshold.
+   */
+  virtual int QueryFeaturesIdWithPalmType(const std::vector<float>& ir_features,
+                                          const std::vector<float>& rgb_features,
+                                          int palm_type,
+                                          int& features_id,
+                                          float& score) = 0;
+
+  /**
+   * QueryFeaturesIdWithPalmType() among the templates of a similar hand shape, see
+   * GeometryParam.
+   *
+   * @param[in] ir_features probe ir features.
+   *
+   * @param[in] rgb_features probe rgb features.
+   *
+   * @param[in] palm_type palm_type of ExtractPalmFeaturesFromImg(), 0 or 1, or -1 to search
+   *            every partition.
+   *
+   * @param[in] skeleton skeleton of ExtractPalmFeaturesFromImg().
+   *
+   * @param[out] features_id features id of the best match.
+   *
+   * @param[out] score fused score of the best match.
+   *
+   * @return Zero on success, kCompareNoMatch if the best match is below the threshold.
+   */
+  virtual int QueryFeaturesIdWithSkeleton(const std::vector<float>& ir_features,
+                                          const std::vector<float>& rgb_features,
+                                          int palm_type,
+                                          const std::vector<float>& skeleton,
+                                          int& features_id,
+                                          float& score) = 0;
+
+  /**
+   * Link a card to the features id of its holder for VerifyCard(), e.g. the UID the XT-N424
+   * reader reports for a card enrolled together with the palm. Linking a card again moves it to
+   * the new id. The links are kept in memory, they are set again after a restart.
+   *
+   * @param[in] card_uid card UID as read.
+   *
+   * @param[in] features_id features id of the holder, which may be added later.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int BindCard(const std::string& card_uid, int features_id) = 0;
+
+  /**
+   * Remove the link of a card, e.g. when it is lost.
+   *
+   * @param[in] card_uid card UID of BindCard().
+   *
+   * @return Zero on success, kCompareIdNotFound for an unknown card.
+   */
+  virtual int UnbindCard(const std::string& card_uid) = 0;
+
+  /**
+   * Verify a palm against the templates of a card's holder alone, 1:1 for doors that take a
+   * card and a palm. Neither a 1:N search nor the server is involved.
+   *
+   * @param[in] card_uid card UID of BindCard().
+   *
+   * @param[in] ir_features probe ir features.
+   *
+   * @param[in] rgb_features probe rgb features.
+   *
+   * @param[out] score fused score against the holder's templates.
+   *
+   * @return Zero if the palm reaches the recognition thresholds, kCompareNoMatch if not,
+   *         kCompareIdNotFound for an unknown card or a holder without templates.
+   */
+  virtual int VerifyCard(const std::string& card_uid,
+                         const std::vector<float>& ir_features,
+                         const std::vector<float>& rgb_features,
+                         float& score) = 0;
+
+  /**
+   * Change the candidate list size of a kHnsw index at runtime.
+   *
+   * @param[in] ef_search candidate list size, at least 1.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int SetHnswSearchParam(uint32_t ef_search) = 0;
+
+  /**
+   * Change the number of lists searched by a kIvfPq index at runtime.
+   *
+   * @param[in] nprobe number of lists, at least 1.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int SetIvfPqSearchParam(uint32_t nprobe) = 0;
+
+  /**
+   * Measure the recall of the configured index against an exhaustive scan. A kIvfPq gallery
+   * needs rerank_file for the exhaustive scan.
+   *
+   * @param[in] ir_probes probe ir features.
+   *
+   * @param[in] rgb_probes probe rgb features, same count as ir_probes.
+   *
+   * @param[in] top_k number of neighbours compared per probe.
+   *
+   * @param[out] recall fraction of the exact top_k found by the index.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int MeasureRecall(const std::vector<std::vector<float>>& ir_probes,
+                            const std::vector<std::vector<float>>& rgb_probes,
+                            uint32_t top_k,
+                            float& recall) = 0;
+
+  /**
+   * Get the counters of the kBiModal ir-then-rgb cascade.
+   *
+   * @param[out] stats cascade counters since Create().
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int GetCascadeStats(CascadeStats& stats) = 0;
+
+  /**
+   * Load the templates of the people expected in an upcoming window into the hot tier of
+   * TierParam, e.g. the work group roster of a shift some minutes before it starts, so that the
+   * rush at its start is served without a search of the whole gallery. The roster is kept as
+   * one block ahead of the ids matched before, which fill the rest of the tier. Ids that are not
+   * in the gallery or do not fit into TierParam::hot_capacity are left out.
+   *
+   * @param[in] features_ids expected ids, the most likely first.
+   *
+   * @return Zero on success, kInvalidArguments without a hot tier.
+   */
+  virtual int PrefetchIds(const std::vector<int>& features_ids) = 0;
+
+  /**
+   * Get the counters of the hot tier since the PalmCompare was created, see TierParam.
+   *
+   * @param[out] stats hit counts, hot_hits / queries is the hit rate of the site.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int GetTierStats(TierStats& stats) = 0;
+
+  /**
+   * Get the number of templates in the gallery.
+   *
+   * @return Number of templates.
+   */
+  virtual size_t GetFeaturesCount() = 0;
+};
+
+// Galleries of several tenants on one matcher, e.g. schools sharing a server, keyed by the
+// company_id of PalmClient::CreatePalmClient(). Each tenant has a PalmCompare of its own with its
+// own index type and memory budget, so a query scans only the templates of its tenant.
+class TenantCompare {
+ public:
+  virtual ~TenantCompare() = default;
+
+  /**
+   * Create a matcher without tenants.
+   *
+   * @param[out] tenants shared_ptr point to Object TenantCompare.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  static int Create(std::shared_ptr<TenantCompare>* tenants);
+
+  /**
+   * Add the gallery of a tenant.
+   *
+   * @param[in] company_id tenant of PalmClient::CreatePalmClient().
+   *
+   * @param[in] config configuration of its gallery, see PalmCompare::Create().
+   *
+   * @return Zero on success, kCompareIdExists if the tenant exists, error code of
+   *         PalmCompare::Create() otherwise.
+   */
+  virtual int AddTenant(const std::string& company_id, const CompareConfig& config) = 0;
+
+  /**
+   * Drop the gallery of a tenant. Callers that still hold it may finish with it.
+   *
+   * @param[in] company_id tenant of AddTenant().
+   *
+   * @return Zero on success, kCompareIdNotFound for an unknown tenant.
+   */
+  virtual int RemoveTenant(const std::string& company_id) = 0;
+
+  /**
+   * Route to the gallery of a tenant, every call on it enrolls or searches that tenant alone.
+   * The lookup is cheap, yet callers serving one tenant may keep the result.
+   *
+   * @param[in] company_id tenant of AddTenant().
+   *
+   * @param[out] compare gallery of the tenant.
+   *
+   * @return Zero on success, kCompareIdNotFound for an unknown tenant.
+   */
+  virtual int GetTenant(const std::string& company_id,
+                        std::shared_ptr<PalmCompare>* compare) = 0;
+
+  /**
+   * Get the company ids of the tenants.
+   *
+   * @param[out] company_ids sorted tenants.
+   *
+   * @return Zero on success, error code otherwise.
+   */
+  virtual int GetTenants(std::vector<std::string>& company_ids) = 0;
+};
+
+/**
+ * Convert the features of a CapturePalmResult to a float vector.
+ *
+ * @param[in] data ir_features or rgb_features of CapturePalmResult.
+ *
+ * @param[out] features feature vector.
+ *
+ * @return Zero on success, error code otherwise.
+ */
+int StreamDataToFeatures(const StreamData& data, std::vector<float>& features);
+
+/**
+ * Train the IVF-PQ codebooks offline and write them to config.ivf_pq.codebook_file. With
+ * config.projection.file set, the codebooks are trained on the projected samples.
+ *
+ * @param[in] config recog_mode, metric, dims, projection and ivf_pq of the galleries that will
+ *            use them.
+ *
+ * @param[in] ir_samples enrolled ir features, at least max(nlist, 256) of them.
+ *
+ * @param[in] rgb_samples enrolled rgb features of the same templates.
+ *
+ * @return Zero on success, error code otherwise.
+ */
+int TrainIvfPq(const CompareConfig& config,
+               const std::vector<std::vector<float>>& ir_samples,
+               const std::vector<std::vector<float>>& rgb_samples);
+
+/**
+ * Train the principal component projection offline and write it to config.projection.file.
+ * Measure the accuracy of each target length on the own enrollment set before deploying it,
+ * e.g. with samples/src/compare_tool.
+ *
+ * @param[in] config recog_mode, metric, dims and projection of the galleries that will use it.
+ *
+ * @param[in] ir_samples enrolled ir features, more than projection.ir_dim of them.
+ *
+ * @param[in] rgb_samples enrolled rgb features of the same templates.
+ *
+ * @return Zero on success, error code otherwise.
+ */
+int TrainProjection(const CompareConfig& config,
+                    const std::vector<std::vector<float>>& ir_samples,
+                    const std::vector<std::vector<float>>& rgb_samples);
+
+/**
+ * Read the cores pinned by the cpu_list entries of a models config such as
+ * palm_models_config.pbtxt, meant for ScanThreadParam::excluded_cpus.
+ *
+ * @param[in] models_config path of the pbtxt file.
+ *
+ * @param[out] cpus sorted cores, without duplicates.
+ *
+ * @return Zero on success, error code otherwise.
+ */
+int LoadModelCpuList(const std::string& models_config, std::vector<int>& cpus);
+
+}  // namespace StreamPalm
+#endif  // STREAM_INCLUDE_COMPARE_ARITHMETIC_H_
@@ -0,0 +1,167 @@
+// Accuracy and latency of the local gallery per projected feature length, on an own enrollment
+// set. The first template of every features id is enrolled, the others are the probes, and the
+// projection is trained on the enrolled templates.
+//
+//   compare_tool <templates> <ir_dim> <rgb_dim> <dim>... [whiten]
+//
+// templates holds [int32 features_id][ir_dim floats][rgb_dim floats] records, the layout of a
+// CompareConfig::rerank_file. A zero ir_dim or rgb_dim compares the other modality alone. The
+// projection of each dim is kept as projection_<dim>.bin, ready for ProjectionParam::file.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "palm/compare_arithmetic.h"
+
+using namespace StreamPalm;
+
+namespace {
+
+struct Templates {
+  std::vector<int> ids;
+  std::vector<std::vector<float>> ir;
+  std::vector<std::vector<float>> rgb;
+};
+
+struct Result {
+  double accuracy{0.0};  // Probes whose top-1 is their own features id.
+  double agreement{0.0};  // Probes whose top-1 is that of the full length features.
+  double query_us{0.0};
+  std::vector<int> top1;
+};
+
+bool ReadTemplates(const char* path, size_t ir_dim, size_t rgb_dim, Templates& templates) {
+  std::FILE* file = std::fopen(path, "rb");
+  if (!file)
+    return false;
+  int32_t id;
+  while (std::fread(&id, sizeof(id), 1, file) == 1) {
+    std::vector<float> ir(ir_dim);
+    std::vector<float> rgb(rgb_dim);
+    if (std::fread(ir.data(), sizeof(float), ir_dim, file) != ir_dim ||
+        std::fread(rgb.data(), sizeof(float), rgb_dim, file) != rgb_dim)
+      break;
+    templates.ids.push_back(id);
+    templates.ir.push_back(std::move(ir));
+    templates.rgb.push_back(std::move(rgb));
+  }
+  std::fclose(file);
+  return !templates.ids.empty();
+}
+
+void AppendTemplate(const Templates& from, size_t i, Templates& to) {
+  to.ids.push_back(from.ids[i]);
+  to.ir.push_back(from.ir[i]);
+  to.rgb.push_back(from.rgb[i]);
+}
+
+int Evaluate(const CompareConfig& config, const Templates& gallery, const Templates& probes,
+             const std::vector<int>* reference, Result& result) {
+  std::shared_ptr<PalmCompare> compare;
+  int ret = PalmCompare::Create(config, &compare);
+  if (ret)
+    return ret;
+  for (size_t i = 0; i < gallery.ids.size(); ++i) {
+    ret = compare->AddFeatures(gallery.ids[i], gallery.ir[i], gallery.rgb[i]);
+    if (ret)
+      return ret;
+  }
+  size_t correct = 0;
+  size_t agree = 0;
+  std::vector<CompareCandidate> candidates;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < probes.ids.size(); ++i) {
+    ret = compare->QueryTopK(probes.ir[i], probes.rgb[i], 1, candidates);
+    if (ret)
+      return ret;
+    int top1 = candidates.empty() ? -1 : candidates[0].features_id;
+    result.top1.push_back(top1);
+    correct += top1 == probes.ids[i];
+    agree += reference && top1 == (*reference)[i];
+  }
+  double elapsed = std::chrono::duration<double, std::micro>(
+      std::chrono::steady_clock::now() - start).count();
+  result.accuracy = static_cast<double>(correct) / probes.ids.size();
+  result.agreement = reference ? static_cast<double>(agree) / probes.ids.size() : 1.0;
+  result.query_us = elapsed / probes.ids.size();
+  return kOk;
+}
+
+void PrintResult(const char* name, size_t ir_dim, size_t rgb_dim, const Result& result) {
+  std::printf("%-8s %6zu %6zu %10zu %9.2f%% %9.2f%% %10.1f\n", name, ir_dim, rgb_dim,
+              (ir_dim + rgb_dim) * sizeof(float), result.accuracy * 100.0,
+              result.agreement * 100.0, result.query_us);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 5) {
+    std::printf("usage: %s <templates> <ir_dim> <rgb_dim> <dim>... [whiten]\n", argv[0]);
+    return 1;
+  }
+  size_t ir_dim = std::strtoul(argv[2], nullptr, 10);
+  size_t rgb_dim = std::strtoul(argv[3], nullptr, 10);
+  bool whiten = std::strcmp(argv[argc - 1], "whiten") == 0;
+  int dims_end = whiten ? argc - 1 : argc;
+  if (!ir_dim && !rgb_dim) {
+    std::printf("ir_dim and rgb_dim are both zero\n");
+    return 1;
+  }
+  Templates templates;
+  if (!ReadTemplates(argv[1], ir_dim, rgb_dim, templates)) {
+    std::printf("no templates in %s\n", argv[1]);
+    return 1;
+  }
+  Templates gallery;
+  Templates probes;
+  std::unordered_set<int> enrolled;
+  for (size_t i = 0; i < templates.ids.size(); ++i) {
+    if (enrolled.insert(templates.ids[i]).second)
+      AppendTemplate(templates, i, gallery);
+    else
+      AppendTemplate(templates, i, probes);
+  }
+  if (probes.ids.empty()) {
+    std::printf("every features id has a single template, nothing to query\n");
+    return 1;
+  }
+  std::printf("%zu enrolled, %zu probes\n", gallery.ids.size(), probes.ids.size());
+
+  CompareConfig config;
+  config.recog_mode = !rgb_dim ? kRegIrVSIr : !ir_dim ? kRegRgbVSRgb : kBiModal;
+  config.ir_dim = static_cast<uint32_t>(ir_dim);
+  config.rgb_dim = static_cast<uint32_t>(rgb_dim);
+  config.reserve = static_cast<uint32_t>(gallery.ids.size());
+  std::printf("%-8s %6s %6s %10s %10s %10s %10s\n", "dims", "ir", "rgb", "bytes/tpl",
+              "accuracy", "agreement", "query_us");
+  Result full;
+  int ret = Evaluate(config, gallery, probes, nullptr, full);
+  if (ret) {
+    std::printf("full length evaluation failed, ret = %#x\n", ret);
+    return 1;
+  }
+  PrintResult("full", ir_dim, rgb_dim, full);
+
+  for (int arg = 4; arg < dims_end; ++arg) {
+    uint32_t dim = static_cast<uint32_t>(std::strtoul(argv[arg], nullptr, 10));
+    CompareConfig projected = config;
+    projected.projection.file = std::string("projection_") + argv[arg] + ".bin";
+    projected.projection.ir_dim = ir_dim ? dim : 0;
+    projected.projection.rgb_dim = rgb_dim ? dim : 0;
+    projected.projection.whiten = whiten;
+    ret = TrainProjection(projected, gallery.ir, gallery.rgb);
+    Result result;
+    if (!ret)
+      ret = Evaluate(projected, gallery, probes, &full.top1, result);
+    if (ret) {
+      std::printf("%-8s failed, ret = %#x\n", argv[arg], ret);
+      continue;
+    }
+    PrintResult(argv[arg], projected.projection.ir_dim, projected.projection.rgb_dim, result);
+  }
+  return 0;
+}
@@ -3,10 +3,15 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include "frame_rate_helper.h"
 #include "palm/arithmetic_device.h"
 namespace StreamPalm {
 
+static const char kModelsConfig[] = "../config/palm_models_config.pbtxt";
+static const char kGalleryFile[] = "local_gallery.bin";
+static const char kGalleryLog[] = "local_gallery.log";
+
 void FrameDeleter(Frame* frame) {
   if (frame) {
     // 释放 Frame 对象中的 data 内存
@@ -154,8 +159,24 @@ int PalmDevice::Create() {
   device_ = Device;
 
   int ret = PalmCapture::Create(device_, &palm_);
-
-  return ret;
+  if (ret)
+    return ret;
+
+  CompareConfig compare_config;
+  compare_config.recog_mode = mode_;
+  compare_config.palm_type.partition = true;
+  compare_config.geometry.enable = true;
+  compare_config.journal.snapshot_file = kGalleryFile;
+  compare_config.journal.log_file = kGalleryLog;
+  // The regulars of the site are matched without a scan of the whole gallery.
+  compare_config.tier.hot_capacity = 512;
+  // The frames of a hand held over the sensor are searched once.
+  compare_config.probe_cache.entries = 4;
+  // Scan the gallery on the cores the models are not pinned to.
+  compare_config.scan.threads = std::thread::hardware_concurrency();
+  if (LoadModelCpuList(kModelsConfig, compare_config.scan.excluded_cpus))
+    std::cout << "[Test] " << kModelsConfig << " not found, scan on every core" << std::endl;
+  return PalmCompare::Create(compare_config, &compare_);
 }
 
 void PalmDevice::Open() {
@@ -166,6 +187,17 @@ void PalmDevice::Open() {
   }
   device_->Open();
   is_open_ = true;
+  if (!palm_ || !compare_) {
+    std::cout << "[Test] Palm capture or compare not created, gallery not loaded" << std::endl;
+    return;
+  }
+  // Serve the templates registered before the last restart, once, a reopen keeps them.
+  std::string model_version;
+  int ret = palm_->GetAlgorithmVersion(model_version);
+  if (!ret)
+    ret = compare_->OpenJournal(model_version);
+  std::cout << "OpenJournal, ret: " << ret << " gallery size: " << compare_->GetFeaturesCount()
+            << std::endl;
 }
 
 void PalmDevice::Start() {
@@ -534,4 +566,139 @@ void PalmDevice::QueryFeaturesIdFromServer() {
   std::cout << "features_id: " << features_id << std::endl;
 }
 
+int PalmDevice::ExtractFeaturesFromInputImg(std::vector<float>& ir_features,
+                                            std::vector<float>& rgb_features,
+                                            std::vector<float>& skeleton,
+                                            int& palm_type) {
+  std::string ir_img_path;
+  std::string rgb_img_path;
+  int result;
+  float score;
+  std::shared_ptr<Frame> palm_ir_img(new Frame(), FrameDeleter);
+  std::shared_ptr<Frame> palm_rgb_img(new Frame(), FrameDeleter);
+  std::cout << "input picture path of ir_img" << std::endl;
+  std::cin >> ir_img_path;
+  int ret = ReadJpgImageToFrame(ir_img_path, palm_ir_img);
+  if (mode_ == StreamPalm::kBiModal) {
+    std::cout << "input picture path of rgb_img" << std::endl;
+    std::cin >> rgb_img_path;
+    ret = ReadJpgImageToFrame(rgb_img_path, palm_rgb_img);
+  }
+  if (ret)
+    return ret;
+  return palm_->ExtractPalmFeaturesFromImg(result,
+                                           score,
+                                           ir_features,
+                                           rgb_features,
+                                           skeleton,
+                                           palm_type,
+                                           mode_,
+                                           *palm_ir_img,
+                                           *palm_rgb_img);
+}
+
+void PalmDevice::RegisterToLocal() {
+  if (!is_open_) {
+    std::cout << "[Test] open device first" << std::endl;
+    return;
+  };
+  std::vector<float> ir_features;
+  std::vector<float> rgb_features;
+  std::vector<float> skeleton;
+  int palm_type;
+  int ret = ExtractFeaturesFromInputImg(ir_features, rgb_features, skeleton, palm_type);
+  if (ret) {
+    std::cout << "Extract PalmFeatures For Img failure !, ret: " << ret << std::endl;
+    return;
+  }
+  int features_id;
+  std::cout << "input features_id :" << std::endl;
+  std::cin >> features_id;
+  ret = compare_->AddFeaturesWithSkeleton(features_id, palm_type, ir_features, rgb_features,
+                                          skeleton);
+  std::cout << "RegisterToLocal, ret: " << ret << " gallery size: " << compare_->GetFeaturesCount()
+            << std::endl;
+}
+
+void PalmDevice::QueryFeaturesIdFromLocal() {
+  if (!is_open_) {
+    std::cout << "[Test] open device first" << std::endl;
+    return;
+  };
+  int ret = compare_->LoadRecognitionThreshold(palm_);
+  if (ret) {
+    std::cout << "GetRecognitionThreshold failure !, ret: " << ret << std::endl;
+    return;
+  }
+  std::vector<float> ir_features;
+  std::vector<float> rgb_features;
+  std::vector<float> skeleton;
+  int palm_type;
+  ret = ExtractFeaturesFromInputImg(ir_features, rgb_features, skeleton, palm_type);
+  if (ret) {
+    std::cout << "Extract PalmFeatures For Img failure !, ret: " << ret << std::endl;
+    return;
+  }
+  int features_id;
+  float score;
+  auto start_time = std::chrono::steady_clock::now();
+  ret = compare_->QueryFeaturesIdWithSkeleton(ir_features, rgb_features, palm_type, skeleton,
+                                              features_id, score);
+  auto need_time = (std::chrono::steady_clock::now() - start_time).count();
+  std::cout << "QueryFeaturesIdFromLocal, ret: " << ret << " features_id: " << features_id
+            << " score: " << score << " [" << need_time / 1000 << " us]" << std::endl;
+  TierStats stats;
+  if (!compare_->GetTierStats(stats) && stats.queries)
+    std::cout << "hot tier hit rate: " << stats.hot_hits * 100 / stats.queries << "% of "
+              << stats.queries << " queries" << std::endl;
+}
+
+void PalmDevice::BindCard() {
+  std::string card_uid;
+  int features_id;
+  std::cout << "input card uid :" << std::endl;
+  std::cin >> card_uid;
+  std::cout << "input features_id :" << std::endl;
+  std::cin >> features_id;
+  int ret = kAccessToNullPointer;
+  if (compare_)
+    ret = compare_->BindCard(card_uid, features_id);
+  std::cout << "BindCard, ret: " << ret << std::endl;
+}
+
+void PalmDevice::VerifyCardFromLocal() {
+  if (!is_open_) {
+    std::cout << "[Test] open device first" << std::endl;
+    return;
+  };
+  if (!compare_) {
+    std::cout << "VerifyCard, ret: " << kAccessToNullPointer << std::endl;
+    return;
+  }
+  int ret = compare_->LoadRecognitionThreshold(palm_);
+  if (ret) {
+    std::cout << "GetRecognitionThreshold failure !, ret: " << ret << std::endl;
+    return;
+  }
+  // The uid the card reader reported, e.g. the "uid" of rfid-reader's output.
+  std::string card_uid;
+  std::cout << "input card uid :" << std::endl;
+  std::cin >> card_uid;
+  std::vector<float> ir_features;
+  std::vector<float> rgb_features;
+  std::vector<float> skeleton;
+  int palm_type;
+  ret = ExtractFeaturesFromInputImg(ir_features, rgb_features, skeleton, palm_type);
+  if (ret) {
+    std::cout << "Extract PalmFeatures For Img failure !, ret: " << ret << std::endl;
+    return;
+  }
+  float score;
+  auto start_time = std::chrono::steady_clock::now();
+  ret = compare_->VerifyCard(card_uid, ir_features, rgb_features, score);
+  auto need_time = (std::chrono::steady_clock::now() - start_time).count();
+  std::cout << "VerifyCardFromLocal, ret: " << ret << " score: " << score << " ["
+            << need_time / 1000 << " us]" << std::endl;
+}
+
 }  // namespace StreamPalm
\ No newline at end of file
@@ -32,6 +32,11 @@ class PalmDevice {
   void DeleteID();
   void QueryFeaturesIdFromServer();
 
+  void RegisterToLocal();
+  void QueryFeaturesIdFromLocal();
+  void BindCard();
+  void VerifyCardFromLocal();
+
   void SetAlgorithemMode(StreamPalm::RecognizeMode mode);
 
  private:
@@ -52,6 +57,12 @@ class PalmDevice {
   bool enable_contious_capture_ = false;
   StreamPalm::RecognizeMode mode_;
   std::shared_ptr<StreamPalm::PalmClient> client_;
+  std::shared_ptr<StreamPalm::PalmCompare> compare_;
+
+  int ExtractFeaturesFromInputImg(std::vector<float>& ir_features,
+                                  std::vector<float>& rgb_features,
+                                  std::vector<float>& skeleton,
+                                  int& palm_type);
 };
 
 }  // namespace StreamPalm
\ No newline at end of file
@@ -35,6 +35,10 @@ void PrintMenu() {
   std::cout << "2: Register to server." << std::endl;
   std::cout << "3: Delete ID." << std::endl;
   std::cout << "4: Query featuresId from server." << std::endl;
+  std::cout << "5: Register to local gallery." << std::endl;
+  std::cout << "6: Query featuresId from local gallery." << std::endl;
+  std::cout << "7: Bind card to featuresId." << std::endl;
+  std::cout << "8: Verify card and palm against local gallery." << std::endl;
   std::cout << "--------------------------------------------------------------------" << std::endl;
 }
 std::shared_ptr<StreamPalm::PalmDevice> palm_device = nullptr;
@@ -143,6 +147,18 @@ int main() {
       case '4':
         palm_device->QueryFeaturesIdFromServer();
         break;
+      case '5':
+        palm_device->RegisterToLocal();
+        break;
+      case '6':
+        palm_device->QueryFeaturesIdFromLocal();
+        break;
+      case '7':
+        palm_device->BindCard();
+        break;
+      case '8':
+        palm_device->VerifyCardFromLocal();
+        break;
       case 'p':
         PrintMenu();
         break;
@@ -0,0 +1,140 @@
+#ifndef PALM_COMPARE_ALIGNED_BUFFER_H_
+#define PALM_COMPARE_ALIGNED_BUFFER_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#if _WIN32
+#include <malloc.h>
+#endif
+
+namespace StreamPalm {
+
+// Cache line size, every feature row starts on its own line.
+constexpr size_t kFeatureAlignment = 64;
+
+inline void* AlignedMalloc(size_t size) {
+  if (size == 0)
+    return nullptr;
+#if _WIN32
+  return _aligned_malloc(size, kFeatureAlignment);
+#else
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, kFeatureAlignment, size) != 0)
+    return nullptr;
+  return ptr;
+#endif
+}
+
+inline void AlignedFree(void* ptr) {
+#if _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+// Growable, zero initialized, 64-byte aligned array of trivially copyable elements. It may
+// instead borrow writable memory it does not own, e.g. a copy-on-write file mapping, until it
+// grows past it.
+template<class T>
+class AlignedBuffer {
+ public:
+  AlignedBuffer() = default;
+  explicit AlignedBuffer(size_t size) { Resize(size); }
+  AlignedBuffer(const AlignedBuffer& other) { *this = other; }
+  AlignedBuffer(AlignedBuffer&& other) noexcept { Swap(other); }
+  ~AlignedBuffer() { Release(); }
+
+  AlignedBuffer& operator=(const AlignedBuffer& other) {
+    if (this != &other) {
+      Resize(0);
+      Resize(other.size_);
+      if (other.size_)
+        std::memcpy(data_, other.data_, other.size_ * sizeof(T));
+    }
+    return *this;
+  }
+  AlignedBuffer& operator=(AlignedBuffer&& other) noexcept {
+    Swap(other);
+    return *this;
+  }
+
+  void Swap(AlignedBuffer& other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(owned_, other.owned_);
+  }
+
+  // Use size elements at data in place, 64-byte aligned. data must outlive the buffer or the
+  // next growth past size, which copies the elements into memory of its own.
+  void Borrow(T* data, size_t size) {
+    Release();
+    data_ = data;
+    size_ = size;
+    capacity_ = size;
+    owned_ = false;
+  }
+
+  // Copy borrowed elements into memory of its own.
+  void Own() {
+    if (owned_)
+      return;
+    size_t capacity = capacity_;
+    capacity_ = 0;
+    if (capacity)
+      Reserve(capacity);
+    else
+      data_ = nullptr;
+    owned_ = true;
+  }
+
+  void Reserve(size_t capacity) {
+    if (capacity <= capacity_)
+      return;
+    T* data = static_cast<T*>(AlignedMalloc(capacity * sizeof(T)));
+    if (!data)
+      throw std::bad_alloc();
+    std::memset(data, 0, capacity * sizeof(T));
+    if (size_)
+      std::memcpy(data, data_, size_ * sizeof(T));
+    Release();
+    data_ = data;
+    capacity_ = capacity;
+    owned_ = true;
+  }
+
+  // New elements are zero, shrinking zeroes the released tail so it can be reused as padding.
+  void Resize(size_t size) {
+    if (size > capacity_)
+      Reserve(size > capacity_ * 2 ? size : capacity_ * 2);
+    if (size < size_)
+      std::memset(data_ + size, 0, (size_ - size) * sizeof(T));
+    size_ = size;
+  }
+
+  T* data() { return data_; }
+  const T* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  T& operator[](size_t i) { return data_[i]; }
+  const T& operator[](size_t i) const { return data_[i]; }
+
+ private:
+  void Release() {
+    if (owned_)
+      AlignedFree(data_);
+    data_ = nullptr;
+  }
+
+  T* data_{nullptr};
+  size_t size_{0};
+  size_t capacity_{0};
+  bool owned_{true};
+};
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_ALIGNED_BUFFER_H_
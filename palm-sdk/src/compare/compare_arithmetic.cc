@@ -0,0 +1,2086 @@
+#include "palm/compare_arithmetic.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include "feature_file_store.h"
+#include "feature_gallery.h"
+#include "feature_projection.h"
+#include "gallery_journal.h"
+#include "hnsw_index.h"
+#include "hot_tier.h"
+#include "ivf_pq_index.h"
+#include "palm_geometry.h"
+#include "scan_thread_pool.h"
+
+namespace StreamPalm {
+
+namespace {
+
+// Shards of a parallel scan are whole scan blocks.
+constexpr size_t kMinShardRows = 256;
+
+// Template bytes a deadline-bounded search compares between two looks at the clock, a fraction
+// of a millisecond.
+constexpr size_t kDeadlineBlockBytes = 4u << 20;
+
+// Palm type of a template or probe that was not given one.
+constexpr int kAnyPalmType = -1;
+
+// Rows [begin, end) of the gallery that a flat search compares, a palm type partition or all.
+struct RowRange {
+  size_t begin;
+  size_t end;
+};
+
+// The gallery and its index, what queries search. PalmCompareImpl keeps two of them with
+// CompareConfig::hot_swap.
+struct GalleryVersion {
+  GalleryVersion(CompareMetric metric, FeatureStorage storage) : gallery(metric, storage) {}
+
+  FeatureGallery gallery;
+  std::unique_ptr<HnswIndex> hnsw;
+  std::unique_ptr<IvfPqIndex> ivf_pq;
+};
+
+// What a query reads, fixed when it starts: the version it searches, which no change touches
+// while the query holds it, and the thresholds. Also what CascadeSearch() covered of the
+// query, see CountCascade().
+struct QueryState {
+  const FeatureGallery& gallery() const { return version->gallery; }
+  const HnswIndex* hnsw() const { return version->hnsw.get(); }
+  const IvfPqIndex* ivf_pq() const { return version->ivf_pq.get(); }
+
+  std::shared_ptr<const GalleryVersion> version;
+  // Held on the single version of a gallery without hot_swap, which changes in place.
+  std::shared_lock<std::shared_timed_mutex> lock;
+  float thresholds[kChannelCount]{0.0f, 0.0f};
+  bool has_thresholds{false};
+  std::vector<RowRange> cascade_ranges;
+  uint64_t cascade_survivors{0};
+};
+
+// Deleter of the pin of a published version, which the queries copy: marks the version unused
+// once the last query that holds the pin is done, and deletes nothing.
+struct Unpin {
+  void operator()(const GalleryVersion*) const { unused->store(true, std::memory_order_release); }
+
+  std::atomic<bool>* unused;
+};
+
+// A probe of a recent match, see ProbeCacheParam.
+struct CachedProbe {
+  std::vector<float> features[kChannelCount];  // By modality, as given.
+  int features_id;
+  float score;
+  std::chrono::steady_clock::time_point time;
+};
+
+// Cosine similarity of features as given, -1 when the lengths differ.
+float FeatureSimilarity(const std::vector<float>& a, const std::vector<float>& b) {
+  if (a.size() != b.size() || a.empty())
+    return -1.0f;
+  double dot = 0.0;
+  double a_sq = 0.0;
+  double b_sq = 0.0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    dot += a[i] * b[i];
+    a_sq += a[i] * a[i];
+    b_sq += b[i] * b[i];
+  }
+  if (a_sq <= 0.0 || b_sq <= 0.0)
+    return -1.0f;
+  return static_cast<float>(dot / std::sqrt(a_sq * b_sq));
+}
+
+// Probe modality compared against each gallery channel, -1 if the channel is unused.
+void GetModeChannels(RecognizeMode mode, int probe_for[kChannelCount]) {
+  probe_for[kIrChannel] = -1;
+  probe_for[kRgbChannel] = -1;
+  switch (mode) {
+    case kRegIrVSIr:
+      probe_for[kIrChannel] = kIrChannel;
+      break;
+    case kRegIrVSRgb:
+      probe_for[kIrChannel] = kRgbChannel;
+      break;
+    case kRegRgbVSIr:
+      probe_for[kRgbChannel] = kIrChannel;
+      break;
+    case kRegRgbVSRgb:
+      probe_for[kRgbChannel] = kRgbChannel;
+      break;
+    case kBiModal:
+    default:
+      probe_for[kIrChannel] = kIrChannel;
+      probe_for[kRgbChannel] = kRgbChannel;
+      break;
+  }
+}
+
+// RegisterPalm() hashes are opaque strings: a '0'/'1' string is packed bit by bit, a hex string
+// nibble by nibble and anything else byte by byte.
+void PackHashBits(const std::string& hash, std::vector<uint64_t>& words, size_t& bits) {
+  bool binary = true;
+  bool hex = true;
+  for (char ch : hash) {
+    binary = binary && (ch == '0' || ch == '1');
+    hex = hex && std::isxdigit(static_cast<unsigned char>(ch));
+  }
+  size_t width = binary ? 1 : hex ? 4 : 8;
+  bits = hash.size() * width;
+  words.assign((bits + 63) / 64, 0);
+  for (size_t i = 0; i < hash.size(); ++i) {
+    uint64_t value = static_cast<unsigned char>(hash[i]);
+    if (binary)
+      value = hash[i] - '0';
+    else if (hex)
+      value = std::isdigit(static_cast<unsigned char>(hash[i])) ?
+              hash[i] - '0' : std::tolower(static_cast<unsigned char>(hash[i])) - 'a' + 10;
+    for (size_t b = 0; b < width; ++b) {
+      size_t bit = i * width + b;
+      if (value >> (width - 1 - b) & 1)
+        words[bit / 64] |= 1ull << (bit % 64);
+    }
+  }
+}
+
+class PalmCompareImpl : public PalmCompare {
+ public:
+  explicit PalmCompareImpl(const CompareConfig& config) : config_(config) {
+    versions_[0] = std::make_shared<GalleryVersion>(config.metric, config.storage);
+    if (config_.hot_swap)
+      versions_[1] = std::make_shared<GalleryVersion>(config.metric, config.storage);
+    unused_[1].store(true);
+    Publish(0);
+    GetModeChannels(config_.recog_mode, probe_for_);
+    bool bimodal = probe_for_[kIrChannel] >= 0 && probe_for_[kRgbChannel] >= 0;
+    weight_[kIrChannel] = bimodal ? config_.ir_weight : 1.0f;
+    weight_[kRgbChannel] = bimodal ? 1.0f - config_.ir_weight : 1.0f;
+    prefilter_ = config_.hamming.candidates && config_.index_type == CompareIndexType::kFlat;
+    cascade_ = config_.cascade.enable && bimodal &&
+               config_.index_type == CompareIndexType::kFlat;
+    early_exit_ = (config_.early_exit.prune || config_.early_exit.accept_first) &&
+                  config_.index_type == CompareIndexType::kFlat;
+    fusion_ = config_.fusion != TemplateFusion::kNone;
+    geometry_ = config_.geometry.enable && config_.index_type == CompareIndexType::kFlat;
+    std::vector<int> cpus =
+        ScanThreadPool::AllowedCpus(config_.scan.cpus, config_.scan.excluded_cpus);
+    size_t threads = std::min<size_t>(config_.scan.threads, cpus.size());
+    if (threads)
+      pool_.reset(new ScanThreadPool(threads, cpus));
+    if (config_.tier.hot_capacity)
+      hot_.reset(new HotTier(config.metric, config.storage, config_.tier.hot_capacity));
+  }
+
+  ~PalmCompareImpl() override {
+    if (!follower_.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(follow_mutex_);
+      stop_following_ = true;
+    }
+    follow_wake_.notify_all();
+    follower_.join();
+  }
+
+  int Init() {
+    if (!config_.projection.file.empty()) {
+      std::unique_ptr<FeatureProjection> projection(new FeatureProjection(config_.metric));
+      int ret = projection->Load(config_.projection.file);
+      if (ret)
+        return ret;
+      for (int c = 0; c < kChannelCount; ++c) {
+        if (probe_for_[c] >= 0 && !projection->out_dim(c))
+          return kCompareDimensionMismatch;
+      }
+      projection_ = std::move(projection);
+    }
+    if (config_.ir_dim || config_.rgb_dim) {
+      return Update([this](GalleryVersion& version, bool first) {
+        return InitGallery(version, config_.ir_dim, config_.rgb_dim, first);
+      });
+    }
+    return kOk;
+  }
+
+  int SetRecognitionThreshold(float ir_threshold, float rgb_threshold) override {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    thresholds_[kIrChannel] = ir_threshold;
+    thresholds_[kRgbChannel] = rgb_threshold;
+    has_thresholds_ = true;
+    // Accepted under the old thresholds.
+    probe_cache_.clear();
+    return kOk;
+  }
+
+  int LoadRecognitionThreshold(std::shared_ptr<PalmCapture> palm) override {
+    if (!palm)
+      return kAccessToNullPointer;
+    float ir_threshold = 0.0f;
+    float rgb_threshold = 0.0f;
+    int ret = palm->GetRecognitionThreshold(ir_threshold, rgb_threshold, config_.recog_mode);
+    if (ret)
+      return ret;
+    return SetRecognitionThreshold(ir_threshold, rgb_threshold);
+  }
+
+  int AddFeatures(int features_id,
+                  const std::vector<float>& ir_features,
+                  const std::vector<float>& rgb_features) override {
+    const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+    return AddTemplate(features_id, ir_features, rgb_features, hashes, kAnyPalmType, nullptr);
+  }
+
+  int AddFeaturesWithHash(int features_id,
+                          const std::vector<float>& ir_features,
+                          const std::vector<float>& rgb_features,
+                          const std::string& hash_ir,
+                          const std::string& hash_rgb) override {
+    const std::string* hashes[kChannelCount] = {&hash_ir, &hash_rgb};
+    return AddTemplate(features_id, ir_features, rgb_features, hashes, kAnyPalmType, nullptr);
+  }
+
+  int AddFeaturesWithPalmType(int features_id,
+                              int palm_type,
+                              const std::vector<float>& ir_features,
+                              const std::vector<float>& rgb_features) override {
+    if (palm_type != 0 && palm_type != 1)
+      return kInvalidArguments;
+    const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+    return AddTemplate(features_id, ir_features, rgb_features, hashes, palm_type, nullptr);
+  }
+
+  int AddFeaturesWithSkeleton(int features_id,
+                              int palm_type,
+                              const std::vector<float>& ir_features,
+                              const std::vector<float>& rgb_features,
+                              const std::vector<float>& skeleton) override {
+    if (palm_type != 0 && palm_type != 1 && palm_type != kAnyPalmType)
+      return kInvalidArguments;
+    const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+    return AddTemplate(features_id, ir_features, rgb_features, hashes, palm_type, &skeleton);
+  }
+
+  int DeleteID(const int& features_id) override {
+    std::unique_lock<std::mutex> lock(write_mutex_);
+    // A followed gallery is read-only, it changes in the process that publishes it.
+    if (following_)
+      return kInvalidArguments;
+    int ret = Update([features_id](GalleryVersion& version, bool) {
+      size_t row = 0;
+      if (!version.gallery.FindRow(features_id, row))
+        return static_cast<int>(kCompareIdNotFound);
+      if (version.hnsw)
+        version.hnsw->Remove(version.gallery, row);
+      if (version.ivf_pq)
+        version.ivf_pq->Remove(version.gallery, row);
+      return version.gallery.Remove(features_id);
+    });
+    if (ret)
+      return ret;
+    // Once no query can come across the id any more.
+    {
+      std::lock_guard<std::mutex> store_lock(store_mutex_);
+      rerank_store_.Erase(features_id);
+    }
+    if (hot_) {
+      std::lock_guard<std::mutex> hot_lock(hot_mutex_);
+      hot_->Remove(features_id);
+    }
+    {
+      std::lock_guard<std::mutex> state_lock(state_mutex_);
+      probe_cache_.erase(std::remove_if(probe_cache_.begin(), probe_cache_.end(),
+                                        [features_id](const CachedProbe& entry) {
+                                          return entry.features_id == features_id;
+                                        }),
+                         probe_cache_.end());
+    }
+    if (!journal_)
+      return kOk;
+    uint64_t sequence = journal_->AppendDelete(features_id);
+    lock.unlock();
+    return CommitJournal(sequence);
+  }
+
+  int SaveGallery(const std::string& path, const std::string& model_version) override {
+    if (config_.index_type == CompareIndexType::kIvfPq || !config_.rerank_file.empty())
+      return kInvalidArguments;
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (!gallery().IsInitialized())
+      return kCompareEmptyGallery;
+    return SaveSnapshot(path, GalleryKey(model_version), 0);
+  }
+
+  int LoadGallery(const std::string& path, const std::string& model_version) override {
+    if (config_.index_type == CompareIndexType::kIvfPq || !config_.rerank_file.empty())
+      return kInvalidArguments;
+    // Mapped and verified before the lock, queries go on meanwhile.
+    std::unique_ptr<FeatureGallery> loaded[2];
+    int ret = LoadVersions(path, GalleryKey(model_version), nullptr, loaded);
+    if (ret)
+      return ret;
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    // The journal would not know about the replaced gallery.
+    if (journal_ || following_)
+      return kInvalidArguments;
+    return InstallGallery(loaded);
+  }
+
+  int FollowGallery(const std::string& path, const std::string& model_version,
+                    uint32_t poll_ms) override {
+    if (config_.index_type == CompareIndexType::kIvfPq || !config_.rerank_file.empty() ||
+        !poll_ms)
+      return kInvalidArguments;
+    GalleryFileKey key = GalleryKey(model_version);
+    std::unique_ptr<FeatureGallery> loaded[2];
+    FileStamp stamp;
+    int ret = LoadShared(path, key, loaded, stamp);
+    if (ret)
+      return ret;
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (journal_ || following_)
+      return kInvalidArguments;
+    ret = InstallGallery(loaded);
+    if (ret)
+      return ret;
+    following_ = true;
+    follower_ = std::thread(&PalmCompareImpl::Follow, this, path, key, stamp, poll_ms);
+    return kOk;
+  }
+
+  int OpenJournal(const std::string& model_version) override {
+    const JournalParam& param = config_.journal;
+    if (param.snapshot_file.empty() || param.log_file.empty())
+      return kInvalidArguments;
+    GalleryFileKey key = GalleryKey(model_version);
+    // The log is replayed once, a concurrent or later call finds the journal open.
+    std::lock_guard<std::mutex> open_lock(journal_open_mutex_);
+    {
+      std::lock_guard<std::mutex> lock(write_mutex_);
+      if (journal_ && journal_->key().model_version == key.model_version)
+        return kOk;
+      if (journal_ || following_ || gallery().size())
+        return kInvalidArguments;
+    }
+    std::unique_ptr<FeatureGallery> snapshot[2];
+    uint64_t sequence = 0;
+    int ret = LoadVersions(param.snapshot_file, key, &sequence, snapshot);
+    if (ret == kOk) {
+      std::lock_guard<std::mutex> lock(write_mutex_);
+      ret = InstallGallery(snapshot);
+    } else if (ret == kFileNotExist) {
+      ret = kOk;
+    }
+    if (ret)
+      return ret;
+    // Replayed while journal_ is unset, so that the records are not logged again.
+    std::unique_ptr<GalleryJournal> journal(new GalleryJournal);
+    ret = journal->Open(param.log_file, key, sequence, [this](const JournalRecord& record) -> int {
+      if (ApplyRecord(record))
+        return kCompareGalleryCorrupt;
+      return kOk;
+    });
+    if (ret)
+      return ret;
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    journal_ = std::move(journal);
+    return kOk;
+  }
+
+  int CompactJournal() override {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (!journal_)
+      return kInvalidArguments;
+    return Compact();
+  }
+
+  int QueryTopK(const std::vector<float>& ir_features,
+                const std::vector<float>& rgb_features,
+                uint32_t top_k,
+                std::vector<CompareCandidate>& candidates) override {
+    const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+    return QueryTemplate(ir_features, rgb_features, hashes, kAnyPalmType, nullptr, top_k,
+                         candidates);
+  }
+
+  int QueryTopKWithHash(const std::vector<float>& ir_features,
+                        const std::vector<float>& rgb_features,
+                        const std::string& hash_ir,
+                        const std::string& hash_rgb,
+                        uint32_t top_k,
+                        std::vector<CompareCandidate>& candidates) override {
+    const std::string* hashes[kChannelCount] = {&hash_ir, &hash_rgb};
+    return QueryTemplate(ir_features, rgb_features, hashes, kAnyPalmType, nullptr, top_k,
+                         candidates);
+  }
+
+  int QueryTopKBatch(const std::vector<std::vector<float>>& ir_probes,
+                     const std::vector<std::vector<float>>& rgb_probes,
+                     uint32_t top_k,
+                     std::vector<std::vector<CompareCandidate>>& results) override {
+    results.clear();
+    if (ir_probes.size() != rgb_probes.size())
+      return kInvalidArguments;
+    size_t count = ir_probes.size();
+    std::vector<ProbeBuffers> buffers(count);
+    std::vector<GalleryProbe> probes(count);
+    std::vector<IvfPqQuery> queries(count);
+    const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+    QueryState state;
+    BeginQuery(state);
+    for (size_t i = 0; i < count; ++i) {
+      int ret = PrepareProbe(state, ir_probes[i], rgb_probes[i], hashes, buffers[i], probes[i]);
+      if (ret)
+        return ret;
+    }
+    uint32_t fetch = rerank_store_.IsOpen() ? std::max(top_k, config_.rerank_count) : top_k;
+    std::vector<TopKHeap> heaps(count, TopKHeap(fetch));
+    if (state.hnsw() || state.ivf_pq() || prefilter_ || cascade_ || early_exit_ || fusion_) {
+      for (size_t i = 0; i < count; ++i) {
+        Search(state, probes[i], AllRows(state), fetch, queries[i], heaps[i]);
+        CountCascade(state, probes[i], heaps[i]);
+      }
+    } else {
+      std::vector<const GalleryProbe*> pointers(count);
+      for (size_t i = 0; i < count; ++i) {
+        pointers[i] = &probes[i];
+      }
+      ParallelScanBatch(state, pointers, heaps);
+    }
+    results.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      std::vector<ScoredRow> rows = heaps[i].Take();
+      if (rerank_store_.IsOpen()) {
+        int ret = Rerank(state, probes[i], rows, top_k, results[i]);
+        if (ret)
+          return ret;
+        continue;
+      }
+      for (const ScoredRow& item : rows) {
+        results[i].push_back(MakeCandidate(state, probes[i], queries[i], item.row));
+      }
+    }
+    return kOk;
+  }
+
+  int QueryTopKWithDeadline(const std::vector<float>& ir_features,
+                            const std::vector<float>& rgb_features,
+                            int palm_type,
+                            uint32_t top_k,
+                            uint32_t budget_us,
+                            std::vector<CompareCandidate>& candidates,
+                            bool& complete) override {
+    // The budget includes the wait for a change of a gallery without hot_swap.
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(budget_us);
+    candidates.clear();
+    complete = false;
+    if (palm_type != 0 && palm_type != 1 && palm_type != kAnyPalmType)
+      return kInvalidArguments;
+    ProbeBuffers buffers;
+    GalleryProbe probe;
+    IvfPqQuery query;
+    const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+    QueryState state;
+    BeginQuery(state);
+    int ret = PrepareProbe(state, ir_features, rgb_features, hashes, buffers, probe);
+    if (ret)
+      return ret;
+    std::vector<CompareCandidate> hot;
+    if (hot_) {
+      std::lock_guard<std::mutex> hot_lock(hot_mutex_);
+      ScanHot(state, probe, palm_type, top_k, hot);
+    }
+    uint32_t fetch = rerank_store_.IsOpen() ? std::max(top_k, config_.rerank_count) : top_k;
+    TopKHeap heap(fetch);
+    complete = SearchUntil(state, probe, palm_type, fetch, deadline, query, heap);
+    CountCascade(state, probe, heap);
+    std::vector<ScoredRow> rows = heap.Take();
+    if (rerank_store_.IsOpen()) {
+      ret = Rerank(state, probe, rows, top_k, candidates);
+      if (ret)
+        return ret;
+    } else {
+      for (const ScoredRow& item : rows) {
+        candidates.push_back(MakeCandidate(state, probe, query, item.row));
+      }
+    }
+    // Hot copies of ids the search came across as well are left out.
+    for (const CompareCandidate& candidate : hot) {
+      auto same = [&candidate](const CompareCandidate& other) {
+        return other.features_id == candidate.features_id;
+      };
+      if (std::none_of(candidates.begin(), candidates.end(), same))
+        candidates.push_back(candidate);
+    }
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const CompareCandidate& a, const CompareCandidate& b) {
+                       return a.score > b.score;
+                     });
+    if (candidates.size() > top_k)
+      candidates.resize(top_k);
+    return kOk;
+  }
+
+  int QueryTopKWithPalmType(const std::vector<float>& ir_features,
+                            const std::vector<float>& rgb_features,
+                            int palm_type,
+                            uint32_t top_k,
+                            std::vector<CompareCandidate>& candidates) override {
+    candidates.clear();
+    if (palm_type != 0 && palm_type != 1)
+      return kInvalidArguments;
+    const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+    return QueryTemplate(ir_features, rgb_features, hashes, palm_type, nullptr, top_k,
+                         candidates);
+  }
+
+  int QueryTopKWithSkeleton(const std::vector<float>& ir_features,
+                            const std::vector<float>& rgb_features,
+                            int palm_type,
+                            const std::vector<float>& skeleton,
+                            uint32_t top_k,
+                            std::vector<CompareCandidate>& candidates) override {
+    candidates.clear();
+    if (palm_type != 0 && palm_type != 1 && palm_type != kAnyPalmType)
+      return kInvalidArguments;
+    const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+    return QueryTemplate(ir_features, rgb_features, hashes, palm_type, &skeleton, top_k,
+                         candidates);
+  }
+
+  int QueryFeaturesId(const std::vector<float>& ir_features,
+                      const std::vector<float>& rgb_features,
+                      int& features_id,
+                      float& score) override {
+    return QueryBestTemplate(ir_features, rgb_features, kAnyPalmType, nullptr, features_id,
+                             score);
+  }
+
+  int QueryFeaturesIdWithPalmType(const std::vector<float>& ir_features,
+                                  const std::vector<float>& rgb_features,
+                                  int palm_type,
+                                  int& features_id,
+                                  float& score) override {
+    features_id = -1;
+    score = 0.0f;
+    if (palm_type != 0 && palm_type != 1)
+      return kInvalidArguments;
+    return QueryBestTemplate(ir_features, rgb_features, palm_type, nullptr, features_id, score);
+  }
+
+  int QueryFeaturesIdWithSkeleton(const std::vector<float>& ir_features,
+                                  const std::vector<float>& rgb_features,
+                                  int palm_type,
+                                  const std::vector<float>& skeleton,
+                                  int& features_id,
+                                  float& score) override {
+    features_id = -1;
+    score = 0.0f;
+    if (palm_type != 0 && palm_type != 1 && palm_type != kAnyPalmType)
+      return kInvalidArguments;
+    return QueryBestTemplate(ir_features, rgb_features, palm_type, &skeleton, features_id,
+                             score);
+  }
+
+  int BindCard(const std::string& card_uid, int features_id) override {
+    if (card_uid.empty())
+      return kInvalidArguments;
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    cards_[card_uid] = features_id;
+    return kOk;
+  }
+
+  int UnbindCard(const std::string& card_uid) override {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    if (!cards_.erase(card_uid))
+      return kCompareIdNotFound;
+    return kOk;
+  }
+
+  int VerifyCard(const std::string& card_uid,
+                 const std::vector<float>& ir_features,
+                 const std::vector<float>& rgb_features,
+                 float& score) override {
+    score = 0.0f;
+    ProbeBuffers buffers;
+    GalleryProbe probe;
+    IvfPqQuery query;
+    const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+    QueryState state;
+    BeginQuery(state);
+    // The card leads to the id, the id to its first row through the row index of the gallery,
+    // which follows the rows as they move.
+    int features_id = 0;
+    {
+      std::lock_guard<std::mutex> lock(state_mutex_);
+      auto card = cards_.find(card_uid);
+      if (card == cards_.end())
+        return kCompareIdNotFound;
+      features_id = card->second;
+    }
+    size_t row = 0;
+    if (!state.gallery().FindRow(features_id, row))
+      return kCompareIdNotFound;
+    int ret = PrepareProbe(state, ir_features, rgb_features, hashes, buffers, probe);
+    if (ret)
+      return ret;
+    std::vector<CompareCandidate> candidates;
+    if (rerank_store_.IsOpen()) {
+      std::vector<ScoredRow> rows(1, ScoredRow{0.0f, static_cast<uint32_t>(row)});
+      ret = Rerank(state, probe, rows, 1, candidates);
+      if (ret)
+        return ret;
+    } else {
+      if (state.ivf_pq())
+        state.ivf_pq()->PrepareQuery(state.gallery(), probe, query);
+      candidates.push_back(MakeCandidate(state, probe, query, row));
+    }
+    if (candidates.empty())
+      return kCompareIdNotFound;
+    score = candidates[0].score;
+    if (!Accept(state, candidates[0]))
+      return kCompareNoMatch;
+    return kOk;
+  }
+
+  int SetHnswSearchParam(uint32_t ef_search) override {
+    if (config_.index_type != CompareIndexType::kHnsw || !ef_search)
+      return kInvalidArguments;
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    config_.hnsw.ef_search = ef_search;
+    return Update([ef_search](GalleryVersion& version, bool) {
+      if (version.hnsw)
+        version.hnsw->SetEfSearch(ef_search);
+      return kOk;
+    });
+  }
+
+  int SetIvfPqSearchParam(uint32_t nprobe) override {
+    if (config_.index_type != CompareIndexType::kIvfPq || !nprobe)
+      return kInvalidArguments;
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    config_.ivf_pq.nprobe = nprobe;
+    return Update([nprobe](GalleryVersion& version, bool) {
+      if (version.ivf_pq)
+        version.ivf_pq->SetNprobe(nprobe);
+      return kOk;
+    });
+  }
+
+  int MeasureRecall(const std::vector<std::vector<float>>& ir_probes,
+                    const std::vector<std::vector<float>>& rgb_probes,
+                    uint32_t top_k,
+                    float& recall) override {
+    recall = 0.0f;
+    if (ir_probes.size() != rgb_probes.size() || ir_probes.empty() || !top_k)
+      return kInvalidArguments;
+    QueryState state;
+    BeginQuery(state);
+    size_t found = 0;
+    size_t expected = 0;
+    for (size_t i = 0; i < ir_probes.size(); ++i) {
+      ProbeBuffers buffers;
+      GalleryProbe probe;
+      const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+      int ret = PrepareProbe(state, ir_probes[i], rgb_probes[i], hashes, buffers, probe);
+      if (ret)
+        return ret;
+      TopKHeap exact_heap(top_k);
+      ret = ExactSearch(state, probe, exact_heap);
+      if (ret)
+        return ret;
+      IvfPqQuery query;
+      TopKHeap index_heap(top_k);
+      Search(state, probe, AllRows(state), top_k, query, index_heap);
+      CountCascade(state, probe, index_heap);
+      std::vector<ScoredRow> exact = exact_heap.Take();
+      std::vector<ScoredRow> approximate = index_heap.Take();
+      for (const ScoredRow& item : exact) {
+        for (const ScoredRow& other : approximate) {
+          if (other.row == item.row) {
+            ++found;
+            break;
+          }
+        }
+      }
+      expected += exact.size();
+    }
+    recall = expected ? static_cast<float>(found) / expected : 1.0f;
+    return kOk;
+  }
+
+  int GetCascadeStats(CascadeStats& stats) override {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    stats = cascade_stats_;
+    return kOk;
+  }
+
+  int PrefetchIds(const std::vector<int>& features_ids) override {
+    if (!hot_)
+      return kInvalidArguments;
+    // Deletions and replaced galleries wait, the queries go on with the old tier meanwhile.
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    std::vector<int> ids;
+    std::unordered_set<int> listed;
+    {
+      std::lock_guard<std::mutex> hot_lock(hot_mutex_);
+      ids.reserve(features_ids.size() + hot_->size());
+      ids.insert(ids.end(), features_ids.begin(), features_ids.end());
+      ids.insert(ids.end(), hot_->order().begin(), hot_->order().end());
+      listed.insert(hot_->order().begin(), hot_->order().end());
+    }
+    HotTier hot(config_.metric, config_.storage, hot_->capacity());
+    std::unordered_set<int> kept;
+    std::vector<size_t> rows;
+    for (int features_id : ids) {
+      size_t row = 0;
+      if (rows.size() == hot.capacity())
+        break;
+      if (kept.insert(features_id).second && gallery().FindRow(features_id, row))
+        rows.push_back(row);
+    }
+    // The first id is promoted last and is the most recently matched one.
+    for (auto it = rows.rbegin(); it != rows.rend(); ++it) {
+      int ret = hot.Promote(gallery(), *it);
+      if (ret)
+        return ret;
+    }
+    std::lock_guard<std::mutex> hot_lock(hot_mutex_);
+    // Promoted by the queries while the tier was built, kept as the most recently matched ones.
+    std::vector<size_t> promoted;
+    for (int features_id : hot_->order()) {
+      size_t row = 0;
+      if (!listed.count(features_id) && gallery().FindRow(features_id, row))
+        promoted.push_back(row);
+    }
+    for (auto it = promoted.rbegin(); it != promoted.rend(); ++it) {
+      int ret = hot.Promote(gallery(), *it);
+      if (ret)
+        return ret;
+    }
+    *hot_ = std::move(hot);
+    return kOk;
+  }
+
+  int GetTierStats(TierStats& stats) override {
+    {
+      std::lock_guard<std::mutex> lock(state_mutex_);
+      stats = tier_stats_;
+    }
+    stats.hot_ids = 0;
+    if (hot_) {
+      std::lock_guard<std::mutex> lock(hot_mutex_);
+      stats.hot_ids = hot_->size();
+    }
+    return kOk;
+  }
+
+  size_t GetFeaturesCount() override {
+    QueryState state;
+    BeginQuery(state);
+    return state.gallery().size();
+  }
+
+ private:
+  // Dims of the features as given, the gallery keeps those of the projection. The rerank file
+  // is opened with the first version.
+  int InitGallery(GalleryVersion& version, size_t ir_dim, size_t rgb_dim, bool first) {
+    size_t dims[kChannelCount] = {probe_for_[kIrChannel] >= 0 ? ir_dim : 0,
+                                  probe_for_[kRgbChannel] >= 0 ? rgb_dim : 0};
+    for (int c = 0; c < kChannelCount && projection_; ++c) {
+      if (!dims[c])
+        continue;
+      if (dims[c] != projection_->in_dim(c))
+        return kCompareDimensionMismatch;
+      dims[c] = projection_->out_dim(c);
+    }
+    if (config_.index_type == CompareIndexType::kIvfPq) {
+      std::unique_ptr<IvfPqIndex> ivf_pq(new IvfPqIndex(config_.metric));
+      int ret = ivf_pq->Load(config_.ivf_pq.codebook_file);
+      if (ret)
+        return ret;
+      if (ivf_pq->dim(kIrChannel) != dims[kIrChannel] ||
+          ivf_pq->dim(kRgbChannel) != dims[kRgbChannel])
+        return kCompareDimensionMismatch;
+      ivf_pq->SetNprobe(config_.ivf_pq.nprobe);
+      version.ivf_pq = std::move(ivf_pq);
+      version.gallery.SetKeepFeatures(false);
+    }
+    FeatureGallery& gallery = version.gallery;
+    gallery.Init(dims[kIrChannel], dims[kRgbChannel]);
+    gallery.SetGrouped(fusion_);
+    gallery.SetPartitioned(config_.palm_type.partition);
+    if (prefilter_ && config_.hamming.source == BinaryCodeSource::kFeatureSign)
+      gallery.InitCodes(dims[kIrChannel], dims[kRgbChannel]);
+    if (config_.reserve)
+      gallery.Reserve(config_.reserve);
+    if (config_.index_type == CompareIndexType::kHnsw)
+      version.hnsw.reset(new HnswIndex(config_.hnsw, weight_));
+    bool quantized = config_.storage != FeatureStorage::kFloat32 || version.ivf_pq;
+    if (first && quantized && !config_.rerank_file.empty()) {
+      std::lock_guard<std::mutex> lock(store_mutex_);
+      return rerank_store_.Open(config_.rerank_file,
+                                gallery.dim(kIrChannel),
+                                gallery.dim(kRgbChannel));
+    }
+    return kOk;
+  }
+
+  // A gallery file mapped once per version, each mapping is copied on write on its own unless
+  // read_only.
+  int LoadVersions(const std::string& path, const GalleryFileKey& key, uint64_t* log_sequence,
+                   std::unique_ptr<FeatureGallery> loaded[2], bool read_only = false) const {
+    for (int i = 0; i < 2 && versions_[i]; ++i) {
+      loaded[i].reset(new FeatureGallery(config_.metric, config_.storage));
+      int ret = loaded[i]->Load(path, key, log_sequence, read_only);
+      if (ret)
+        return ret;
+    }
+    return kOk;
+  }
+
+  // The read-only versions of FollowGallery() and the file they were loaded from.
+  int LoadShared(const std::string& path, const GalleryFileKey& key,
+                 std::unique_ptr<FeatureGallery> loaded[2], FileStamp& stamp) const {
+    int ret = LoadVersions(path, key, nullptr, loaded, true);
+    if (ret)
+      return ret;
+    stamp = loaded[0]->mapping()->stamp();
+#if _WIN32
+    // Windows does not let the publisher rename a new generation over a mapped file, the rows
+    // are copied instead of shared there.
+    for (int i = 0; i < 2 && loaded[i]; ++i) {
+      loaded[i]->Unmap();
+    }
+#endif
+    return kOk;
+  }
+
+  // Thread of FollowGallery(). Installs every generation renamed over path, loaded while the
+  // queries and, with hot_swap, also the installation go on with the previous one. A file that
+  // does not load is not tried again until it is replaced.
+  void Follow(const std::string& path, const GalleryFileKey& key, FileStamp tried,
+              uint32_t poll_ms) {
+    std::unique_lock<std::mutex> lock(follow_mutex_);
+    while (!follow_wake_.wait_for(lock, std::chrono::milliseconds(poll_ms),
+                                  [this] { return stop_following_; })) {
+      lock.unlock();
+      FileStamp stamp;
+      if (StatFile(path, stamp) && stamp != tried) {
+        std::unique_ptr<FeatureGallery> loaded[2];
+        if (LoadShared(path, key, loaded, stamp) == kOk) {
+          std::lock_guard<std::mutex> write_lock(write_mutex_);
+          InstallGallery(loaded);
+        }
+        tried = stamp;
+      }
+      lock.lock();
+    }
+  }
+
+  // Replace the gallery with those of LoadVersions(), under write_mutex_.
+  int InstallGallery(std::unique_ptr<FeatureGallery> loaded[2]) {
+    if (!MatchesConfig(*loaded[0]))
+      return kCompareGalleryMismatch;
+    int ret = Update([this, loaded](GalleryVersion& version, bool first) {
+      version.gallery = std::move(*loaded[first ? 0 : 1]);
+      if (config_.index_type == CompareIndexType::kHnsw) {
+        version.hnsw.reset(new HnswIndex(config_.hnsw, weight_));
+        for (size_t row = 0; row < version.gallery.size(); ++row) {
+          version.hnsw->Insert(version.gallery, row);
+        }
+      }
+      return kOk;
+    });
+    // The hot copies and cached matches may be of templates the new gallery no longer has.
+    if (hot_) {
+      std::lock_guard<std::mutex> lock(hot_mutex_);
+      hot_->Clear();
+    }
+    {
+      std::lock_guard<std::mutex> lock(state_mutex_);
+      probe_cache_.clear();
+    }
+    return ret;
+  }
+
+  // Under write_mutex_, the queries only read the gallery meanwhile.
+  int SaveSnapshot(const std::string& path, const GalleryFileKey& key, uint64_t log_sequence) {
+#if _WIN32
+    // The gallery may be mapped from path, which Windows would not let us replace.
+    int ret = Update([](GalleryVersion& version, bool) {
+      version.gallery.Unmap();
+      return kOk;
+    });
+    if (ret)
+      return ret;
+#endif
+    return gallery().Save(path, key, log_sequence);
+  }
+
+  // Apply a change to the gallery versions, under write_mutex_. With a single version the
+  // queries wait meanwhile. With hot_swap the spare version is changed once no query holds it
+  // any more and published, the queries that start afterwards search it. Then the other one is
+  // changed the same way once the queries still on it are done. change(version, first) has to
+  // do the same to both, also when it fails, and leaves anything beyond the versions to the
+  // first call. Only running out of memory tells the two apart, the version left behind is
+  // never published but copied from the published one before the next change.
+  template<class Change>
+  int Update(const Change& change) {
+    if (!versions_[1]) {
+      std::unique_lock<std::shared_timed_mutex> lock(version_mutex_);
+      return change(*versions_[0], true);
+    }
+    int spare = 1 - active_;
+    WaitUntilUnused(spare);
+    int ret = SyncSpare(spare);
+    if (ret)
+      return ret;
+    try {
+      ret = change(*versions_[spare], true);
+      Publish(spare);
+    } catch (const std::bad_alloc&) {
+      stale_ = true;
+      return kFailedToAllocateMemory;
+    }
+    WaitUntilUnused(1 - spare);
+    int again = kOk;
+    try {
+      again = change(*versions_[1 - spare], false);
+    } catch (const std::bad_alloc&) {
+      again = kFailedToAllocateMemory;
+    }
+    stale_ = again != ret;
+    return ret;
+  }
+
+  // Pin a version for the queries that start from now on. The previous pin is dropped, its
+  // version unused once the queries that copied it are done.
+  void Publish(int index) {
+    std::shared_ptr<const GalleryVersion> pin(versions_[index].get(), Unpin{&unused_[index]});
+    unused_[index].store(false, std::memory_order_relaxed);
+    std::atomic_store(&published_, std::move(pin));
+    active_ = index;
+  }
+
+  // Wait for the queries that still search a version, which no new query can reach. Their
+  // reads of the version happen before the change.
+  void WaitUntilUnused(int index) const {
+    while (!unused_[index].load(std::memory_order_acquire)) {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+  // Copy the published version over the spare one when the last change failed on it.
+  int SyncSpare(int spare) {
+    if (!stale_)
+      return kOk;
+    const GalleryVersion& from = *versions_[1 - spare];
+    GalleryVersion& to = *versions_[spare];
+    try {
+      to.gallery = from.gallery;
+      to.hnsw.reset(from.hnsw ? new HnswIndex(*from.hnsw) : nullptr);
+      to.ivf_pq.reset(from.ivf_pq ? new IvfPqIndex(*from.ivf_pq) : nullptr);
+    } catch (const std::bad_alloc&) {
+      return kFailedToAllocateMemory;
+    }
+    stale_ = false;
+    return kOk;
+  }
+
+  // Pin the published version for a query and copy the thresholds, see QueryState.
+  void BeginQuery(QueryState& state) {
+    if (!versions_[1])
+      state.lock = std::shared_lock<std::shared_timed_mutex>(version_mutex_);
+    state.version = std::atomic_load(&published_);
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    for (int c = 0; c < kChannelCount; ++c) {
+      state.thresholds[c] = thresholds_[c];
+    }
+    state.has_thresholds = has_thresholds_;
+  }
+
+  // The published version, for the writers under write_mutex_, which alone changes it.
+  const FeatureGallery& gallery() const { return versions_[active_]->gallery; }
+
+  // A record of the journal replayed by OpenJournal().
+  int ApplyRecord(const JournalRecord& record) {
+    if (record.op == JournalOp::kDelete)
+      return DeleteID(record.features_id);
+    const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (record.has_hash[c])
+        hashes[c] = &record.hashes[c];
+    }
+    return AddTemplate(record.features_id, record.features[kIrChannel],
+                       record.features[kRgbChannel], hashes, record.palm_type,
+                       record.has_skeleton ? &record.skeleton : nullptr);
+  }
+
+  // Wait for a logged change to reach the disk, then fold a long log into the snapshot.
+  int CommitJournal(uint64_t sequence) {
+    int ret = journal_->Commit(sequence);
+    uint32_t limit = config_.journal.compact_records;
+    if (ret || !limit || journal_->records() < limit)
+      return ret;
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    // Another caller may have compacted meanwhile.
+    if (journal_->records() < limit)
+      return kOk;
+    return Compact();
+  }
+
+  // Under write_mutex_, no record is appended meanwhile.
+  int Compact() {
+    uint64_t sequence = journal_->sequence();
+    int ret = journal_->Commit(sequence);
+    if (!ret && gallery().IsInitialized())
+      ret = SaveSnapshot(config_.journal.snapshot_file, journal_->key(), sequence);
+    if (!ret)
+      ret = journal_->Reset();
+    return ret;
+  }
+
+  GalleryFileKey GalleryKey(const std::string& model_version) const {
+    GalleryFileKey key;
+    key.model_version = model_version;
+    key.recog_mode = static_cast<uint32_t>(config_.recog_mode);
+    // The dims of CompareConfig, as the gallery keeps them.
+    size_t configured[kChannelCount] = {config_.ir_dim, config_.rgb_dim};
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (probe_for_[c] >= 0 && configured[c])
+        key.dims[c] = projection_ ? projection_->out_dim(c) : configured[c];
+    }
+    return key;
+  }
+
+  // Whether a loaded gallery has the layout InitGallery() and the first templates would give.
+  bool MatchesConfig(const FeatureGallery& gallery) const {
+    if (gallery.grouped() != fusion_ || gallery.partitioned() != config_.palm_type.partition ||
+        !gallery.keep_features() || (!geometry_ && gallery.geometry_dim()))
+      return false;
+    if (gallery.has_codes() && !prefilter_)
+      return false;
+    for (int c = 0; c < kChannelCount; ++c) {
+      if ((probe_for_[c] >= 0) != (gallery.dim(c) != 0))
+        return false;
+      if (this->gallery().IsInitialized() && gallery.dim(c) != this->gallery().dim(c))
+        return false;
+      if (projection_ && probe_for_[c] >= 0 && gallery.dim(c) != projection_->out_dim(c))
+        return false;
+      if (prefilter_ && config_.hamming.source == BinaryCodeSource::kFeatureSign &&
+          gallery.code_bits(c) != gallery.dim(c))
+        return false;
+    }
+    return true;
+  }
+
+  // skeleton is nullptr when not given, it is required once GeometryParam is enabled.
+  int AddTemplate(int features_id,
+                  const std::vector<float>& ir_features,
+                  const std::vector<float>& rgb_features,
+                  const std::string* const hashes[kChannelCount],
+                  int palm_type,
+                  const std::vector<float>* skeleton) {
+    const std::vector<float>* input[kChannelCount] = {&ir_features, &rgb_features};
+    static const int kOwnChannel[kChannelCount] = {kIrChannel, kRgbChannel};
+    std::vector<float> projected[kChannelCount];
+    int ret = Project(kOwnChannel, input, projected);
+    if (ret)
+      return ret;
+    std::unique_lock<std::mutex> lock(write_mutex_);
+    if (following_)
+      return kInvalidArguments;
+    if (config_.memory_budget &&
+        (gallery().size() + 1) * TemplateBytes(ir_features.size(), rgb_features.size()) >
+            config_.memory_budget)
+      return kCompareGalleryFull;
+    ret = Update([&](GalleryVersion& version, bool first) {
+      if (!version.gallery.IsInitialized()) {
+        int init = InitGallery(version, ir_features.size(), rgb_features.size(), first);
+        if (init)
+          return init;
+      }
+      return AddToVersion(version, first, features_id, input, hashes, palm_type, skeleton);
+    });
+    if (ret || !journal_)
+      return ret;
+    // Logged as given, replaying projects it again.
+    const std::vector<float>* given[kChannelCount] = {&ir_features, &rgb_features};
+    uint64_t sequence = journal_->AppendAdd(features_id, palm_type, given, hashes, skeleton);
+    lock.unlock();
+    return CommitJournal(sequence);
+  }
+
+  // Memory of a template in the gallery, or in the codes of a kIvfPq index. Before the first
+  // template, from the feature lengths it is added with.
+  size_t TemplateBytes(size_t ir_dim, size_t rgb_dim) const {
+    if (config_.index_type == CompareIndexType::kIvfPq) {
+      size_t channels = 0;
+      for (int c = 0; c < kChannelCount; ++c) {
+        channels += probe_for_[c] >= 0;
+      }
+      return channels * config_.ivf_pq.pq_m;
+    }
+    if (gallery().IsInitialized())
+      return gallery().row_bytes();
+    size_t dims[kChannelCount] = {ir_dim, rgb_dim};
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (probe_for_[c] < 0)
+        dims[c] = 0;
+      else if (projection_)
+        dims[c] = projection_->out_dim(c);
+    }
+    return FeatureGallery::RowBytes(config_.storage, dims[kIrChannel], dims[kRgbChannel]);
+  }
+
+  // The version part of AddTemplate() with the projected features.
+  int AddToVersion(GalleryVersion& version,
+                   bool first,
+                   int features_id,
+                   const std::vector<float>* const input[kChannelCount],
+                   const std::string* const hashes[kChannelCount],
+                   int palm_type,
+                   const std::vector<float>* skeleton) {
+    FeatureGallery& gallery = version.gallery;
+    const float* features[kChannelCount] = {nullptr, nullptr};
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (probe_for_[c] < 0)
+        continue;
+      if (input[c]->size() != gallery.dim(c) || input[c]->empty())
+        return kCompareDimensionMismatch;
+      features[c] = input[c]->data();
+    }
+    if (!fusion_ && gallery.Contains(features_id))
+      return kCompareIdExists;
+    if (gallery.partitioned() && palm_type == kAnyPalmType)
+      return kInvalidArguments;
+    std::vector<uint64_t> codes[kChannelCount];
+    int ret = MakeTemplateCodes(gallery, features, hashes, codes);
+    if (ret)
+      return ret;
+    const uint64_t* code_rows[kChannelCount] = {nullptr, nullptr};
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (!codes[c].empty())
+        code_rows[c] = codes[c].data();
+    }
+    std::vector<float> geometry;
+    ret = MakeTemplateGeometry(gallery, skeleton, geometry);
+    if (ret)
+      return ret;
+    // Before any query can find the row.
+    if (first && rerank_store_.IsOpen()) {
+      std::lock_guard<std::mutex> lock(store_mutex_);
+      ret = rerank_store_.Append(features_id, features);
+      if (ret)
+        return ret;
+    }
+    ret = gallery.Add(features_id, features, code_rows, std::max(palm_type, 0),
+                      geometry.empty() ? nullptr : geometry.data());
+    if (ret)
+      return ret;
+    if (version.hnsw)
+      version.hnsw->Insert(gallery, gallery.size() - 1);
+    if (version.ivf_pq)
+      version.ivf_pq->Insert(gallery, gallery.size() - 1, features);
+    return kOk;
+  }
+
+  int QueryTemplate(const std::vector<float>& ir_features,
+                    const std::vector<float>& rgb_features,
+                    const std::string* const hashes[kChannelCount],
+                    int palm_type,
+                    const std::vector<float>* skeleton,
+                    uint32_t top_k,
+                    std::vector<CompareCandidate>& candidates) {
+    QueryState state;
+    BeginQuery(state);
+    return QueryTemplate(state, ir_features, rgb_features, hashes, palm_type, skeleton, top_k,
+                         candidates, false);
+  }
+
+  int QueryTemplate(QueryState& state,
+                    const std::vector<float>& ir_features,
+                    const std::vector<float>& rgb_features,
+                    const std::string* const hashes[kChannelCount],
+                    int palm_type,
+                    const std::vector<float>* skeleton,
+                    uint32_t top_k,
+                    std::vector<CompareCandidate>& candidates,
+                    bool tiered) {
+    candidates.clear();
+    ProbeBuffers buffers;
+    GalleryProbe probe;
+    IvfPqQuery query;
+    int ret = PrepareProbe(state, ir_features, rgb_features, hashes, buffers, probe);
+    if (ret)
+      return ret;
+    if (geometry_ && skeleton) {
+      std::vector<float> geometry;
+      ret = SkeletonGeometry(*skeleton, geometry);
+      if (!ret)
+        ret = state.gallery().PrepareGeometry(geometry, buffers, probe);
+      if (ret)
+        return ret;
+    }
+    tiered = tiered && hot_;
+    if (tiered) {
+      CompareCandidate candidate;
+      bool hit = SearchHot(state, probe, palm_type, candidate);
+      {
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        ++tier_stats_.queries;
+        if (hit)
+          ++tier_stats_.hot_hits;
+      }
+      if (hit) {
+        candidates.push_back(candidate);
+        return kOk;
+      }
+    }
+    uint32_t fetch = rerank_store_.IsOpen() ? std::max(top_k, config_.rerank_count) : top_k;
+    TopKHeap heap(fetch);
+    SearchPalmType(state, probe, palm_type, fetch, query, heap);
+    CountCascade(state, probe, heap);
+    std::vector<ScoredRow> rows = heap.Take();
+    if (tiered && !rows.empty() && AcceptRow(state, probe, rows[0].row)) {
+      {
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        ++tier_stats_.cold_hits;
+      }
+      std::lock_guard<std::mutex> lock(hot_mutex_);
+      hot_->Promote(state.gallery(), rows[0].row);
+    }
+    if (rerank_store_.IsOpen())
+      return Rerank(state, probe, rows, top_k, candidates);
+    for (const ScoredRow& item : rows) {
+      candidates.push_back(MakeCandidate(state, probe, query, item.row));
+    }
+    return kOk;
+  }
+
+  // Best candidate of QueryTemplate() if it reaches the recognition thresholds.
+  int QueryBestTemplate(const std::vector<float>& ir_features,
+                        const std::vector<float>& rgb_features,
+                        int palm_type,
+                        const std::vector<float>* skeleton,
+                        int& features_id,
+                        float& score) {
+    features_id = -1;
+    score = 0.0f;
+    const std::vector<float>* input[kChannelCount] = {&ir_features, &rgb_features};
+    QueryState state;
+    BeginQuery(state);
+    if (config_.probe_cache.entries) {
+      std::lock_guard<std::mutex> lock(state_mutex_);
+      if (LookupProbe(state, input, features_id, score)) {
+        ++tier_stats_.cache_hits;
+        return kOk;
+      }
+    }
+    std::vector<CompareCandidate> candidates;
+    const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+    int ret = QueryTemplate(state, ir_features, rgb_features, hashes, palm_type, skeleton, 1,
+                            candidates, true);
+    if (ret)
+      return ret;
+    if (candidates.empty() || !Accept(state, candidates[0]))
+      return kCompareNoMatch;
+    features_id = candidates[0].features_id;
+    score = candidates[0].score;
+    if (config_.probe_cache.entries) {
+      CachedProbe entry;
+      for (int m = 0; m < kChannelCount; ++m) {
+        entry.features[m] = *input[m];
+      }
+      entry.features_id = features_id;
+      entry.score = score;
+      entry.time = std::chrono::steady_clock::now();
+      std::lock_guard<std::mutex> lock(state_mutex_);
+      probe_cache_.push_front(std::move(entry));
+      if (probe_cache_.size() > config_.probe_cache.entries)
+        probe_cache_.pop_back();
+    }
+    return kOk;
+  }
+
+  // Match of a cached probe close to input on every compared modality, under state_mutex_.
+  bool LookupProbe(const QueryState& state, const std::vector<float>* const input[kChannelCount],
+                   int& features_id, float& score) {
+    auto now = std::chrono::steady_clock::now();
+    auto ttl = std::chrono::milliseconds(config_.probe_cache.ttl_ms);
+    // Newest first, the expired entries are at the back.
+    while (!probe_cache_.empty() && now - probe_cache_.back().time > ttl) {
+      probe_cache_.pop_back();
+    }
+    for (const CachedProbe& entry : probe_cache_) {
+      // With hot_swap an id leaves the gallery a moment before DeleteID() drops its entries.
+      if (!state.gallery().Contains(entry.features_id))
+        continue;
+      bool close = true;
+      for (int c = 0; c < kChannelCount && close; ++c) {
+        int m = probe_for_[c];
+        if (m >= 0)
+          close = FeatureSimilarity(*input[m], entry.features[m]) >=
+                  config_.probe_cache.similarity;
+      }
+      if (close) {
+        features_id = entry.features_id;
+        score = entry.score;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Best template of the hot tier if it reaches the recognition thresholds.
+  bool SearchHot(const QueryState& state, const GalleryProbe& probe, int palm_type,
+                 CompareCandidate& candidate) {
+    std::vector<CompareCandidate> candidates;
+    std::lock_guard<std::mutex> lock(hot_mutex_);
+    ScanHot(state, probe, palm_type, 1, candidates);
+    if (candidates.empty() || !Accept(state, candidates[0]))
+      return false;
+    candidate = candidates[0];
+    hot_->Touch(candidate.features_id);
+    return true;
+  }
+
+  // Best templates of the hot tier, compared with the probe of the whole gallery, which has the
+  // same layout. Under hot_mutex_.
+  void ScanHot(const QueryState& state, const GalleryProbe& probe, int palm_type, size_t top_k,
+               std::vector<CompareCandidate>& candidates) const {
+    const FeatureGallery& hot = hot_->gallery();
+    size_t begin = 0;
+    size_t end = 0;
+    hot_->Range(palm_type, begin, end);
+    if (begin == end)
+      return;
+    TopKHeap heap(top_k);
+    hot.Scan(probe, begin, end, heap);
+    for (const ScoredRow& item : heap.Take()) {
+      float scores[kChannelCount];
+      CompareCandidate candidate;
+      candidate.features_id = hot.id(item.row);
+      candidate.score = hot.ScoreRow(probe, item.row, scores);
+      candidate.ir_score = scores[kIrChannel];
+      candidate.rgb_score = scores[kRgbChannel];
+      // With hot_swap an id leaves the gallery a moment before DeleteID() drops its hot copy.
+      if (state.gallery().Contains(candidate.features_id))
+        candidates.push_back(candidate);
+    }
+  }
+
+  // Skeleton descriptor of a template for the hand shape filter, none when the filter is off.
+  int MakeTemplateGeometry(FeatureGallery& gallery, const std::vector<float>* skeleton,
+                           std::vector<float>& geometry) {
+    if (!geometry_)
+      return kOk;
+    if (!skeleton)
+      return kInvalidArguments;
+    int ret = SkeletonGeometry(*skeleton, geometry);
+    if (ret)
+      return ret;
+    // The first template fixes the descriptor length.
+    if (!gallery.geometry_dim()) {
+      ret = gallery.InitGeometry(geometry.size());
+      if (ret)
+        return ret;
+    }
+    if (geometry.size() != gallery.geometry_dim())
+      return kCompareDimensionMismatch;
+    return kOk;
+  }
+
+  // Binary codes of a template for the Hamming prefilter, none when the prefilter is off.
+  int MakeTemplateCodes(FeatureGallery& gallery,
+                        const float* const features[kChannelCount],
+                        const std::string* const hashes[kChannelCount],
+                        std::vector<uint64_t> codes[kChannelCount]) {
+    if (!prefilter_)
+      return kOk;
+    if (config_.hamming.source == BinaryCodeSource::kFeatureSign) {
+      for (int c = 0; c < kChannelCount; ++c) {
+        if (!features[c])
+          continue;
+        codes[c].assign(gallery.code_words(c), 0);
+        PackSignBits(features[c], gallery.dim(c), codes[c].data());
+      }
+      return kOk;
+    }
+    size_t bits[kChannelCount] = {0, 0};
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (!features[c])
+        continue;
+      if (!hashes[c])
+        return kInvalidArguments;
+      PackHashBits(*hashes[c], codes[c], bits[c]);
+      if (!bits[c])
+        return kInvalidArguments;
+    }
+    // The first template fixes the hash length.
+    if (!gallery.has_codes()) {
+      int ret = gallery.InitCodes(bits[kIrChannel], bits[kRgbChannel]);
+      if (ret)
+        return ret;
+    }
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (bits[c] != gallery.code_bits(c))
+        return kCompareDimensionMismatch;
+      codes[c].resize(gallery.code_words(c), 0);
+    }
+    return kOk;
+  }
+
+  int PrepareProbe(const QueryState& state,
+                   const std::vector<float>& ir_features,
+                   const std::vector<float>& rgb_features,
+                   const std::string* const hashes[kChannelCount],
+                   ProbeBuffers& buffers,
+                   GalleryProbe& probe) const {
+    if (!state.gallery().size())
+      return kCompareEmptyGallery;
+    const std::vector<float>* input[kChannelCount] = {&ir_features, &rgb_features};
+    std::vector<float> projected[kChannelCount];
+    int ret = Project(probe_for_, input, projected);
+    if (ret)
+      return ret;
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (probe_for_[c] < 0)
+        continue;
+      ret = state.gallery().PrepareProbe(c, *input[probe_for_[c]], buffers, probe);
+      if (ret)
+        return ret;
+      probe.weight[c] = weight_[c];
+    }
+    return PrepareProbeCodes(state, input, hashes, buffers, probe);
+  }
+
+  // Project the modality source[c] with the projection of gallery channel c, the input then
+  // points at the projected copies. Nothing to do without a projection.
+  int Project(const int source[kChannelCount], const std::vector<float>* input[kChannelCount],
+              std::vector<float> projected[kChannelCount]) const {
+    if (!projection_)
+      return kOk;
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (source[c] < 0 || probe_for_[c] < 0)
+        continue;
+      int ret = projection_->Apply(c, *input[source[c]], projected[source[c]]);
+      if (ret)
+        return ret;
+      input[source[c]] = &projected[source[c]];
+    }
+    return kOk;
+  }
+
+  // Without codes for every compared channel, e.g. no probe hash, the prefilter is skipped.
+  int PrepareProbeCodes(const QueryState& state,
+                        const std::vector<float>* const input[kChannelCount],
+                        const std::string* const hashes[kChannelCount],
+                        ProbeBuffers& buffers,
+                        GalleryProbe& probe) const {
+    if (!prefilter_ || !state.gallery().has_codes())
+      return kOk;
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (probe_for_[c] < 0)
+        continue;
+      AlignedBuffer<uint64_t>& buffer = buffers.codes[c];
+      buffer.Resize(0);
+      buffer.Resize(state.gallery().code_words(c));
+      if (config_.hamming.source == BinaryCodeSource::kFeatureSign) {
+        PackSignBits(input[probe_for_[c]]->data(), state.gallery().dim(c), buffer.data());
+      } else {
+        const std::string* hash = hashes[probe_for_[c]];
+        if (!hash)
+          return kOk;
+        std::vector<uint64_t> words;
+        size_t bits = 0;
+        PackHashBits(*hash, words, bits);
+        if (bits != state.gallery().code_bits(c))
+          return kCompareDimensionMismatch;
+        std::copy(words.begin(), words.end(), buffer.data());
+      }
+    }
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (probe_for_[c] >= 0)
+        probe.codes[c] = buffers.codes[c].data();
+    }
+    return kOk;
+  }
+
+  RowRange AllRows(const QueryState& state) const { return {0, state.gallery().size()}; }
+
+  // Search the partition of the palm type, and the other one as well when the best template
+  // of the own partition is not accepted.
+  void SearchPalmType(QueryState& state, const GalleryProbe& probe, int palm_type, size_t top_k,
+                      IvfPqQuery& query, TopKHeap& heap) {
+    if (!state.gallery().partitioned() || palm_type == kAnyPalmType) {
+      Search(state, probe, AllRows(state), top_k, query, heap);
+      return;
+    }
+    RowRange range;
+    state.gallery().PartitionRange(palm_type, range.begin, range.end);
+    Search(state, probe, range, top_k, query, heap);
+    if (!config_.palm_type.fallback)
+      return;
+    std::vector<ScoredRow> rows = heap.Take();
+    for (const ScoredRow& item : rows) {
+      heap.Push(item.score, item.row);
+    }
+    if (!rows.empty() && AcceptRow(state, probe, rows[0].row))
+      return;
+    state.gallery().PartitionRange(1 - palm_type, range.begin, range.end);
+    Search(state, probe, range, top_k, query, heap);
+  }
+
+  // Search a flat gallery block by block, the partition of the palm type first, until the
+  // deadline passes. Whether every row was searched.
+  bool SearchUntil(QueryState& state, const GalleryProbe& probe, int palm_type, size_t top_k,
+                   std::chrono::steady_clock::time_point deadline, IvfPqQuery& query,
+                   TopKHeap& heap) {
+    if (state.hnsw() || state.ivf_pq()) {
+      Search(state, probe, AllRows(state), top_k, query, heap);
+      return true;
+    }
+    RowRange ranges[2] = {AllRows(state), {0, 0}};
+    if (state.gallery().partitioned() && palm_type != kAnyPalmType) {
+      state.gallery().PartitionRange(palm_type, ranges[0].begin, ranges[0].end);
+      if (config_.palm_type.fallback)
+        state.gallery().PartitionRange(1 - palm_type, ranges[1].begin, ranges[1].end);
+    }
+    size_t block_rows = std::max(kDeadlineBlockBytes / state.gallery().row_bytes(), kMinShardRows);
+    bool first = true;
+    for (const RowRange& range : ranges) {
+      // The other partition only when the best of the own one is not accepted, as in
+      // SearchPalmType(state, ).
+      if (&range != ranges) {
+        std::vector<ScoredRow> rows = heap.Take();
+        for (const ScoredRow& item : rows) {
+          heap.Push(item.score, item.row);
+        }
+        if (!rows.empty() && AcceptRow(state, probe, rows[0].row))
+          return true;
+      }
+      for (size_t begin = range.begin; begin < range.end; begin += block_rows) {
+        if (!first && std::chrono::steady_clock::now() >= deadline)
+          return false;
+        first = false;
+        // Searched on its own, as some searches replace what the heap holds.
+        TopKHeap block(top_k);
+        Search(state, probe, {begin, std::min(begin + block_rows, range.end)}, top_k, query, block);
+        for (const ScoredRow& item : block.Take()) {
+          heap.Push(item.score, item.row);
+        }
+      }
+    }
+    return true;
+  }
+
+  // Flat searches compare only the rows in range, the indexes always search every row.
+  void Search(QueryState& state, const GalleryProbe& probe, const RowRange& range, size_t top_k,
+              IvfPqQuery& query, TopKHeap& heap) {
+    if (state.hnsw()) {
+      state.hnsw()->Search(state.gallery(), probe, top_k, heap);
+    } else if (state.ivf_pq()) {
+      state.ivf_pq()->PrepareQuery(state.gallery(), probe, query);
+      state.ivf_pq()->Search(state.gallery(), query, heap);
+    } else if (probe.geometry) {
+      GeometrySearch(state, probe, range, top_k, heap);
+    } else if (UsePrefilter(probe, range)) {
+      // Binary pass over every row, float scores only for the closest codes.
+      TopKHeap binary(std::max<size_t>(config_.hamming.candidates, top_k));
+      state.gallery().HammingScan(probe, range.begin, range.end, binary);
+      state.gallery().ScanRows(probe, binary.Take(), heap);
+    } else if (cascade_ && state.has_thresholds) {
+      // The ir bound comes from the thresholds, without them every row is scored anyway.
+      CascadeSearch(state, probe, range, top_k, heap);
+    } else if (fusion_) {
+      FusedSearch(state, probe, range, top_k, heap);
+    } else if (early_exit_) {
+      PrunedSearch(state, probe, range, top_k, heap);
+    } else {
+      ParallelScan(state, probe, range, top_k, heap);
+    }
+  }
+
+  // Features scored only for the rows of a similar hand shape, see GeometryParam.
+  void GeometrySearch(const QueryState& state, const GalleryProbe& probe, const RowRange& range,
+                      size_t top_k, TopKHeap& heap) const {
+    ShardedScan(state, range, top_k, heap, [&](size_t begin, size_t end, TopKHeap& shard_heap) {
+      std::vector<ScoredRow> survivors;
+      state.gallery().GeometryScan(probe, config_.geometry.max_distance, begin, end, survivors);
+      state.gallery().ScanRows(probe, survivors, shard_heap);
+    });
+  }
+
+  // Flat scan that skips rows which cannot make the result, see EarlyExitParam.
+  void PrunedSearch(const QueryState& state, const GalleryProbe& probe, const RowRange& range,
+                    size_t top_k, TopKHeap& heap) const {
+    ScanBounds bounds;
+    if (config_.early_exit.prune && state.has_thresholds) {
+      bounds.floor[kIrChannel] = state.thresholds[kIrChannel];
+      bounds.floor[kRgbChannel] = state.thresholds[kRgbChannel];
+    }
+    bounds.accept_first = config_.early_exit.accept_first;
+    bounds.accept[kIrChannel] = config_.early_exit.accept_ir_threshold;
+    bounds.accept[kRgbChannel] = config_.early_exit.accept_rgb_threshold;
+    ShardedScan(state, range, top_k, heap, [&](size_t begin, size_t end, TopKHeap& shard_heap) {
+      state.gallery().PrunedScan(probe, bounds, begin, end, shard_heap);
+    });
+    int64_t accepted = bounds.accepted;
+    if (accepted < 0)
+      return;
+    heap.Take();
+    float scores[kChannelCount];
+    uint32_t row = static_cast<uint32_t>(accepted);
+    heap.Push(state.gallery().ScoreRow(probe, row, scores), row);
+  }
+
+  // Rows per shard of a parallel scan, zero when the range is scanned in one piece.
+  size_t ShardRows(const QueryState& state, const RowRange& range) const {
+    if (!pool_)
+      return 0;
+    size_t rows = config_.scan.shard_bytes / state.gallery().row_bytes();
+    rows = (std::max(rows, kMinShardRows) + kMinShardRows - 1) / kMinShardRows * kMinShardRows;
+    return rows < range.end - range.begin ? rows : 0;
+  }
+
+  // Run scan(begin, end, heap) over shards of the range on the pool, each shard into a heap of
+  // its own, and merge the shard heaps.
+  template<class ScanFunction>
+  void ShardedScan(const QueryState& state, const RowRange& range, size_t top_k, TopKHeap& heap,
+                   const ScanFunction& scan) const {
+    size_t shard_rows = ShardRows(state, range);
+    if (!shard_rows) {
+      scan(range.begin, range.end, heap);
+      return;
+    }
+    size_t shards = (range.end - range.begin + shard_rows - 1) / shard_rows;
+    std::vector<TopKHeap> heaps(shards, TopKHeap(top_k));
+    pool_->ParallelFor(shards, [&](size_t shard) {
+      size_t begin = range.begin + shard * shard_rows;
+      scan(begin, std::min(begin + shard_rows, range.end), heaps[shard]);
+    });
+    for (TopKHeap& shard_heap : heaps) {
+      for (const ScoredRow& item : shard_heap.Take()) {
+        heap.Push(item.score, item.row);
+      }
+    }
+  }
+
+  // Flat scan that offers every features id once, see TemplateFusion.
+  void FusedSearch(const QueryState& state, const GalleryProbe& probe, const RowRange& range,
+                   size_t top_k, TopKHeap& heap) const {
+    ShardedScan(state, range, top_k, heap, [&](size_t begin, size_t end, TopKHeap& shard_heap) {
+      state.gallery().FusedScan(probe, config_.fusion, begin, end, shard_heap);
+    });
+  }
+
+  void ParallelScan(const QueryState& state, const GalleryProbe& probe, const RowRange& range,
+                    size_t top_k, TopKHeap& heap) const {
+    ShardedScan(state, range, top_k, heap, [&](size_t begin, size_t end, TopKHeap& shard_heap) {
+      state.gallery().Scan(probe, begin, end, shard_heap);
+    });
+  }
+
+  void ParallelScanBatch(const QueryState& state, const std::vector<const GalleryProbe*>& probes,
+                         std::vector<TopKHeap>& heaps) const {
+    size_t shard_rows = ShardRows(state, AllRows(state));
+    if (!shard_rows) {
+      state.gallery().ScanBatch(probes, 0, state.gallery().size(), heaps);
+      return;
+    }
+    size_t shards = (state.gallery().size() + shard_rows - 1) / shard_rows;
+    std::vector<std::vector<TopKHeap>> shard_heaps(shards, heaps);
+    pool_->ParallelFor(shards, [&](size_t shard) {
+      size_t begin = shard * shard_rows;
+      state.gallery().ScanBatch(probes, begin, std::min(begin + shard_rows, state.gallery().size()),
+                         shard_heaps[shard]);
+    });
+    for (std::vector<TopKHeap>& shard : shard_heaps) {
+      for (size_t p = 0; p < probes.size(); ++p) {
+        for (const ScoredRow& item : shard[p].Take()) {
+          heaps[p].Push(item.score, item.row);
+        }
+      }
+    }
+  }
+
+  // Ir stage over every row, fused scores only for the rows that can still reach the ir
+  // threshold.
+  void CascadeSearch(QueryState& state, const GalleryProbe& probe, const RowRange& range,
+                     size_t top_k, TopKHeap& heap) {
+    // E.g. the partition of a palm type nobody enrolled.
+    if (range.begin == range.end)
+      return;
+    std::vector<ScoredRow> survivors;
+    float bound = state.thresholds[kIrChannel] - config_.cascade.ir_margin;
+    state.gallery().CollectAbove(probe, kIrChannel, bound, range.begin, range.end, survivors);
+    TopKHeap cascade(top_k);
+    state.gallery().ScanRows(probe, survivors, cascade);
+    state.cascade_survivors += survivors.size();
+    if (!state.cascade_ranges.empty() && state.cascade_ranges.back().end == range.begin)
+      state.cascade_ranges.back().end = range.end;
+    else
+      state.cascade_ranges.push_back(range);
+    for (const ScoredRow& item : cascade.Take()) {
+      heap.Push(item.score, item.row);
+    }
+  }
+
+  // Count a query the cascade took part in once, whatever number of ranges it searched, and
+  // every audit_interval-th one compare its result with a full scan of the same rows.
+  void CountCascade(QueryState& state, const GalleryProbe& probe, TopKHeap& heap) {
+    if (state.cascade_ranges.empty())
+      return;
+    bool audit = false;
+    {
+      std::lock_guard<std::mutex> lock(state_mutex_);
+      ++cascade_stats_.queries;
+      cascade_stats_.survivors += state.cascade_survivors;
+      audit = config_.cascade.audit_interval &&
+              cascade_stats_.queries % config_.cascade.audit_interval == 0;
+    }
+    if (audit) {
+      std::vector<ScoredRow> rows = heap.Take();
+      for (const ScoredRow& item : rows) {
+        heap.Push(item.score, item.row);
+      }
+      TopKHeap full(1);
+      for (const RowRange& range : state.cascade_ranges) {
+        state.gallery().Scan(probe, range.begin, range.end, full);
+      }
+      std::vector<ScoredRow> best = full.Take();
+      bool top1_changed = rows.empty() || best[0].row != rows[0].row;
+      bool decision_changed =
+          top1_changed && ((!rows.empty() && AcceptRow(state, probe, rows[0].row)) ||
+                           AcceptRow(state, probe, best[0].row));
+      std::lock_guard<std::mutex> lock(state_mutex_);
+      ++cascade_stats_.audited;
+      if (top1_changed)
+        ++cascade_stats_.top1_changed;
+      if (decision_changed)
+        ++cascade_stats_.decision_changed;
+    }
+    state.cascade_ranges.clear();
+    state.cascade_survivors = 0;
+  }
+
+  bool UsePrefilter(const GalleryProbe& probe, const RowRange& range) const {
+    if (!prefilter_ || range.end - range.begin <= config_.hamming.candidates)
+      return false;
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (probe_for_[c] >= 0 && !probe.codes[c])
+        return false;
+    }
+    return true;
+  }
+
+  // Exhaustive scan, from the full precision file when the gallery keeps only codes.
+  int ExactSearch(const QueryState& state, const GalleryProbe& probe, TopKHeap& heap) {
+    if (state.gallery().keep_features()) {
+      if (fusion_)
+        FusedSearch(state, probe, AllRows(state), heap.capacity(), heap);
+      else
+        ParallelScan(state, probe, AllRows(state), heap.capacity(), heap);
+      return kOk;
+    }
+    if (!rerank_store_.IsOpen())
+      return kInvalidArguments;
+    AlignedBuffer<float> buffers[kChannelCount];
+    float* features[kChannelCount] = {nullptr, nullptr};
+    for (int c = 0; c < kChannelCount; ++c) {
+      buffers[c].Resize(ProbeDim(state.gallery().dim(c)));
+      features[c] = buffers[c].data();
+    }
+    for (size_t row = 0; row < state.gallery().size(); ++row) {
+      int ret = ReadStored(state.gallery().id(row), features);
+      if (ret)
+        return ret;
+      for (int c = 0; c < kChannelCount; ++c) {
+        state.gallery().NormalizeIfCosine(features[c], buffers[c].size());
+      }
+      float scores[kChannelCount];
+      heap.Push(state.gallery().ScoreExact(probe, row, features, scores),
+                static_cast<uint32_t>(row));
+    }
+    return kOk;
+  }
+
+  CompareCandidate MakeCandidate(const QueryState& state, const GalleryProbe& probe,
+                                 const IvfPqQuery& query, size_t row) const {
+    float scores[kChannelCount];
+    CompareCandidate candidate;
+    candidate.features_id = state.gallery().id(row);
+    if (state.ivf_pq())
+      candidate.score = state.ivf_pq()->ScoreRow(state.gallery(), query, row, scores);
+    else if (fusion_)
+      candidate.score = state.gallery().ScoreGroup(probe, row, config_.fusion, scores);
+    else
+      candidate.score = state.gallery().ScoreRow(probe, row, scores);
+    candidate.ir_score = scores[kIrChannel];
+    candidate.rgb_score = scores[kRgbChannel];
+    return candidate;
+  }
+
+  // Re-score the quantized candidates with the full precision templates kept on disk.
+  int Rerank(const QueryState& state,
+             const GalleryProbe& probe,
+             const std::vector<ScoredRow>& rows,
+             uint32_t top_k,
+             std::vector<CompareCandidate>& candidates) {
+    AlignedBuffer<float> buffers[kChannelCount];
+    float* features[kChannelCount] = {nullptr, nullptr};
+    for (int c = 0; c < kChannelCount; ++c) {
+      buffers[c].Resize(ProbeDim(state.gallery().dim(c)));
+      features[c] = buffers[c].data();
+    }
+    for (const ScoredRow& item : rows) {
+      int ret = ReadStored(state.gallery().id(item.row), features);
+      if (ret)
+        return ret;
+      for (int c = 0; c < kChannelCount; ++c) {
+        state.gallery().NormalizeIfCosine(features[c], buffers[c].size());
+      }
+      float scores[kChannelCount];
+      CompareCandidate candidate;
+      candidate.features_id = state.gallery().id(item.row);
+      candidate.score = state.gallery().ScoreExact(probe, item.row, features, scores);
+      candidate.ir_score = scores[kIrChannel];
+      candidate.rgb_score = scores[kRgbChannel];
+      candidates.push_back(candidate);
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const CompareCandidate& a, const CompareCandidate& b) {
+                return a.score > b.score;
+              });
+    if (candidates.size() > top_k)
+      candidates.resize(top_k);
+    return kOk;
+  }
+
+  int ReadStored(int features_id, float* const features[kChannelCount]) {
+    std::lock_guard<std::mutex> lock(store_mutex_);
+    return rerank_store_.Read(features_id, features);
+  }
+
+  bool AcceptRow(const QueryState& state, const GalleryProbe& probe, size_t row) const {
+    IvfPqQuery query;
+    return Accept(state, MakeCandidate(state, probe, query, row));
+  }
+
+  // Every compared modality has to reach its own threshold.
+  bool Accept(const QueryState& state, const CompareCandidate& candidate) const {
+    if (probe_for_[kIrChannel] >= 0 && candidate.ir_score < state.thresholds[kIrChannel])
+      return false;
+    if (probe_for_[kRgbChannel] >= 0 && candidate.rgb_score < state.thresholds[kRgbChannel])
+      return false;
+    return true;
+  }
+
+  CompareConfig config_;
+  int probe_for_[kChannelCount];
+  float weight_[kChannelCount];
+  bool prefilter_{false};
+  bool cascade_{false};
+  bool early_exit_{false};
+  bool fusion_{false};
+  bool geometry_{false};
+  // Statistics, cards, probe cache and thresholds, under state_mutex_.
+  CascadeStats cascade_stats_;
+  // Features id of each card UID of BindCard().
+  std::unordered_map<std::string, int> cards_;
+  TierStats tier_stats_;
+  // Newest first.
+  std::deque<CachedProbe> probe_cache_;
+  float thresholds_[kChannelCount]{0.0f, 0.0f};
+  bool has_thresholds_{false};
+  // The second version only with hot_swap, see Update(). active_ and stale_ under write_mutex_.
+  std::shared_ptr<GalleryVersion> versions_[2];
+  int active_{0};
+  bool stale_{false};
+  // Whether no query holds a pin of versions_[i], see Publish().
+  std::atomic<bool> unused_[2];
+  // The pin of versions_[active_], which the queries copy, see BeginQuery(). Read and written
+  // through std::atomic_load() and std::atomic_store() only.
+  std::shared_ptr<const GalleryVersion> published_;
+  // Shared by the queries and held by Update() on the single version without hot_swap.
+  std::shared_timed_mutex version_mutex_;
+  FeatureFileStore rerank_store_;
+  std::unique_ptr<FeatureProjection> projection_;
+  std::unique_ptr<ScanThreadPool> pool_;
+  // Set by the constructor, its content changed by the queries under hot_mutex_.
+  std::unique_ptr<HotTier> hot_;
+  std::mutex hot_mutex_;
+  // Set once by OpenJournal(), which holds journal_open_mutex_ throughout.
+  std::unique_ptr<GalleryJournal> journal_;
+  std::mutex journal_open_mutex_;
+  // Set once by FollowGallery(), under write_mutex_.
+  bool following_{false};
+  std::thread follower_;
+  std::mutex follow_mutex_;
+  std::condition_variable follow_wake_;
+  bool stop_following_{false};
+  // Serializes the changes of the gallery, the queries never take it.
+  std::mutex write_mutex_;
+  std::mutex state_mutex_;
+  // rerank_store_, which the writers append to while queries read.
+  std::mutex store_mutex_;
+};
+
+}  // namespace
+
+int PalmCompare::Create(const CompareConfig& config, std::shared_ptr<PalmCompare>* compare) {
+  if (!compare)
+    return kAccessToNullPointer;
+  if (config.ir_weight < 0.0f || config.ir_weight > 1.0f)
+    return kInvalidArguments;
+  if (config.fusion != TemplateFusion::kNone &&
+      (config.index_type != CompareIndexType::kFlat || config.hamming.candidates ||
+       config.cascade.enable || config.early_exit.prune || config.early_exit.accept_first ||
+       !config.rerank_file.empty()))
+    return kInvalidArguments;
+  if (config.palm_type.partition && config.index_type != CompareIndexType::kFlat)
+    return kInvalidArguments;
+  if (config.geometry.enable &&
+      (config.index_type != CompareIndexType::kFlat || config.hamming.candidates ||
+       config.cascade.enable || config.fusion != TemplateFusion::kNone ||
+       config.early_exit.prune || config.early_exit.accept_first))
+    return kInvalidArguments;
+  if ((!config.journal.snapshot_file.empty() || !config.journal.log_file.empty()) &&
+      (config.index_type == CompareIndexType::kIvfPq || !config.rerank_file.empty()))
+    return kInvalidArguments;
+  if (config.tier.hot_capacity &&
+      (config.index_type == CompareIndexType::kIvfPq || config.fusion != TemplateFusion::kNone ||
+       !config.rerank_file.empty()))
+    return kInvalidArguments;
+  std::shared_ptr<PalmCompareImpl> impl = std::make_shared<PalmCompareImpl>(config);
+  int ret = impl->Init();
+  if (ret)
+    return ret;
+  *compare = impl;
+  return kOk;
+}
+
+int TrainIvfPq(const CompareConfig& config,
+               const std::vector<std::vector<float>>& ir_samples,
+               const std::vector<std::vector<float>>& rgb_samples) {
+  if (config.ivf_pq.codebook_file.empty())
+    return kInvalidArguments;
+  int probe_for[kChannelCount];
+  GetModeChannels(config.recog_mode, probe_for);
+  const std::vector<std::vector<float>>* samples[kChannelCount] = {&ir_samples, &rgb_samples};
+  size_t configured[kChannelCount] = {config.ir_dim, config.rgb_dim};
+  size_t dims[kChannelCount] = {0, 0};
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (probe_for[c] < 0) {
+      samples[c] = nullptr;
+      continue;
+    }
+    if (samples[c]->empty())
+      return kInvalidArguments;
+    dims[c] = configured[c] ? configured[c] : samples[c]->front().size();
+  }
+  // Codebooks of a projected gallery quantize the projected features.
+  std::vector<std::vector<float>> projected[kChannelCount];
+  if (!config.projection.file.empty()) {
+    FeatureProjection projection(config.metric);
+    int ret = projection.Load(config.projection.file);
+    if (ret)
+      return ret;
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (!samples[c])
+        continue;
+      if (dims[c] != projection.in_dim(c))
+        return kCompareDimensionMismatch;
+      projected[c].resize(samples[c]->size());
+      for (size_t i = 0; i < projected[c].size(); ++i) {
+        ret = projection.Apply(c, (*samples[c])[i], projected[c][i]);
+        if (ret)
+          return ret;
+      }
+      samples[c] = &projected[c];
+      dims[c] = projection.out_dim(c);
+    }
+  }
+  IvfPqIndex index(config.metric);
+  int ret = index.Train(dims, samples, config.ivf_pq.nlist, config.ivf_pq.pq_m);
+  if (ret)
+    return ret;
+  return index.Save(config.ivf_pq.codebook_file);
+}
+
+int TrainProjection(const CompareConfig& config,
+                    const std::vector<std::vector<float>>& ir_samples,
+                    const std::vector<std::vector<float>>& rgb_samples) {
+  if (config.projection.file.empty())
+    return kInvalidArguments;
+  int probe_for[kChannelCount];
+  GetModeChannels(config.recog_mode, probe_for);
+  const std::vector<std::vector<float>>* samples[kChannelCount] = {&ir_samples, &rgb_samples};
+  size_t configured[kChannelCount] = {config.ir_dim, config.rgb_dim};
+  size_t out_dims[kChannelCount] = {config.projection.ir_dim, config.projection.rgb_dim};
+  size_t dims[kChannelCount] = {0, 0};
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (probe_for[c] < 0) {
+      samples[c] = nullptr;
+      out_dims[c] = 0;
+      continue;
+    }
+    if (samples[c]->empty())
+      return kInvalidArguments;
+    dims[c] = configured[c] ? configured[c] : samples[c]->front().size();
+  }
+  FeatureProjection projection(config.metric);
+  int ret = projection.Train(dims, out_dims, config.projection.whiten, samples);
+  if (ret)
+    return ret;
+  return projection.Save(config.projection.file);
+}
+
+int LoadModelCpuList(const std::string& models_config, std::vector<int>& cpus) {
+  cpus.clear();
+  std::FILE* file = std::fopen(models_config.c_str(), "r");
+  if (!file)
+    return kFileNotExist;
+  static const char kKey[] = "cpu_list";
+  char line[256];
+  while (std::fgets(line, sizeof(line), file)) {
+    const char* key = std::strstr(line, kKey);
+    if (!key)
+      continue;
+    const char* value = std::strchr(key + sizeof(kKey) - 1, ':');
+    int cpu;
+    if (value && std::sscanf(value + 1, "%d", &cpu) == 1 && cpu >= 0)
+      cpus.push_back(cpu);
+  }
+  std::fclose(file);
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return kOk;
+}
+
+int StreamDataToFeatures(const StreamData& data, std::vector<float>& features) {
+  features.clear();
+  if (data.data_len % sizeof(float))
+    return kDataSizeError;
+  if (data.data_len && !data.data)
+    return kAccessToNullPointer;
+  features.resize(data.data_len / sizeof(float));
+  if (data.data_len)
+    std::memcpy(features.data(), data.data.get(), data.data_len);
+  return kOk;
+}
+
+}  // namespace StreamPalm
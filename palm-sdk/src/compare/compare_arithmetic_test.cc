@@ -0,0 +1,590 @@
+// Regression tests of PalmCompare, run by ctest when the library is built on its own.
+
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+#include "palm/compare_arithmetic.h"
+
+using namespace StreamPalm;
+
+namespace {
+
+int failures = 0;
+
+void Expect(bool condition, const char* what) {
+  if (condition)
+    return;
+  std::fprintf(stderr, "FAILED: %s\n", what);
+  ++failures;
+}
+
+std::vector<float> RandomFeatures(std::mt19937& rng, size_t dim) {
+  std::normal_distribution<float> normal;
+  std::vector<float> features(dim);
+  for (float& value : features) {
+    value = normal(rng);
+  }
+  return features;
+}
+
+std::vector<uint8_t> ReadFile(const char* path) {
+  std::vector<uint8_t> bytes;
+  std::FILE* file = std::fopen(path, "rb");
+  if (!file)
+    return bytes;
+  int c;
+  while ((c = std::fgetc(file)) != EOF) {
+    bytes.push_back(static_cast<uint8_t>(c));
+  }
+  std::fclose(file);
+  return bytes;
+}
+
+void WriteFile(const char* path, const std::vector<uint8_t>& bytes) {
+  std::FILE* file = std::fopen(path, "wb");
+  if (!file)
+    return;
+  std::fwrite(bytes.data(), 1, bytes.size(), file);
+  std::fclose(file);
+}
+
+// A query for the palm type of an empty partition, with the cascade audit on every query.
+void TestCascadeEmptyPartition() {
+  for (int fallback = 0; fallback < 2; ++fallback) {
+    CompareConfig config;
+    config.palm_type.partition = true;
+    config.palm_type.fallback = fallback != 0;
+    config.cascade.enable = true;
+    config.cascade.audit_interval = 1;
+    std::shared_ptr<PalmCompare> compare;
+    Expect(PalmCompare::Create(config, &compare) == kOk, "create");
+    if (!compare)
+      return;
+    compare->SetRecognitionThreshold(0.5f, 0.5f);
+    std::mt19937 rng(7);
+    std::vector<float> ir;
+    std::vector<float> rgb;
+    for (int id = 0; id < 100; ++id) {
+      ir = RandomFeatures(rng, 512);
+      rgb = RandomFeatures(rng, 512);
+      Expect(compare->AddFeaturesWithPalmType(id, 0, ir, rgb) == kOk, "add left palm");
+    }
+    for (int query = 0; query < 3; ++query) {
+      int features_id = -1;
+      float score = 0.0f;
+      int ret = compare->QueryFeaturesIdWithPalmType(ir, rgb, 1, features_id, score);
+      if (fallback)
+        Expect(ret == kOk && features_id == 99, "fallback finds the other palm type");
+      else
+        Expect(ret == kCompareNoMatch && features_id == -1, "empty partition has no match");
+    }
+  }
+}
+
+// Queries that search several ranges, the fallback partition or the blocks of a deadline
+// search, count and audit the cascade once each.
+void TestCascadeStatsPerQuery() {
+  CompareConfig config;
+  config.palm_type.partition = true;
+  config.cascade.enable = true;
+  config.cascade.audit_interval = 1;
+  std::shared_ptr<PalmCompare> compare;
+  Expect(PalmCompare::Create(config, &compare) == kOk, "create");
+  if (!compare)
+    return;
+  compare->SetRecognitionThreshold(0.5f, 0.5f);
+  std::mt19937 rng(11);
+  std::vector<float> ir;
+  std::vector<float> rgb;
+  // Several 4 MB blocks of the deadline search.
+  for (int id = 0; id < 3000; ++id) {
+    ir = RandomFeatures(rng, 512);
+    rgb = RandomFeatures(rng, 512);
+    compare->AddFeaturesWithPalmType(id, id % 2, ir, rgb);
+  }
+  // The last template is a right palm, found by the fallback of a left palm query.
+  int features_id = -1;
+  float score = 0.0f;
+  Expect(compare->QueryFeaturesIdWithPalmType(ir, rgb, 0, features_id, score) == kOk &&
+             features_id == 2999, "fallback query");
+  std::vector<CompareCandidate> candidates;
+  bool complete = false;
+  Expect(compare->QueryTopKWithDeadline(ir, rgb, 0, 1, 10000000, candidates, complete) == kOk &&
+             complete && candidates[0].features_id == 2999, "deadline query");
+  CascadeStats stats;
+  compare->GetCascadeStats(stats);
+  Expect(stats.queries == 2 && stats.audited == 2, "one count per query");
+  Expect(stats.top1_changed == 0, "audit against the query result");
+}
+
+// Without recognition thresholds there is no ir bound, the cascade must not drop the rows of a
+// kL2 gallery, whose scores are all below zero.
+void TestCascadeWithoutThresholds() {
+  CompareConfig config;
+  config.metric = CompareMetric::kL2;
+  config.cascade.enable = true;
+  std::shared_ptr<PalmCompare> compare;
+  Expect(PalmCompare::Create(config, &compare) == kOk, "create");
+  if (!compare)
+    return;
+  std::mt19937 rng(17);
+  std::vector<std::vector<float>> ir(50);
+  std::vector<std::vector<float>> rgb(50);
+  for (int id = 0; id < 50; ++id) {
+    ir[id] = RandomFeatures(rng, 256);
+    rgb[id] = RandomFeatures(rng, 256);
+    compare->AddFeatures(id, ir[id], rgb[id]);
+  }
+  std::vector<CompareCandidate> candidates;
+  Expect(compare->QueryTopK(ir[21], rgb[21], 3, candidates) == kOk && candidates.size() == 3 &&
+             candidates[0].features_id == 21, "kL2 cascade without thresholds");
+}
+
+// The budget holds from the first template on, before the gallery knows its row size.
+void TestMemoryBudget() {
+  CompareConfig config;
+  // Three bimodal float templates of 512 + 512 floats.
+  config.memory_budget = 3 * 4096;
+  std::shared_ptr<PalmCompare> compare;
+  Expect(PalmCompare::Create(config, &compare) == kOk, "create");
+  if (!compare)
+    return;
+  std::mt19937 rng(13);
+  std::vector<float> small = RandomFeatures(rng, 512);
+  std::vector<float> large = RandomFeatures(rng, 4096);
+  Expect(compare->AddFeatures(0, large, large) == kCompareGalleryFull,
+         "first template over the budget");
+  for (int id = 0; id < 3; ++id) {
+    Expect(compare->AddFeatures(id, small, small) == kOk, "template within the budget");
+  }
+  Expect(compare->AddFeatures(3, small, small) == kCompareGalleryFull, "budget used up");
+  Expect(compare->GetFeaturesCount() == 3, "three templates");
+}
+
+// Ids promoted by the queries while PrefetchIds() builds the new tier are kept in it.
+void TestPrefetchKeepsPromotions() {
+  CompareConfig config;
+  config.tier.hot_capacity = 8;
+  std::shared_ptr<PalmCompare> compare;
+  Expect(PalmCompare::Create(config, &compare) == kOk, "create");
+  if (!compare)
+    return;
+  compare->SetRecognitionThreshold(0.5f, 0.5f);
+  std::mt19937 rng(19);
+  std::vector<std::vector<float>> ir(400);
+  std::vector<std::vector<float>> rgb(400);
+  for (int id = 0; id < 400; ++id) {
+    ir[id] = RandomFeatures(rng, 512);
+    rgb[id] = RandomFeatures(rng, 512);
+    compare->AddFeatures(id, ir[id], rgb[id]);
+  }
+  std::atomic<bool> done{false};
+  std::thread prefetch([&] {
+    for (int round = 0; !done; ++round) {
+      compare->PrefetchIds({300 + round % 4, 301 + round % 4});
+    }
+  });
+  int lost = 0;
+  for (int id = 0; id < 200; ++id) {
+    // Matched from the whole gallery and promoted, then from the hot tier.
+    int features_id = -1;
+    float score = 0.0f;
+    compare->QueryFeaturesId(ir[id], rgb[id], features_id, score);
+    TierStats before;
+    TierStats after;
+    compare->GetTierStats(before);
+    compare->QueryFeaturesId(ir[id], rgb[id], features_id, score);
+    compare->GetTierStats(after);
+    lost += after.hot_hits != before.hot_hits + 1;
+  }
+  done = true;
+  prefetch.join();
+  Expect(lost == 0, "promotions kept by a concurrent prefetch");
+}
+
+// A gallery file of other dims than those configured is refused and leaves the gallery as it was.
+void TestLoadGalleryOtherDims() {
+  const char* const kPath = "compare_arithmetic_test.gallery";
+  std::mt19937 rng(23);
+  std::shared_ptr<PalmCompare> saved;
+  Expect(PalmCompare::Create(CompareConfig(), &saved) == kOk, "create");
+  if (!saved)
+    return;
+  for (int id = 0; id < 5; ++id) {
+    saved->AddFeatures(id, RandomFeatures(rng, 256), RandomFeatures(rng, 256));
+  }
+  Expect(saved->SaveGallery(kPath, "v1") == kOk, "save");
+  CompareConfig config;
+  config.ir_dim = 512;
+  config.rgb_dim = 512;
+  std::shared_ptr<PalmCompare> compare;
+  Expect(PalmCompare::Create(config, &compare) == kOk, "create");
+  if (!compare)
+    return;
+  compare->SetRecognitionThreshold(0.5f, 0.5f);
+  std::vector<float> ir = RandomFeatures(rng, 512);
+  std::vector<float> rgb = RandomFeatures(rng, 512);
+  compare->AddFeatures(7, ir, rgb);
+  Expect(compare->LoadGallery(kPath, "v1") == kCompareGalleryMismatch, "other dims refused");
+  int features_id = -1;
+  float score = 0.0f;
+  Expect(compare->GetFeaturesCount() == 1 &&
+             compare->QueryFeaturesId(ir, rgb, features_id, score) == kOk && features_id == 7,
+         "gallery kept");
+  std::remove(kPath);
+}
+
+// A hot_swap gallery answers as a single one, also to queries while it changes.
+void TestHotSwapMatchesSingle() {
+  CompareConfig config;
+  std::shared_ptr<PalmCompare> single;
+  Expect(PalmCompare::Create(config, &single) == kOk, "create");
+  config.hot_swap = true;
+  std::shared_ptr<PalmCompare> swapped;
+  Expect(PalmCompare::Create(config, &swapped) == kOk, "create");
+  if (!single || !swapped)
+    return;
+  std::mt19937 rng(29);
+  std::vector<std::vector<float>> ir(300);
+  std::vector<std::vector<float>> rgb(300);
+  for (int id = 0; id < 300; ++id) {
+    ir[id] = RandomFeatures(rng, 512);
+    rgb[id] = RandomFeatures(rng, 512);
+  }
+  for (int id = 0; id < 100; ++id) {
+    single->AddFeatures(id, ir[id], rgb[id]);
+    swapped->AddFeatures(id, ir[id], rgb[id]);
+  }
+  std::atomic<bool> done{false};
+  std::atomic<int> wrong{0};
+  std::thread query([&] {
+    while (!done) {
+      // Among the first 100 ids whatever the writer has done so far, 0 to 49 are never deleted.
+      std::vector<CompareCandidate> candidates;
+      swapped->QueryTopK(ir[17], rgb[17], 1, candidates);
+      wrong += candidates.empty() || candidates[0].features_id != 17;
+    }
+  });
+  for (int id = 100; id < 300; ++id) {
+    Expect(swapped->AddFeatures(id, ir[id], rgb[id]) == kOk, "add while querying");
+    single->AddFeatures(id, ir[id], rgb[id]);
+  }
+  for (int id = 50; id < 100; ++id) {
+    Expect(swapped->DeleteID(id) == kOk, "delete while querying");
+    single->DeleteID(id);
+  }
+  done = true;
+  query.join();
+  Expect(wrong == 0, "queries during the changes");
+  Expect(swapped->GetFeaturesCount() == single->GetFeaturesCount(), "same count");
+  int differ = 0;
+  for (int id = 0; id < 300; id += 7) {
+    std::vector<CompareCandidate> expected;
+    std::vector<CompareCandidate> got;
+    single->QueryTopK(ir[id], rgb[id], 5, expected);
+    swapped->QueryTopK(ir[id], rgb[id], 5, got);
+    if (got.size() != expected.size()) {
+      ++differ;
+      continue;
+    }
+    for (size_t i = 0; i < got.size(); ++i) {
+      differ += got[i].features_id != expected[i].features_id || got[i].score != expected[i].score;
+    }
+  }
+  Expect(differ == 0, "hot_swap results as with a single version");
+}
+
+// A saved gallery loads with the same answers, a damaged or foreign file is refused.
+void TestGalleryFile() {
+  const char* const kPath = "compare_arithmetic_test.gallery";
+  const char* const kDamaged = "compare_arithmetic_test_damaged.gallery";
+  std::mt19937 rng(31);
+  std::shared_ptr<PalmCompare> saved;
+  std::shared_ptr<PalmCompare> loaded;
+  Expect(PalmCompare::Create(CompareConfig(), &saved) == kOk, "create");
+  Expect(PalmCompare::Create(CompareConfig(), &loaded) == kOk, "create");
+  if (!saved || !loaded)
+    return;
+  std::vector<std::vector<float>> ir(60);
+  std::vector<std::vector<float>> rgb(60);
+  for (int id = 0; id < 60; ++id) {
+    ir[id] = RandomFeatures(rng, 256);
+    rgb[id] = RandomFeatures(rng, 256);
+    saved->AddFeatures(id, ir[id], rgb[id]);
+  }
+  saved->DeleteID(10);
+  Expect(saved->SaveGallery(kPath, "v1") == kOk, "save");
+  Expect(loaded->LoadGallery(kPath, "v1") == kOk && loaded->GetFeaturesCount() == 59, "load");
+  int differ = 0;
+  for (int id = 0; id < 60; id += 3) {
+    std::vector<CompareCandidate> expected;
+    std::vector<CompareCandidate> got;
+    saved->QueryTopK(ir[id], rgb[id], 3, expected);
+    loaded->QueryTopK(ir[id], rgb[id], 3, got);
+    differ += got.size() != expected.size() || got[0].features_id != expected[0].features_id ||
+              got[0].score != expected[0].score;
+  }
+  Expect(differ == 0, "loaded gallery answers as the saved one");
+  std::shared_ptr<PalmCompare> compare;
+  Expect(PalmCompare::Create(CompareConfig(), &compare) == kOk, "create");
+  if (!compare)
+    return;
+  compare->AddFeatures(100, ir[0], rgb[0]);
+  Expect(compare->LoadGallery(kPath, "v2") == kCompareGalleryMismatch, "other model version");
+  std::vector<uint8_t> bytes = ReadFile(kPath);
+  // The format version, after the magic.
+  std::vector<uint8_t> damaged = bytes;
+  damaged[4] ^= 0x02;
+  WriteFile(kDamaged, damaged);
+  Expect(compare->LoadGallery(kDamaged, "v1") == kCompareGalleryMismatch, "other format version");
+  damaged = bytes;
+  damaged[damaged.size() - 1] ^= 0x01;
+  WriteFile(kDamaged, damaged);
+  Expect(compare->LoadGallery(kDamaged, "v1") == kCompareGalleryCorrupt, "checksum");
+  damaged = bytes;
+  damaged.resize(damaged.size() - 64);
+  WriteFile(kDamaged, damaged);
+  Expect(compare->LoadGallery(kDamaged, "v1") == kCompareGalleryCorrupt, "truncated");
+  std::vector<CompareCandidate> candidates;
+  Expect(compare->GetFeaturesCount() == 1 &&
+             compare->QueryTopK(ir[0], rgb[0], 1, candidates) == kOk &&
+             candidates[0].features_id == 100, "gallery kept");
+  std::remove(kPath);
+  std::remove(kDamaged);
+}
+
+// Deleted ids leave the HNSW graph searchable and never come back from it.
+void TestHnswDelete() {
+  CompareConfig config;
+  config.index_type = CompareIndexType::kHnsw;
+  std::shared_ptr<PalmCompare> compare;
+  Expect(PalmCompare::Create(config, &compare) == kOk, "create");
+  if (!compare)
+    return;
+  std::mt19937 rng(37);
+  std::vector<std::vector<float>> ir(300);
+  std::vector<std::vector<float>> rgb(300);
+  for (int id = 0; id < 300; ++id) {
+    ir[id] = RandomFeatures(rng, 128);
+    rgb[id] = RandomFeatures(rng, 128);
+    compare->AddFeatures(id, ir[id], rgb[id]);
+  }
+  // Every even id, the entry point among them.
+  for (int id = 0; id < 300; id += 2) {
+    Expect(compare->DeleteID(id) == kOk, "delete");
+  }
+  Expect(compare->DeleteID(0) == kCompareIdNotFound, "deleted twice");
+  int deleted_found = 0;
+  int kept_missed = 0;
+  for (int id = 0; id < 300; ++id) {
+    std::vector<CompareCandidate> candidates;
+    compare->QueryTopK(ir[id], rgb[id], 10, candidates);
+    for (const CompareCandidate& candidate : candidates) {
+      deleted_found += candidate.features_id % 2 == 0;
+    }
+    if (id % 2)
+      kept_missed += candidates.empty() || candidates[0].features_id != id;
+    else
+      kept_missed += candidates.size() != 10;
+  }
+  Expect(deleted_found == 0, "no deleted id found");
+  Expect(kept_missed == 0, "kept ids found");
+  // The nodes of the deleted ids are reused.
+  for (int id = 0; id < 300; id += 2) {
+    compare->AddFeatures(id, ir[id], rgb[id]);
+  }
+  int missed = 0;
+  for (int id = 0; id < 300; ++id) {
+    std::vector<CompareCandidate> candidates;
+    compare->QueryTopK(ir[id], rgb[id], 1, candidates);
+    missed += candidates.empty() || candidates[0].features_id != id;
+  }
+  Expect(missed == 0 && compare->GetFeaturesCount() == 300, "ids added again");
+}
+
+// An IVF-PQ gallery with full precision rerank finds the top-k of a flat scan.
+void TestIvfPqRecall() {
+  const char* const kCodebook = "compare_arithmetic_test.codebook";
+  const char* const kRerank = "compare_arithmetic_test.rerank";
+  constexpr size_t kDim = 64;
+  constexpr int kCount = 1000;
+  std::mt19937 rng(41);
+  // Templates around 50 people, probes close to a template.
+  std::vector<std::vector<float>> ir(kCount);
+  std::vector<std::vector<float>> rgb(kCount);
+  std::vector<std::vector<float>> ir_centers;
+  std::vector<std::vector<float>> rgb_centers;
+  for (int i = 0; i < 50; ++i) {
+    ir_centers.push_back(RandomFeatures(rng, kDim));
+    rgb_centers.push_back(RandomFeatures(rng, kDim));
+  }
+  auto near = [&](const std::vector<float>& center, float spread) {
+    std::vector<float> features = RandomFeatures(rng, kDim);
+    for (size_t i = 0; i < kDim; ++i) {
+      features[i] = center[i] + spread * features[i];
+    }
+    return features;
+  };
+  for (int id = 0; id < kCount; ++id) {
+    ir[id] = near(ir_centers[id % 50], 0.5f);
+    rgb[id] = near(rgb_centers[id % 50], 0.5f);
+  }
+  CompareConfig config;
+  config.ir_dim = kDim;
+  config.rgb_dim = kDim;
+  config.index_type = CompareIndexType::kIvfPq;
+  config.ivf_pq.nlist = 16;
+  config.ivf_pq.nprobe = 4;
+  config.ivf_pq.pq_m = 16;
+  config.ivf_pq.codebook_file = kCodebook;
+  config.rerank_file = kRerank;
+  Expect(TrainIvfPq(config, ir, rgb) == kOk, "train");
+  std::shared_ptr<PalmCompare> ivf_pq;
+  std::shared_ptr<PalmCompare> flat;
+  Expect(PalmCompare::Create(config, &ivf_pq) == kOk, "create");
+  config.index_type = CompareIndexType::kFlat;
+  config.rerank_file.clear();
+  Expect(PalmCompare::Create(config, &flat) == kOk, "create");
+  if (!ivf_pq || !flat)
+    return;
+  for (int id = 0; id < kCount; ++id) {
+    ivf_pq->AddFeatures(id, ir[id], rgb[id]);
+    flat->AddFeatures(id, ir[id], rgb[id]);
+  }
+  std::vector<std::vector<float>> ir_probes;
+  std::vector<std::vector<float>> rgb_probes;
+  for (int id = 0; id < kCount; id += 10) {
+    ir_probes.push_back(near(ir[id], 0.2f));
+    rgb_probes.push_back(near(rgb[id], 0.2f));
+  }
+  size_t found = 0;
+  size_t expected = 0;
+  int top1_missed = 0;
+  for (size_t p = 0; p < ir_probes.size(); ++p) {
+    std::vector<CompareCandidate> exact;
+    std::vector<CompareCandidate> got;
+    flat->QueryTopK(ir_probes[p], rgb_probes[p], 10, exact);
+    ivf_pq->QueryTopK(ir_probes[p], rgb_probes[p], 10, got);
+    for (const CompareCandidate& item : exact) {
+      for (const CompareCandidate& other : got) {
+        found += other.features_id == item.features_id;
+      }
+    }
+    expected += exact.size();
+    top1_missed += got.empty() || got[0].features_id != exact[0].features_id;
+  }
+  Expect(top1_missed == 0, "ivf_pq top-1 as the flat scan");
+  Expect(found >= expected * 9 / 10, "ivf_pq recall@10 against the flat scan");
+  // The codes alone, against the exact scores of the rerank file.
+  float recall = 0.0f;
+  Expect(ivf_pq->MeasureRecall(ir_probes, rgb_probes, 10, recall) == kOk && recall >= 0.7f,
+         "recall of the codes");
+  std::remove(kCodebook);
+  std::remove(kRerank);
+}
+
+// VerifyCard() scores against the holder alone and follows DeleteID().
+void TestVerifyCard() {
+  std::shared_ptr<PalmCompare> compare;
+  Expect(PalmCompare::Create(CompareConfig(), &compare) == kOk, "create");
+  if (!compare)
+    return;
+  compare->SetRecognitionThreshold(0.5f, 0.5f);
+  std::mt19937 rng(43);
+  std::vector<std::vector<float>> ir(20);
+  std::vector<std::vector<float>> rgb(20);
+  for (int id = 0; id < 20; ++id) {
+    ir[id] = RandomFeatures(rng, 256);
+    rgb[id] = RandomFeatures(rng, 256);
+    compare->AddFeatures(id, ir[id], rgb[id]);
+  }
+  float score = 0.0f;
+  Expect(compare->BindCard("card", 3) == kOk, "bind");
+  Expect(compare->VerifyCard("card", ir[3], rgb[3], score) == kOk && score > 0.99f, "holder");
+  Expect(compare->VerifyCard("card", ir[4], rgb[4], score) == kCompareNoMatch, "other palm");
+  Expect(compare->VerifyCard("other", ir[3], rgb[3], score) == kCompareIdNotFound,
+         "unknown card");
+  // A card of a holder enrolled later, and a card moved to another holder.
+  Expect(compare->BindCard("late", 20) == kOk &&
+             compare->VerifyCard("late", ir[0], rgb[0], score) == kCompareIdNotFound,
+         "holder not enrolled yet");
+  compare->AddFeatures(20, ir[0], rgb[0]);
+  Expect(compare->VerifyCard("late", ir[0], rgb[0], score) == kOk, "holder enrolled");
+  Expect(compare->BindCard("late", 5) == kOk &&
+             compare->VerifyCard("late", ir[5], rgb[5], score) == kOk, "card moved");
+  compare->DeleteID(3);
+  Expect(compare->VerifyCard("card", ir[3], rgb[3], score) == kCompareIdNotFound,
+         "holder deleted");
+  Expect(compare->UnbindCard("late") == kOk &&
+             compare->VerifyCard("late", ir[5], rgb[5], score) == kCompareIdNotFound, "unbind");
+}
+
+// A cached probe does not answer for a deleted id or after the thresholds changed.
+void TestProbeCacheInvalidation() {
+  CompareConfig config;
+  config.probe_cache.entries = 4;
+  config.probe_cache.ttl_ms = 60000;
+  std::shared_ptr<PalmCompare> compare;
+  Expect(PalmCompare::Create(config, &compare) == kOk, "create");
+  if (!compare)
+    return;
+  compare->SetRecognitionThreshold(0.5f, 0.5f);
+  std::mt19937 rng(47);
+  std::vector<std::vector<float>> ir(20);
+  std::vector<std::vector<float>> rgb(20);
+  for (int id = 0; id < 20; ++id) {
+    ir[id] = RandomFeatures(rng, 256);
+    rgb[id] = RandomFeatures(rng, 256);
+    compare->AddFeatures(id, ir[id], rgb[id]);
+  }
+  int features_id = -1;
+  float score = 0.0f;
+  TierStats stats;
+  Expect(compare->QueryFeaturesId(ir[5], rgb[5], features_id, score) == kOk &&
+             compare->QueryFeaturesId(ir[5], rgb[5], features_id, score) == kOk &&
+             features_id == 5, "query");
+  compare->GetTierStats(stats);
+  Expect(stats.cache_hits == 1, "second query from the cache");
+  // The id enrolled again with another palm, the old probe no longer matches it.
+  compare->DeleteID(5);
+  compare->AddFeatures(5, RandomFeatures(rng, 256), RandomFeatures(rng, 256));
+  Expect(compare->QueryFeaturesId(ir[5], rgb[5], features_id, score) == kCompareNoMatch,
+         "cached probe of a deleted id");
+  // A probe that scores about 0.9, accepted until the thresholds rise above it.
+  std::vector<float> ir_probe = RandomFeatures(rng, 256);
+  std::vector<float> rgb_probe = RandomFeatures(rng, 256);
+  for (size_t i = 0; i < 256; ++i) {
+    ir_probe[i] = ir[7][i] + 0.5f * ir_probe[i];
+    rgb_probe[i] = rgb[7][i] + 0.5f * rgb_probe[i];
+  }
+  Expect(compare->QueryFeaturesId(ir_probe, rgb_probe, features_id, score) == kOk &&
+             features_id == 7 && score < 0.95f, "close probe");
+  compare->SetRecognitionThreshold(0.95f, 0.95f);
+  Expect(compare->QueryFeaturesId(ir_probe, rgb_probe, features_id, score) == kCompareNoMatch,
+         "cached probe under new thresholds");
+  compare->GetTierStats(stats);
+  Expect(stats.cache_hits == 1, "no further cache hits");
+}
+
+}  // namespace
+
+int main() {
+  TestCascadeEmptyPartition();
+  TestCascadeStatsPerQuery();
+  TestCascadeWithoutThresholds();
+  TestMemoryBudget();
+  TestPrefetchKeepsPromotions();
+  TestLoadGalleryOtherDims();
+  TestHotSwapMatchesSingle();
+  TestGalleryFile();
+  TestHnswDelete();
+  TestIvfPqRecall();
+  TestVerifyCard();
+  TestProbeCacheInvalidation();
+  if (failures)
+    return 1;
+  std::printf("all tests passed\n");
+  return 0;
+}
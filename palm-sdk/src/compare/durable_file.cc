@@ -0,0 +1,61 @@
+#include "durable_file.h"
+#if _WIN32
+#include <io.h>
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace StreamPalm {
+
+namespace {
+
+#if !_WIN32
+// Flush the entries of the directory that holds path, e.g. a file just renamed into it.
+bool SyncDirectory(const std::string& path) {
+  size_t slash = path.find_last_of('/');
+  std::string directory = slash == std::string::npos ? "." : path.substr(0, slash ? slash : 1);
+  int fd = open(directory.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  bool ok = fsync(fd) == 0;
+  return close(fd) == 0 && ok;
+}
+#endif
+
+}  // namespace
+
+bool SyncFile(std::FILE* file) {
+  if (std::fflush(file))
+    return false;
+#if _WIN32
+  return _commit(_fileno(file)) == 0;
+#else
+  return fsync(fileno(file)) == 0;
+#endif
+}
+
+bool RenameOver(const std::string& from, const std::string& to) {
+#if _WIN32
+  return MoveFileExA(from.c_str(), to.c_str(),
+                     MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+  // Until the directory is flushed, a power cut can still bring back the old file, or undo one
+  // rename but not a later one.
+  return std::rename(from.c_str(), to.c_str()) == 0 && SyncDirectory(to);
+#endif
+}
+
+bool TruncateFile(std::FILE* file, uint64_t size) {
+  if (std::fflush(file))
+    return false;
+#if _WIN32
+  return _chsize_s(_fileno(file), static_cast<__int64>(size)) == 0;
+#else
+  return ftruncate(fileno(file), static_cast<off_t>(size)) == 0;
+#endif
+}
+
+}  // namespace StreamPalm
@@ -0,0 +1,66 @@
+#ifndef PALM_COMPARE_DURABLE_FILE_H_
+#define PALM_COMPARE_DURABLE_FILE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace StreamPalm {
+
+// FNV-1a over 64-bit words rather than bytes, so that verifying a large gallery runs at memory
+// speed. Independent of how the data is split into Update() calls.
+class Checksum {
+ public:
+  void Update(const void* data, size_t bytes) {
+    const uint8_t* bytes_in = static_cast<const uint8_t*>(data);
+    for (; bytes && pending_bytes_; --bytes) {
+      Push(*bytes_in++);
+    }
+    for (; bytes >= sizeof(uint64_t); bytes -= sizeof(uint64_t)) {
+      uint64_t word;
+      std::memcpy(&word, bytes_in, sizeof(word));
+      Mix(word);
+      bytes_in += sizeof(word);
+    }
+    for (; bytes; --bytes) {
+      Push(*bytes_in++);
+    }
+  }
+
+  uint64_t value() const {
+    if (!pending_bytes_)
+      return hash_;
+    return (hash_ ^ pending_) * kPrime;
+  }
+
+ private:
+  static constexpr uint64_t kPrime = 0x100000001b3ull;
+
+  void Mix(uint64_t word) { hash_ = (hash_ ^ word) * kPrime; }
+  void Push(uint8_t byte) {
+    pending_ |= static_cast<uint64_t>(byte) << (8 * pending_bytes_);
+    if (++pending_bytes_ < sizeof(uint64_t))
+      return;
+    Mix(pending_);
+    pending_ = 0;
+    pending_bytes_ = 0;
+  }
+
+  uint64_t hash_{0xcbf29ce484222325ull};
+  uint64_t pending_{0};
+  size_t pending_bytes_{0};
+};
+
+// Flush a written file to the disk, so that it survives a power cut once this returns.
+bool SyncFile(std::FILE* file);
+
+// Replace to with from in one step, a reader sees either the old or the new file. Durable once
+// this returns, like the renames before it.
+bool RenameOver(const std::string& from, const std::string& to);
+
+// Cut an open file to size bytes, e.g. a torn record at the end of a log.
+bool TruncateFile(std::FILE* file, uint64_t size);
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_DURABLE_FILE_H_
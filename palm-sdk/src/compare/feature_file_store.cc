@@ -0,0 +1,66 @@
+#include "feature_file_store.h"
+
+namespace StreamPalm {
+
+int FeatureFileStore::Open(const std::string& path, size_t ir_dim, size_t rgb_dim) {
+  Close();
+  file_ = std::fopen(path.c_str(), "w+b");
+  if (!file_)
+    return kFailedToOperateFile;
+  dims_[kIrChannel] = ir_dim;
+  dims_[kRgbChannel] = rgb_dim;
+  record_size_ = sizeof(int32_t) + (ir_dim + rgb_dim) * sizeof(float);
+  end_ = 0;
+  return kOk;
+}
+
+void FeatureFileStore::Close() {
+  if (file_) {
+    std::fclose(file_);
+    file_ = nullptr;
+  }
+  offsets_.clear();
+}
+
+int FeatureFileStore::Seek(uint64_t offset) {
+#if _WIN32
+  int ret = _fseeki64(file_, static_cast<__int64>(offset), SEEK_SET);
+#else
+  int ret = fseeko(file_, static_cast<off_t>(offset), SEEK_SET);
+#endif
+  return ret ? kFailedToOperateFile : kOk;
+}
+
+int FeatureFileStore::Append(int features_id, const float* const features[kChannelCount]) {
+  if (!file_)
+    return kFileNotExist;
+  if (Seek(end_))
+    return kFailedToOperateFile;
+  int32_t id = features_id;
+  if (std::fwrite(&id, sizeof(id), 1, file_) != 1)
+    return kFailedToOperateFile;
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (dims_[c] && std::fwrite(features[c], sizeof(float), dims_[c], file_) != dims_[c])
+      return kFailedToOperateFile;
+  }
+  if (std::fflush(file_))
+    return kFailedToOperateFile;
+  offsets_[features_id] = end_;
+  end_ += record_size_;
+  return kOk;
+}
+
+int FeatureFileStore::Read(int features_id, float* const features[kChannelCount]) {
+  auto it = offsets_.find(features_id);
+  if (it == offsets_.end())
+    return kCompareIdNotFound;
+  if (Seek(it->second + sizeof(int32_t)))
+    return kFailedToOperateFile;
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (dims_[c] && std::fread(features[c], sizeof(float), dims_[c], file_) != dims_[c])
+      return kFailedToOperateFile;
+  }
+  return kOk;
+}
+
+}  // namespace StreamPalm
@@ -0,0 +1,42 @@
+#ifndef PALM_COMPARE_FEATURE_FILE_STORE_H_
+#define PALM_COMPARE_FEATURE_FILE_STORE_H_
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include "feature_gallery.h"
+
+namespace StreamPalm {
+
+// Append-only file of full precision templates next to a quantized gallery. Records are
+// [int32 features_id][ir floats][rgb floats]; only the offsets are kept in memory.
+class FeatureFileStore {
+ public:
+  FeatureFileStore() = default;
+  FeatureFileStore(const FeatureFileStore&) = delete;
+  FeatureFileStore& operator=(const FeatureFileStore&) = delete;
+  ~FeatureFileStore() { Close(); }
+
+  // Create or truncate the file, a zero dimension leaves the channel out of the records.
+  int Open(const std::string& path, size_t ir_dim, size_t rgb_dim);
+  void Close();
+  bool IsOpen() const { return file_ != nullptr; }
+
+  int Append(int features_id, const float* const features[kChannelCount]);
+  void Erase(int features_id) { offsets_.erase(features_id); }
+
+  // Read a record into caller buffers of at least dim floats per used channel.
+  int Read(int features_id, float* const features[kChannelCount]);
+
+ private:
+  int Seek(uint64_t offset);
+
+  FILE* file_{nullptr};
+  size_t dims_[kChannelCount]{0, 0};
+  uint64_t record_size_{0};
+  uint64_t end_{0};
+  std::unordered_map<int, uint64_t> offsets_;
+};
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_FEATURE_FILE_STORE_H_
@@ -0,0 +1,779 @@
+#include "feature_gallery.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace StreamPalm {
+
+// Rows scored per batch, sized so the per channel score arrays stay in L1.
+static constexpr size_t kScanBlockRows = 256;
+
+// Rows per tile of a batched scan, the tile stays in L2 while every group of probes passes it.
+static constexpr size_t kBatchTileRows = 64;
+
+// Added to the Cauchy-Schwarz bound of a pruned row.
+static constexpr float kPruneSlack = 1e-4f;
+
+FeatureGallery& FeatureGallery::operator=(const FeatureGallery& other) {
+  if (this == &other)
+    return *this;
+  // Rows borrowed from a file of its own are dropped rather than overwritten.
+  if (mapping_)
+    *this = FeatureGallery(other.metric_, other.storage_);
+  metric_ = other.metric_;
+  storage_ = other.storage_;
+  initialized_ = other.initialized_;
+  keep_features_ = other.keep_features_;
+  has_codes_ = other.has_codes_;
+  grouped_ = other.grouped_;
+  partitioned_ = other.partitioned_;
+  split_ = other.split_;
+  geometry_ = other.geometry_;
+  for (int c = 0; c < kChannelCount; ++c) {
+    code_bits_[c] = other.code_bits_[c];
+    codes_[c] = other.codes_[c];
+    channels_[c] = other.channels_[c];
+    row_kernels_[c] = other.row_kernels_[c];
+    half_channels_[c] = other.half_channels_[c];
+    int8_channels_[c] = other.int8_channels_[c];
+    int8_scales_[c] = other.int8_scales_[c];
+    sq_norms_[c] = other.sq_norms_[c];
+    tail_sq_norms_[c] = other.tail_sq_norms_[c];
+  }
+  ids_ = other.ids_;
+  rows_ = other.rows_;
+  return *this;
+}
+
+void FeatureGallery::Init(size_t ir_dim, size_t rgb_dim) {
+  size_t dims[kChannelCount] = {ir_dim, rgb_dim};
+  for (int c = 0; c < kChannelCount; ++c) {
+    channels_[c].Init(dims[c]);
+    half_channels_[c].Init(dims[c]);
+    int8_channels_[c].Init(dims[c]);
+    row_kernels_[c] = FindStrideKernels(channels_[c].stride());
+  }
+  initialized_ = true;
+}
+
+void FeatureGallery::Reserve(size_t rows) {
+  for (int c = 0; c < kChannelCount; ++c) {
+    int8_scales_[c].reserve(rows);
+    sq_norms_[c].reserve(rows);
+    tail_sq_norms_[c].reserve(rows * (kPruneSteps - 1));
+    if (code_bits_[c])
+      codes_[c].Reserve(rows);
+    if (!keep_features_)
+      continue;
+    switch (storage_) {
+      case FeatureStorage::kFloat16:
+        half_channels_[c].Reserve(rows);
+        break;
+      case FeatureStorage::kInt8:
+        int8_channels_[c].Reserve(rows);
+        break;
+      default:
+        channels_[c].Reserve(rows);
+        break;
+    }
+  }
+  if (geometry_.dim())
+    geometry_.Reserve(rows);
+  ids_.reserve(rows);
+  rows_.reserve(rows);
+}
+
+size_t FeatureGallery::row_bytes() const {
+  if (!keep_features_)
+    return 1;
+  return RowBytes(storage_, channels_[kIrChannel].dim(), channels_[kRgbChannel].dim());
+}
+
+size_t FeatureGallery::RowBytes(FeatureStorage storage, size_t ir_dim, size_t rgb_dim) {
+  size_t dims[kChannelCount] = {ir_dim, rgb_dim};
+  size_t bytes = 0;
+  for (int c = 0; c < kChannelCount; ++c) {
+    switch (storage) {
+      case FeatureStorage::kFloat16:
+        bytes += TypedMatrix<uint16_t>::Stride(dims[c]) * sizeof(uint16_t);
+        break;
+      case FeatureStorage::kInt8:
+        bytes += TypedMatrix<int8_t>::Stride(dims[c]) * sizeof(int8_t);
+        break;
+      default:
+        bytes += TypedMatrix<float>::Stride(dims[c]) * sizeof(float);
+        break;
+    }
+  }
+  return std::max<size_t>(bytes, 1);
+}
+
+int FeatureGallery::InitCodes(size_t ir_bits, size_t rgb_bits) {
+  if (!ids_.empty())
+    return kInvalidArguments;
+  size_t bits[kChannelCount] = {ir_bits, rgb_bits};
+  for (int c = 0; c < kChannelCount; ++c) {
+    code_bits_[c] = bits[c];
+    codes_[c].Init((bits[c] + 63) / 64);
+  }
+  has_codes_ = ir_bits || rgb_bits;
+  return kOk;
+}
+
+int FeatureGallery::InitGeometry(size_t dim) {
+  if (!ids_.empty())
+    return kInvalidArguments;
+  geometry_.Init(dim);
+  return kOk;
+}
+
+int FeatureGallery::Add(int features_id, const float* const features[kChannelCount],
+                        const uint64_t* const codes[kChannelCount], int partition,
+                        const float* geometry) {
+  auto group = rows_.find(features_id);
+  if (group != rows_.end() && !grouped_)
+    return kCompareIdExists;
+  if (partitioned_ && group != rows_.end() && (group->second >= split_) != (partition != 0))
+    return kInvalidArguments;
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (channels_[c].dim() && !features[c])
+      return kInvalidArguments;
+    if (code_bits_[c] && (!codes || !codes[c]))
+      return kInvalidArguments;
+  }
+  if (geometry_.dim() && !geometry)
+    return kInvalidArguments;
+
+  size_t row = ids_.size();
+  AlignedBuffer<float> scratch;
+  for (int c = 0; c < kChannelCount; ++c) {
+    size_t dim = channels_[c].dim();
+    if (!dim) {
+      sq_norms_[c].push_back(0.0f);
+      tail_sq_norms_[c].insert(tail_sq_norms_[c].end(), kPruneSteps - 1, 0.0f);
+      int8_scales_[c].push_back(0.0f);
+      continue;
+    }
+    scratch.Resize(0);
+    scratch.Resize(ProbeDim(dim));
+    std::memcpy(scratch.data(), features[c], dim * sizeof(float));
+    NormalizeIfCosine(scratch.data(), scratch.size());
+    sq_norms_[c].push_back(FeatureDot(scratch.data(), scratch.data(), scratch.size()));
+    size_t stride = channels_[c].stride();
+    for (size_t step = 0; step + 1 < kPruneSteps; ++step) {
+      size_t from = PruneStepEnd(c, step);
+      tail_sq_norms_[c].push_back(
+          FeatureDot(scratch.data() + from, scratch.data() + from, stride - from));
+    }
+    if (!keep_features_) {
+      int8_scales_[c].push_back(0.0f);
+      continue;
+    }
+
+    switch (storage_) {
+      case FeatureStorage::kFloat16: {
+        half_channels_[c].Resize(row + 1);
+        uint16_t* dst = half_channels_[c].MutableRow(row);
+        for (size_t i = 0; i < dim; ++i) {
+          dst[i] = FloatToHalf(scratch[i]);
+        }
+        int8_scales_[c].push_back(0.0f);
+        break;
+      }
+      case FeatureStorage::kInt8:
+        int8_channels_[c].Resize(row + 1);
+        int8_scales_[c].push_back(QuantizeInt8(scratch.data(), dim,
+                                               int8_channels_[c].MutableRow(row)));
+        break;
+      default:
+        channels_[c].Resize(row + 1);
+        std::memcpy(channels_[c].MutableRow(row), scratch.data(),
+                    channels_[c].stride() * sizeof(float));
+        int8_scales_[c].push_back(0.0f);
+        break;
+    }
+  }
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (!code_bits_[c])
+      continue;
+    codes_[c].Resize(row + 1);
+    std::memcpy(codes_[c].MutableRow(row), codes[c], codes_[c].dim() * sizeof(uint64_t));
+  }
+  if (geometry_.dim()) {
+    geometry_.Resize(row + 1);
+    std::memcpy(geometry_.MutableRow(row), geometry, geometry_.dim() * sizeof(float));
+  }
+  ids_.push_back(features_id);
+  if (group == rows_.end())
+    rows_[features_id] = static_cast<uint32_t>(row);
+  if (!grouped_) {
+    // A partition 0 row swaps places with the first row of partition 1.
+    if (partitioned_ && !partition)
+      SwapRows(split_++, row);
+    return kOk;
+  }
+  // After the other templates of the id, or at the end of its partition.
+  size_t target = row;
+  if (group != rows_.end())
+    target = GroupEnd(group->second);
+  else if (partitioned_ && !partition)
+    target = split_;
+  if (target < row) {
+    RotateLastRowTo(target);
+    UpdateRowsFrom(target);
+  }
+  if (partitioned_ && !partition)
+    ++split_;
+  return kOk;
+}
+
+void FeatureGallery::RotateLastRowTo(size_t row) {
+  size_t last = ids_.size() - 1;
+  ForEachRowMatrix([&](auto& matrix) { matrix.RotateLastTo(row, last + 1); });
+  for (int c = 0; c < kChannelCount; ++c) {
+    std::rotate(sq_norms_[c].begin() + row, sq_norms_[c].end() - 1, sq_norms_[c].end());
+    std::rotate(int8_scales_[c].begin() + row, int8_scales_[c].end() - 1,
+                int8_scales_[c].end());
+    std::rotate(tail_sq_norms_[c].begin() + row * (kPruneSteps - 1),
+                tail_sq_norms_[c].end() - (kPruneSteps - 1), tail_sq_norms_[c].end());
+  }
+  std::rotate(ids_.begin() + row, ids_.end() - 1, ids_.end());
+}
+
+void FeatureGallery::EraseRows(size_t begin, size_t count) {
+  size_t rows = ids_.size();
+  ForEachRowMatrix([&](auto& matrix) {
+    matrix.MoveRows(begin + count, begin, rows - begin - count);
+    matrix.Resize(rows - count);
+  });
+  for (int c = 0; c < kChannelCount; ++c) {
+    sq_norms_[c].erase(sq_norms_[c].begin() + begin, sq_norms_[c].begin() + begin + count);
+    int8_scales_[c].erase(int8_scales_[c].begin() + begin,
+                          int8_scales_[c].begin() + begin + count);
+    tail_sq_norms_[c].erase(tail_sq_norms_[c].begin() + begin * (kPruneSteps - 1),
+                            tail_sq_norms_[c].begin() + (begin + count) * (kPruneSteps - 1));
+  }
+  ids_.erase(ids_.begin() + begin, ids_.begin() + begin + count);
+}
+
+// Point the ids of the groups at or after row at their new first rows.
+void FeatureGallery::UpdateRowsFrom(size_t row) {
+  for (size_t i = row; i < ids_.size(); ++i) {
+    if (i == 0 || ids_[i] != ids_[i - 1])
+      rows_[ids_[i]] = static_cast<uint32_t>(i);
+  }
+}
+
+int FeatureGallery::Remove(int features_id) {
+  auto it = rows_.find(features_id);
+  if (it == rows_.end())
+    return kCompareIdNotFound;
+  size_t row = it->second;
+  rows_.erase(it);
+  if (grouped_) {
+    size_t count = GroupEnd(row) - row;
+    EraseRows(row, count);
+    if (row < split_)
+      split_ -= count;
+    UpdateRowsFrom(row);
+    return kOk;
+  }
+  // The last row of partition 0 fills the hole, then the last row fills its place.
+  if (row < split_) {
+    --split_;
+    MoveRowTo(split_, row);
+    row = split_;
+  }
+  MoveRowTo(ids_.size() - 1, row);
+  PopRow();
+  return kOk;
+}
+
+void FeatureGallery::MoveRowTo(size_t from, size_t to) {
+  if (from == to)
+    return;
+  ForEachRowMatrix([&](auto& matrix) { matrix.MoveRow(from, to); });
+  for (int c = 0; c < kChannelCount; ++c) {
+    sq_norms_[c][to] = sq_norms_[c][from];
+    std::copy_n(&tail_sq_norms_[c][from * (kPruneSteps - 1)], kPruneSteps - 1,
+                &tail_sq_norms_[c][to * (kPruneSteps - 1)]);
+    int8_scales_[c][to] = int8_scales_[c][from];
+  }
+  ids_[to] = ids_[from];
+  rows_[ids_[to]] = static_cast<uint32_t>(to);
+}
+
+void FeatureGallery::SwapRows(size_t a, size_t b) {
+  ForEachRowMatrix([&](auto& matrix) {
+    std::swap_ranges(matrix.MutableRow(a), matrix.MutableRow(a) + matrix.stride(),
+                     matrix.MutableRow(b));
+  });
+  for (int c = 0; c < kChannelCount; ++c) {
+    std::swap(sq_norms_[c][a], sq_norms_[c][b]);
+    std::swap_ranges(&tail_sq_norms_[c][a * (kPruneSteps - 1)],
+                     &tail_sq_norms_[c][(a + 1) * (kPruneSteps - 1)],
+                     &tail_sq_norms_[c][b * (kPruneSteps - 1)]);
+    std::swap(int8_scales_[c][a], int8_scales_[c][b]);
+  }
+  std::swap(ids_[a], ids_[b]);
+  rows_[ids_[a]] = static_cast<uint32_t>(a);
+  rows_[ids_[b]] = static_cast<uint32_t>(b);
+}
+
+void FeatureGallery::PopRow() {
+  size_t last = ids_.size() - 1;
+  ForEachRowMatrix([&](auto& matrix) { matrix.Resize(last); });
+  for (int c = 0; c < kChannelCount; ++c) {
+    sq_norms_[c].pop_back();
+    tail_sq_norms_[c].resize(last * (kPruneSteps - 1));
+    int8_scales_[c].pop_back();
+  }
+  ids_.pop_back();
+}
+
+void FeatureGallery::NormalizeIfCosine(float* features, size_t n) const {
+  if (metric_ == CompareMetric::kCosine)
+    NormalizeFeature(features, n);
+}
+
+int FeatureGallery::PrepareProbe(int channel, const std::vector<float>& features,
+                                 ProbeBuffers& buffers, GalleryProbe& probe) const {
+  size_t dim = channels_[channel].dim();
+  if (features.size() != dim)
+    return kCompareDimensionMismatch;
+  AlignedBuffer<float>& buffer = buffers.features[channel];
+  buffer.Resize(0);
+  buffer.Resize(ProbeDim(dim));
+  std::memcpy(buffer.data(), features.data(), dim * sizeof(float));
+  NormalizeIfCosine(buffer.data(), buffer.size());
+  probe.features[channel] = buffer.data();
+  probe.sq_norm[channel] = FeatureDot(buffer.data(), buffer.data(), buffer.size());
+  if (storage_ == FeatureStorage::kInt8) {
+    AlignedBuffer<int8_t>& int8_buffer = buffers.int8_features[channel];
+    int8_buffer.Resize(0);
+    int8_buffer.Resize(ProbeDim(dim));
+    probe.int8_scale[channel] = QuantizeInt8(buffer.data(), dim, int8_buffer.data());
+    probe.int8_features[channel] = int8_buffer.data();
+  }
+  return kOk;
+}
+
+int FeatureGallery::PrepareGeometry(const std::vector<float>& descriptor, ProbeBuffers& buffers,
+                                    GalleryProbe& probe) const {
+  if (descriptor.size() != geometry_.dim())
+    return kCompareDimensionMismatch;
+  buffers.geometry.Resize(0);
+  buffers.geometry.Resize(geometry_.stride());
+  std::memcpy(buffers.geometry.data(), descriptor.data(), descriptor.size() * sizeof(float));
+  probe.geometry = buffers.geometry.data();
+  return kOk;
+}
+
+void FeatureGallery::RowProbe(size_t row, const float weight[kChannelCount],
+                              ProbeBuffers& buffers, GalleryProbe& probe) const {
+  for (int c = 0; c < kChannelCount; ++c) {
+    probe.features[c] = nullptr;
+    probe.int8_features[c] = nullptr;
+    size_t dim = channels_[c].dim();
+    if (!dim)
+      continue;
+    probe.weight[c] = weight[c];
+    probe.sq_norm[c] = sq_norms_[c][row];
+    if (storage_ == FeatureStorage::kFloat32) {
+      probe.features[c] = channels_[c].Row(row);
+      continue;
+    }
+    AlignedBuffer<float>& buffer = buffers.features[c];
+    buffer.Resize(0);
+    buffer.Resize(ProbeDim(dim));
+    if (storage_ == FeatureStorage::kFloat16) {
+      const uint16_t* src = half_channels_[c].Row(row);
+      for (size_t i = 0; i < dim; ++i) {
+        buffer[i] = HalfToFloat(src[i]);
+      }
+    } else {
+      const int8_t* src = int8_channels_[c].Row(row);
+      for (size_t i = 0; i < dim; ++i) {
+        buffer[i] = src[i] * int8_scales_[c][row];
+      }
+      probe.int8_features[c] = src;
+      probe.int8_scale[c] = int8_scales_[c][row];
+    }
+    probe.features[c] = buffer.data();
+  }
+}
+
+float FeatureGallery::ChannelDot(const GalleryProbe& probe, int channel, size_t row) const {
+  switch (storage_) {
+    case FeatureStorage::kFloat16: {
+      const TypedMatrix<uint16_t>& matrix = half_channels_[channel];
+      return FeatureDotHalf(probe.features[channel], matrix.Row(row), matrix.stride());
+    }
+    case FeatureStorage::kInt8: {
+      const TypedMatrix<int8_t>& matrix = int8_channels_[channel];
+      int32_t dot = FeatureDotInt8(probe.int8_features[channel], matrix.Row(row),
+                                   matrix.stride());
+      return static_cast<float>(dot) * probe.int8_scale[channel] * int8_scales_[channel][row];
+    }
+    default: {
+      const FeatureMatrix& matrix = channels_[channel];
+      return row_kernels_[channel].dot(probe.features[channel], matrix.Row(row), matrix.stride());
+    }
+  }
+}
+
+float FeatureGallery::ChannelScore(const GalleryProbe& probe, int channel, size_t row,
+                                   float dot) const {
+  if (metric_ == CompareMetric::kCosine)
+    return dot;
+  return 2.0f * dot - probe.sq_norm[channel] - sq_norms_[channel][row];
+}
+
+float FeatureGallery::ScoreRow(const GalleryProbe& probe, size_t row,
+                               float channel_scores[kChannelCount]) const {
+  float fused = 0.0f;
+  for (int c = 0; c < kChannelCount; ++c) {
+    channel_scores[c] = 0.0f;
+    if (!probe.features[c])
+      continue;
+    channel_scores[c] = ChannelScore(probe, c, row, ChannelDot(probe, c, row));
+    fused += probe.weight[c] * channel_scores[c];
+  }
+  return fused;
+}
+
+float FeatureGallery::ScoreExact(const GalleryProbe& probe, size_t row,
+                                 const float* const features[kChannelCount],
+                                 float channel_scores[kChannelCount]) const {
+  float fused = 0.0f;
+  for (int c = 0; c < kChannelCount; ++c) {
+    channel_scores[c] = 0.0f;
+    if (!probe.features[c])
+      continue;
+    float dot = FeatureDot(probe.features[c], features[c], ProbeDim(channels_[c].dim()));
+    channel_scores[c] = ChannelScore(probe, c, row, dot);
+    fused += probe.weight[c] * channel_scores[c];
+  }
+  return fused;
+}
+
+void FeatureGallery::ScoreBlock(const GalleryProbe& probe, size_t block, size_t rows,
+                                float* fused) const {
+  float dots[kScanBlockRows];
+  std::fill(fused, fused + rows, 0.0f);
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (!probe.features[c])
+      continue;
+    if (storage_ == FeatureStorage::kFloat32) {
+      const FeatureMatrix& matrix = channels_[c];
+      row_kernels_[c].dot_batch(probe.features[c], matrix.Row(block), matrix.stride(), rows, dots);
+    } else {
+      for (size_t i = 0; i < rows; ++i) {
+        dots[i] = ChannelDot(probe, c, block + i);
+      }
+    }
+    for (size_t i = 0; i < rows; ++i) {
+      fused[i] += probe.weight[c] * ChannelScore(probe, c, block + i, dots[i]);
+    }
+  }
+}
+
+void FeatureGallery::Scan(const GalleryProbe& probe, size_t begin, size_t end,
+                          TopKHeap& heap) const {
+  float fused[kScanBlockRows];
+  for (size_t block = begin; block < end; block += kScanBlockRows) {
+    size_t rows = std::min(kScanBlockRows, end - block);
+    ScoreBlock(probe, block, rows, fused);
+    for (size_t i = 0; i < rows; ++i) {
+      heap.Push(fused[i], static_cast<uint32_t>(block + i));
+    }
+  }
+}
+
+namespace {
+
+// Running fusion of the template scores of one features id.
+class TemplateScores {
+ public:
+  void Add(float score) {
+    if (score > best_) {
+      second_ = best_;
+      best_ = score;
+    } else if (score > second_) {
+      second_ = score;
+    }
+    sum_ += score;
+    ++count_;
+  }
+
+  float Fused(TemplateFusion fusion) const {
+    switch (fusion) {
+      case TemplateFusion::kMean:
+        return sum_ / count_;
+      case TemplateFusion::kTop2Mean:
+        return count_ > 1 ? 0.5f * (best_ + second_) : best_;
+      default:
+        return best_;
+    }
+  }
+
+ private:
+  float best_{-std::numeric_limits<float>::infinity()};
+  float second_{-std::numeric_limits<float>::infinity()};
+  float sum_{0.0f};
+  size_t count_{0};
+};
+
+}  // namespace
+
+void FeatureGallery::FusedScan(const GalleryProbe& probe, TemplateFusion fusion, size_t begin,
+                               size_t end, TopKHeap& heap) const {
+  while (begin < end && begin > 0 && ids_[begin] == ids_[begin - 1]) {
+    ++begin;
+  }
+  if (begin >= end)
+    return;
+  end = GroupEnd(end - 1);
+  float fused[kScanBlockRows];
+  TemplateScores scores;
+  size_t first = begin;
+  for (size_t block = begin; block < end; block += kScanBlockRows) {
+    size_t rows = std::min(kScanBlockRows, end - block);
+    ScoreBlock(probe, block, rows, fused);
+    for (size_t i = 0; i < rows; ++i) {
+      size_t row = block + i;
+      scores.Add(fused[i]);
+      if (row + 1 < end && ids_[row + 1] == ids_[row])
+        continue;
+      heap.Push(scores.Fused(fusion), static_cast<uint32_t>(first));
+      scores = TemplateScores();
+      first = row + 1;
+    }
+  }
+}
+
+float FeatureGallery::ScoreGroup(const GalleryProbe& probe, size_t row, TemplateFusion fusion,
+                                 float channel_scores[kChannelCount]) const {
+  struct TemplateScore {
+    float fused;
+    float channels[kChannelCount];
+  };
+  size_t end = GroupEnd(row);
+  std::vector<TemplateScore> ranked(end - row);
+  for (size_t r = row; r < end; ++r) {
+    ranked[r - row].fused = ScoreRow(probe, r, ranked[r - row].channels);
+  }
+  // Average the templates picked by the fusion rule, channel by channel.
+  size_t picks = fusion == TemplateFusion::kMean ? ranked.size() :
+                 fusion == TemplateFusion::kTop2Mean ? std::min<size_t>(2, ranked.size()) : 1;
+  std::partial_sort(ranked.begin(), ranked.begin() + picks, ranked.end(),
+                    [](const TemplateScore& a, const TemplateScore& b) {
+                      return a.fused > b.fused;
+                    });
+  float fused = 0.0f;
+  for (int c = 0; c < kChannelCount; ++c) {
+    channel_scores[c] = 0.0f;
+  }
+  for (size_t i = 0; i < picks; ++i) {
+    fused += ranked[i].fused / picks;
+    for (int c = 0; c < kChannelCount; ++c) {
+      channel_scores[c] += ranked[i].channels[c] / picks;
+    }
+  }
+  return fused;
+}
+
+void FeatureGallery::ScanBatch(const std::vector<const GalleryProbe*>& probes, size_t begin,
+                               size_t end, std::vector<TopKHeap>& heaps) const {
+  size_t count = probes.size();
+  if (!count)
+    return;
+  if (storage_ != FeatureStorage::kFloat32 || count == 1) {
+    for (size_t p = 0; p < count; ++p) {
+      Scan(*probes[p], begin, end, heaps[p]);
+    }
+    return;
+  }
+  std::vector<float> fused(count * kBatchTileRows);
+  float dots[kTileQueries * kBatchTileRows];
+  for (size_t block = begin; block < end; block += kBatchTileRows) {
+    size_t rows = std::min(kBatchTileRows, end - block);
+    std::fill(fused.begin(), fused.end(), 0.0f);
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (!probes[0]->features[c])
+        continue;
+      const FeatureMatrix& matrix = channels_[c];
+      for (size_t group = 0; group < count; group += kTileQueries) {
+        // A short last group repeats its final probe, the extra scores are dropped.
+        const float* queries[kTileQueries];
+        for (size_t q = 0; q < kTileQueries; ++q) {
+          queries[q] = probes[std::min(group + q, count - 1)]->features[c];
+        }
+        if (count - group == 1)
+          row_kernels_[c].dot_batch(queries[0], matrix.Row(block), matrix.stride(), rows, dots);
+        else
+          FeatureDotTile(queries, matrix.Row(block), matrix.stride(), rows, dots);
+        for (size_t q = 0; q < kTileQueries && group + q < count; ++q) {
+          const GalleryProbe& probe = *probes[group + q];
+          float* scores = &fused[(group + q) * kBatchTileRows];
+          for (size_t i = 0; i < rows; ++i) {
+            scores[i] += probe.weight[c] * ChannelScore(probe, c, block + i, dots[q * rows + i]);
+          }
+        }
+      }
+    }
+    for (size_t p = 0; p < count; ++p) {
+      for (size_t i = 0; i < rows; ++i) {
+        heaps[p].Push(fused[p * kBatchTileRows + i], static_cast<uint32_t>(block + i));
+      }
+    }
+  }
+}
+
+size_t FeatureGallery::PruneStepEnd(int channel, size_t step) const {
+  size_t stride = channels_[channel].stride();
+  size_t part = PaddedDim((stride + kPruneSteps - 1) / kPruneSteps);
+  return std::min(stride, (step + 1) * part);
+}
+
+bool FeatureGallery::Admit(const GalleryProbe& probe, ScanBounds& bounds, size_t row,
+                           float fused, const float scores[kChannelCount],
+                           TopKHeap& heap) const {
+  bool accept = bounds.accept_first;
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (!probe.features[c])
+      continue;
+    if (scores[c] < bounds.floor[c])
+      return false;
+    accept = accept && scores[c] >= bounds.accept[c];
+  }
+  heap.Push(fused, static_cast<uint32_t>(row));
+  int64_t none = -1;
+  return accept && bounds.accepted.compare_exchange_strong(none, static_cast<int64_t>(row));
+}
+
+void FeatureGallery::PrunedScan(const GalleryProbe& probe, ScanBounds& bounds, size_t begin,
+                                size_t end, TopKHeap& heap) const {
+  float scores[kChannelCount];
+  if (storage_ != FeatureStorage::kFloat32) {
+    for (size_t row = begin; row < end; ++row) {
+      if ((row - begin) % kScanBlockRows == 0 && bounds.accepted >= 0)
+        return;
+      if (Admit(probe, bounds, row, ScoreRow(probe, row, scores), scores, heap))
+        return;
+    }
+    return;
+  }
+  // Norms of the probe after each checkpoint.
+  float probe_tails[kChannelCount][kPruneSteps - 1];
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (!probe.features[c])
+      continue;
+    size_t stride = channels_[c].stride();
+    for (size_t step = 0; step + 1 < kPruneSteps; ++step) {
+      const float* tail = probe.features[c] + PruneStepEnd(c, step);
+      probe_tails[c][step] = FeatureDot(tail, tail, stride - PruneStepEnd(c, step));
+    }
+  }
+  for (size_t row = begin; row < end; ++row) {
+    if ((row - begin) % kScanBlockRows == 0 && bounds.accepted >= 0)
+      return;
+    float dots[kChannelCount]{0.0f, 0.0f};
+    bool pruned = false;
+    for (size_t step = 0; step < kPruneSteps && !pruned; ++step) {
+      for (int c = 0; c < kChannelCount; ++c) {
+        if (!probe.features[c])
+          continue;
+        size_t from = step ? PruneStepEnd(c, step - 1) : 0;
+        dots[c] += FeatureDot(probe.features[c] + from, channels_[c].Row(row) + from,
+                              PruneStepEnd(c, step) - from);
+      }
+      if (step + 1 == kPruneSteps)
+        break;
+      float upper_fused = 0.0f;
+      for (int c = 0; c < kChannelCount && !pruned; ++c) {
+        if (!probe.features[c])
+          continue;
+        float rest = std::sqrt(probe_tails[c][step] *
+                               tail_sq_norms_[c][row * (kPruneSteps - 1) + step]);
+        // The slack covers the rounding of the partial sums against a single FeatureDot().
+        float upper = ChannelScore(probe, c, row, dots[c] + rest + kPruneSlack);
+        pruned = upper < bounds.floor[c];
+        upper_fused += probe.weight[c] * upper;
+      }
+      pruned = pruned || upper_fused < heap.Bound();
+    }
+    if (pruned)
+      continue;
+    float fused = 0.0f;
+    for (int c = 0; c < kChannelCount; ++c) {
+      scores[c] = probe.features[c] ? ChannelScore(probe, c, row, dots[c]) : 0.0f;
+      fused += probe.weight[c] * scores[c];
+    }
+    if (Admit(probe, bounds, row, fused, scores, heap))
+      return;
+  }
+}
+
+void FeatureGallery::HammingScan(const GalleryProbe& probe, size_t begin, size_t end,
+                                 TopKHeap& heap) const {
+  for (size_t row = begin; row < end; ++row) {
+    float distance = 0.0f;
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (!probe.codes[c] || !code_bits_[c])
+        continue;
+      const TypedMatrix<uint64_t>& matrix = codes_[c];
+      distance += probe.weight[c] *
+                  HammingDistance(probe.codes[c], matrix.Row(row), matrix.stride());
+    }
+    heap.Push(-distance, static_cast<uint32_t>(row));
+  }
+}
+
+void FeatureGallery::GeometryScan(const GalleryProbe& probe, float max_distance, size_t begin,
+                                  size_t end, std::vector<ScoredRow>& rows) const {
+  // Compare sums, the padding of both sides is zero.
+  size_t stride = geometry_.stride();
+  float bound = max_distance * geometry_.dim();
+  for (size_t row = begin; row < end; ++row) {
+    const float* values = geometry_.Row(row);
+    float sum = 0.0f;
+    for (size_t i = 0; i < stride; ++i) {
+      sum += std::fabs(probe.geometry[i] - values[i]);
+    }
+    if (sum <= bound)
+      rows.push_back({-sum / geometry_.dim(), static_cast<uint32_t>(row)});
+  }
+}
+
+void FeatureGallery::CollectAbove(const GalleryProbe& probe, int channel, float bound,
+                                  size_t begin, size_t end, std::vector<ScoredRow>& rows) const {
+  float dots[kScanBlockRows];
+  for (size_t block = begin; block < end; block += kScanBlockRows) {
+    size_t count = std::min(kScanBlockRows, end - block);
+    if (storage_ == FeatureStorage::kFloat32) {
+      const FeatureMatrix& matrix = channels_[channel];
+      row_kernels_[channel].dot_batch(probe.features[channel], matrix.Row(block), matrix.stride(),
+                                      count, dots);
+    } else {
+      for (size_t i = 0; i < count; ++i) {
+        dots[i] = ChannelDot(probe, channel, block + i);
+      }
+    }
+    for (size_t i = 0; i < count; ++i) {
+      float score = ChannelScore(probe, channel, block + i, dots[i]);
+      if (score >= bound)
+        rows.push_back({score, static_cast<uint32_t>(block + i)});
+    }
+  }
+}
+
+void FeatureGallery::ScanRows(const GalleryProbe& probe, const std::vector<ScoredRow>& rows,
+                              TopKHeap& heap) const {
+  float scores[kChannelCount];
+  for (const ScoredRow& item : rows) {
+    heap.Push(ScoreRow(probe, item.row, scores), item.row);
+  }
+}
+
+}  // namespace StreamPalm
@@ -0,0 +1,360 @@
+#ifndef PALM_COMPARE_FEATURE_GALLERY_H_
+#define PALM_COMPARE_FEATURE_GALLERY_H_
+
+#include <atomic>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "aligned_buffer.h"
+#include "feature_kernels.h"
+#include "mapped_file.h"
+#include "palm/compare_arithmetic.h"
+#include "top_k_heap.h"
+
+namespace StreamPalm {
+
+enum FeatureChannel { kIrChannel = 0, kRgbChannel, kChannelCount };
+
+// Row major matrix of features, each row zero padded to a whole number of cache lines.
+template<class T>
+class TypedMatrix {
+ public:
+  using Value = T;
+
+  // Elements per row of features of length dim.
+  static size_t Stride(size_t dim) { return (dim + LaneOf<T>() - 1) / LaneOf<T>() * LaneOf<T>(); }
+
+  void Init(size_t dim) {
+    dim_ = dim;
+    stride_ = Stride(dim);
+  }
+  size_t dim() const { return dim_; }
+  size_t stride() const { return stride_; }
+  const T* Row(size_t row) const { return data_.data() + row * stride_; }
+  T* MutableRow(size_t row) { return data_.data() + row * stride_; }
+  void Resize(size_t rows) { data_.Resize(rows * stride_); }
+  void Reserve(size_t rows) { data_.Reserve(rows * stride_); }
+  // Use rows at data in place, see AlignedBuffer::Borrow().
+  void Borrow(T* data, size_t rows) { data_.Borrow(data, rows * stride_); }
+  void Own() { data_.Own(); }
+  void MoveRow(size_t from, size_t to) {
+    std::memcpy(MutableRow(to), Row(from), stride_ * sizeof(T));
+  }
+  // Ranges may overlap.
+  void MoveRows(size_t from, size_t to, size_t count) {
+    std::memmove(MutableRow(to), Row(from), count * stride_ * sizeof(T));
+  }
+  // Move the last of rows to position row, the rows in between shift down by one.
+  void RotateLastTo(size_t row, size_t rows) {
+    std::vector<T> last(Row(rows - 1), Row(rows - 1) + stride_);
+    MoveRows(row, row + 1, rows - 1 - row);
+    std::memcpy(MutableRow(row), last.data(), stride_ * sizeof(T));
+  }
+
+ private:
+  size_t dim_{0};
+  size_t stride_{0};
+  AlignedBuffer<T> data_;
+};
+
+using FeatureMatrix = TypedMatrix<float>;
+
+// A probe prepared for one gallery, features[c] is nullptr when channel c is not compared.
+// int8_features is only set for a FeatureStorage::kInt8 gallery, codes only for the Hamming
+// prefilter and geometry only for the skeleton filter.
+struct GalleryProbe {
+  const float* features[kChannelCount]{nullptr, nullptr};
+  const int8_t* int8_features[kChannelCount]{nullptr, nullptr};
+  const uint64_t* codes[kChannelCount]{nullptr, nullptr};
+  const float* geometry{nullptr};
+  float int8_scale[kChannelCount]{0.0f, 0.0f};
+  float sq_norm[kChannelCount]{0.0f, 0.0f};
+  float weight[kChannelCount]{0.0f, 0.0f};
+};
+
+// Parts of a pruned dot product, the row is bounded after each of the first kPruneSteps - 1.
+// A single check halfway is the fastest, the partial sums of more parts cost more than the
+// extra rows they drop.
+constexpr size_t kPruneSteps = 2;
+
+// Limits of FeatureGallery::PrunedScan(), shared by the shards of one query.
+struct ScanBounds {
+  // A row is dropped as soon as it cannot reach floor[c] on a compared channel.
+  float floor[kChannelCount]{-std::numeric_limits<float>::infinity(),
+                             -std::numeric_limits<float>::infinity()};
+
+  // Stop at the first row that reaches accept[c] on every compared channel.
+  bool accept_first{false};
+  float accept[kChannelCount]{0.0f, 0.0f};
+
+  // Row accepted by any shard, -1 while none. The other shards stop once it is set.
+  std::atomic<int64_t> accepted{-1};
+};
+
+// Aligned copies of the probe features, owned by the calling thread.
+struct ProbeBuffers {
+  AlignedBuffer<float> features[kChannelCount];
+  AlignedBuffer<int8_t> int8_features[kChannelCount];
+  AlignedBuffer<uint64_t> codes[kChannelCount];
+  AlignedBuffer<float> geometry;
+};
+
+// Bytes of GalleryFileKey::model_version in a file, with the terminating zero.
+constexpr size_t kModelVersionSize = 128;
+
+// Identity of the features in a gallery file, a gallery only loads a file of the same.
+struct GalleryFileKey {
+  std::string model_version;
+  uint32_t recog_mode{0};
+  // Dims the gallery must have, zero for any. Not written to the file.
+  size_t dims[kChannelCount]{};
+};
+
+// Structure-of-arrays template store: one contiguous aligned matrix per channel plus parallel
+// id, norm and scale arrays. Removal moves the last row into the hole, so rows stay dense.
+// Depending on the storage, rows are kept as float, half or int8 with a per row scale.
+class FeatureGallery {
+ public:
+  FeatureGallery(CompareMetric metric, FeatureStorage storage) :
+      metric_(metric),
+      storage_(storage) {}
+  // A copy owns its rows, also those the other gallery borrows from the file of Load().
+  FeatureGallery(const FeatureGallery& other) :
+      metric_(other.metric_),
+      storage_(other.storage_) {
+    *this = other;
+  }
+  FeatureGallery(FeatureGallery&& other) = default;
+  FeatureGallery& operator=(const FeatureGallery& other);
+  FeatureGallery& operator=(FeatureGallery&& other) = default;
+
+  // A zero dimension leaves the channel unused.
+  void Init(size_t ir_dim, size_t rgb_dim);
+  bool IsInitialized() const { return initialized_; }
+  // Keep only ids and norms, for an index that holds the templates in compressed form.
+  void SetKeepFeatures(bool keep) { keep_features_ = keep; }
+  bool keep_features() const { return keep_features_; }
+  // Allow several templates per features id, kept in adjacent rows in the order they were added.
+  // Rows then move on Add() and Remove() to keep the groups together.
+  void SetGrouped(bool grouped) { grouped_ = grouped; }
+  bool grouped() const { return grouped_; }
+  // Keep the rows of partition 0 ahead of those of partition 1, so that each partition is a row
+  // range of its own. Add() and Remove() swap rows across the boundary.
+  void SetPartitioned(bool partitioned) { partitioned_ = partitioned; }
+  bool partitioned() const { return partitioned_; }
+  void PartitionRange(int partition, size_t& begin, size_t& end) const {
+    begin = partition ? split_ : 0;
+    end = partition ? ids_.size() : split_;
+  }
+  void Reserve(size_t rows);
+
+  // Keep a packed binary code per row for the Hamming prefilter, zero bits for a channel without
+  // codes. Only while the gallery is empty.
+  int InitCodes(size_t ir_bits, size_t rgb_bits);
+  bool has_codes() const { return has_codes_; }
+  size_t code_bits(int channel) const { return code_bits_[channel]; }
+  size_t code_words(int channel) const { return codes_[channel].stride(); }
+
+  // Keep a skeleton geometry descriptor of dim values per row for GeometryScan(). Only while the
+  // gallery is empty.
+  int InitGeometry(size_t dim);
+  size_t geometry_dim() const { return geometry_.dim(); }
+
+  // codes[c] is required for every channel with code bits once InitCodes() was called, geometry
+  // once InitGeometry() was. In a grouped gallery an existing id gets another template and
+  // Remove() drops all of them. partition is 0 or 1 for a partitioned gallery, the templates of
+  // an id share one.
+  int Add(int features_id, const float* const features[kChannelCount],
+          const uint64_t* const codes[kChannelCount] = nullptr, int partition = 0,
+          const float* geometry = nullptr);
+  int Remove(int features_id);
+
+  // Write every row to a gallery file, which is replaced atomically. log_sequence is the last
+  // GalleryJournal record the rows include, zero without a journal.
+  int Save(const std::string& path, const GalleryFileKey& key, uint64_t log_sequence = 0) const;
+
+  // Map a gallery file of Save() into a gallery that is not initialized yet, constructed with
+  // the metric and storage of the file. The matrices are scanned in place from the mapping, only
+  // the ids, norms and scales are copied. The gallery is left as it was when it fails. A
+  // read_only mapping shares its pages with every other process mapping the file, the gallery
+  // must not be changed then.
+  int Load(const std::string& path, const GalleryFileKey& key,
+           uint64_t* log_sequence = nullptr, bool read_only = false);
+  // Copy the rows borrowed from the file of Load() and close it, e.g. before the file is
+  // replaced on Windows, which does not allow that while it is mapped.
+  void Unmap();
+  // Null once the rows are no longer borrowed from a file.
+  const MappedFile* mapping() const { return mapping_.get(); }
+
+  size_t size() const { return ids_.size(); }
+  size_t dim(int channel) const { return channels_[channel].dim(); }
+  int id(size_t row) const { return ids_[row]; }
+  bool Contains(int features_id) const { return rows_.count(features_id) != 0; }
+  // Row past the last template of the id stored at row.
+  size_t GroupEnd(size_t row) const {
+    size_t end = row + 1;
+    while (end < ids_.size() && ids_[end] == ids_[row]) {
+      ++end;
+    }
+    return end;
+  }
+  // First row of the features id for a grouped gallery.
+  bool FindRow(int features_id, size_t& row) const {
+    auto it = rows_.find(features_id);
+    if (it == rows_.end())
+      return false;
+    row = it->second;
+    return true;
+  }
+  CompareMetric metric() const { return metric_; }
+  FeatureStorage storage() const { return storage_; }
+
+  // Bytes a scan reads per row, used to size the shards of a parallel scan.
+  size_t row_bytes() const;
+  // row_bytes() of a gallery that keeps its features, before it is initialized.
+  static size_t RowBytes(FeatureStorage storage, size_t ir_dim, size_t rgb_dim);
+
+  // Copy features into aligned padded probe buffers, normalized for kCosine.
+  int PrepareProbe(int channel, const std::vector<float>& features, ProbeBuffers& buffers,
+                   GalleryProbe& probe) const;
+
+  // Copy a geometry descriptor into a padded probe buffer.
+  int PrepareGeometry(const std::vector<float>& descriptor, ProbeBuffers& buffers,
+                      GalleryProbe& probe) const;
+
+  // Use a stored row as the probe, e.g. to link a new node of a graph index. Quantized rows
+  // are decoded into the buffers.
+  void RowProbe(size_t row, const float weight[kChannelCount], ProbeBuffers& buffers,
+                GalleryProbe& probe) const;
+
+  // Scale features to unit length for kCosine, the form rows are scored in.
+  void NormalizeIfCosine(float* features, size_t n) const;
+
+  // Score rows [begin, end) and offer every row to the heap.
+  void Scan(const GalleryProbe& probe, size_t begin, size_t end, TopKHeap& heap) const;
+
+  // Scan() for a batch of probes that compare the same channels, heaps[p] receives the rows of
+  // probes[p]. Float rows are scored in tiles shared by kTileQueries probes at a time.
+  void ScanBatch(const std::vector<const GalleryProbe*>& probes, size_t begin, size_t end,
+                 std::vector<TopKHeap>& heaps) const;
+
+  // Scan() of a grouped gallery that offers every features id once, at its first row, with the
+  // scores of its templates fused. An id belongs to the range its first row falls in.
+  void FusedScan(const GalleryProbe& probe, TemplateFusion fusion, size_t begin, size_t end,
+                 TopKHeap& heap) const;
+
+  // Fused and per channel scores of the templates of the id starting at row, the channel scores
+  // fused by the same rule.
+  float ScoreGroup(const GalleryProbe& probe, size_t row, TemplateFusion fusion,
+                   float channel_scores[kChannelCount]) const;
+
+  // Scan() that drops rows which cannot enter the heap or reach bounds.floor. The inner product
+  // of a float row is computed in kPruneSteps parts and abandoned once the remaining dimensions
+  // could not lift it far enough, by Cauchy-Schwarz on the norms of the remaining parts.
+  void PrunedScan(const GalleryProbe& probe, ScanBounds& bounds, size_t begin, size_t end,
+                  TopKHeap& heap) const;
+
+  // Offer rows [begin, end) to the heap by their weighted Hamming distance to probe.codes, as a
+  // negative score so that the heap keeps the closest rows.
+  void HammingScan(const GalleryProbe& probe, size_t begin, size_t end, TopKHeap& heap) const;
+
+  // Rows in [begin, end) whose geometry lies within max_distance of probe.geometry, by the mean
+  // absolute difference of the descriptors. The distance is returned as a negative
+  // ScoredRow::score.
+  void GeometryScan(const GalleryProbe& probe, float max_distance, size_t begin, size_t end,
+                    std::vector<ScoredRow>& rows) const;
+
+  // Rows in [begin, end) whose score on a single channel reaches bound, the first stage of a
+  // cascade. The channel score is returned as ScoredRow::score.
+  void CollectAbove(const GalleryProbe& probe, int channel, float bound, size_t begin,
+                    size_t end, std::vector<ScoredRow>& rows) const;
+
+  // Score only the given rows, e.g. the survivors of HammingScan().
+  void ScanRows(const GalleryProbe& probe, const std::vector<ScoredRow>& rows,
+                TopKHeap& heap) const;
+
+  // Per channel and fused score of a single row.
+  float ScoreRow(const GalleryProbe& probe, size_t row, float channel_scores[kChannelCount]) const;
+
+  // Per channel and fused score against full precision features of a row, e.g. re-read from
+  // disk for re-ranking. features[c] are padded to ProbeDim() and normalized like the probe.
+  float ScoreExact(const GalleryProbe& probe, size_t row,
+                   const float* const features[kChannelCount],
+                   float channel_scores[kChannelCount]) const;
+
+  // Channel score of a row from its inner product with the probe.
+  float ChannelScore(const GalleryProbe& probe, int channel, size_t row, float dot) const;
+
+ private:
+  float ChannelDot(const GalleryProbe& probe, int channel, size_t row) const;
+  // fused[i] = fused score of row block + i, i < rows <= kScanBlockRows.
+  void ScoreBlock(const GalleryProbe& probe, size_t block, size_t rows, float* fused) const;
+  void MoveRowTo(size_t from, size_t to);
+  void SwapRows(size_t a, size_t b);
+  void PopRow();
+  void RotateLastRowTo(size_t row);
+  void EraseRows(size_t begin, size_t count);
+  void UpdateRowsFrom(size_t row);
+
+  // Call function with every matrix that holds a row per template.
+  template<class Function>
+  void ForEachRowMatrix(const Function& function) { ForEachRowMatrix(*this, function); }
+  template<class Function>
+  void ForEachRowMatrix(const Function& function) const { ForEachRowMatrix(*this, function); }
+  template<class Gallery, class Function>
+  static void ForEachRowMatrix(Gallery& gallery, const Function& function) {
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (gallery.channels_[c].dim() && gallery.keep_features_) {
+        switch (gallery.storage_) {
+          case FeatureStorage::kFloat16:
+            function(gallery.half_channels_[c]);
+            break;
+          case FeatureStorage::kInt8:
+            function(gallery.int8_channels_[c]);
+            break;
+          default:
+            function(gallery.channels_[c]);
+            break;
+        }
+      }
+      if (gallery.code_bits_[c])
+        function(gallery.codes_[c]);
+    }
+    if (gallery.geometry_.dim())
+      function(gallery.geometry_);
+  }
+  size_t PruneStepEnd(int channel, size_t step) const;
+  bool Admit(const GalleryProbe& probe, ScanBounds& bounds, size_t row, float fused,
+             const float scores[kChannelCount], TopKHeap& heap) const;
+
+  CompareMetric metric_;
+  FeatureStorage storage_;
+  bool initialized_{false};
+  bool keep_features_{true};
+  bool has_codes_{false};
+  bool grouped_{false};
+  bool partitioned_{false};
+  size_t split_{0};  // First row of partition 1.
+  size_t code_bits_[kChannelCount]{0, 0};
+  TypedMatrix<uint64_t> codes_[kChannelCount];
+  FeatureMatrix geometry_;
+  FeatureMatrix channels_[kChannelCount];
+  // Float kernels picked for the row stride of each channel by Init().
+  FixedStrideKernels row_kernels_[kChannelCount]{};
+  TypedMatrix<uint16_t> half_channels_[kChannelCount];
+  TypedMatrix<int8_t> int8_channels_[kChannelCount];
+  std::vector<float> int8_scales_[kChannelCount];
+  std::vector<float> sq_norms_[kChannelCount];
+  // Squared norm of the row after each pruning checkpoint, kPruneSteps - 1 per row.
+  std::vector<float> tail_sq_norms_[kChannelCount];
+  std::vector<int> ids_;
+  std::unordered_map<int, uint32_t> rows_;
+  // File of Load(), borrowed by the matrices until they grow past it.
+  std::unique_ptr<MappedFile> mapping_;
+};
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_FEATURE_GALLERY_H_
@@ -0,0 +1,249 @@
+#include "feature_gallery.h"
+#include <cstdio>
+#include <type_traits>
+#include "durable_file.h"
+
+namespace StreamPalm {
+
+namespace {
+
+constexpr uint32_t kGalleryMagic = 0x4c414750;  // "PGAL"
+constexpr uint32_t kGalleryVersion = 1;
+
+enum GalleryFileFlag : uint32_t {
+  kGroupedFlag = 1u << 0,
+  kPartitionedFlag = 1u << 1,
+  kKeepFeaturesFlag = 1u << 2,
+};
+
+// Start of a gallery file. The payload follows in sections, each padded to kFeatureAlignment so
+// that the matrices can be used in place: the ids, then per channel the squared norms, tail norms
+// and int8 scales, then the matrices in ForEachRowMatrix() order.
+struct GalleryFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recog_mode;
+  uint32_t metric;
+  uint32_t storage;
+  uint32_t flags;
+  uint32_t dims[kChannelCount];
+  uint32_t code_bits[kChannelCount];
+  uint32_t geometry_dim;
+  uint32_t prune_steps;
+  uint64_t rows;
+  uint64_t split;
+  uint64_t payload_size;
+  uint64_t checksum;  // Of the payload.
+  uint64_t log_sequence;
+  char model_version[kModelVersionSize];
+  uint8_t reserved[40];
+};
+
+static_assert(sizeof(GalleryFileHeader) % kFeatureAlignment == 0,
+              "the payload must start aligned");
+
+size_t AlignedSize(size_t bytes) {
+  return (bytes + kFeatureAlignment - 1) / kFeatureAlignment * kFeatureAlignment;
+}
+
+// Writes the payload sections and sums them up.
+class PayloadWriter {
+ public:
+  explicit PayloadWriter(std::FILE* file) : file_(file) {}
+
+  bool Section(const void* data, size_t bytes) {
+    static const uint8_t kPadding[kFeatureAlignment] = {};
+    return Write(data, bytes) && Write(kPadding, AlignedSize(bytes) - bytes);
+  }
+  uint64_t size() const { return size_; }
+  uint64_t checksum() const { return checksum_.value(); }
+
+ private:
+  bool Write(const void* data, size_t bytes) {
+    if (!bytes)
+      return true;
+    if (std::fwrite(data, bytes, 1, file_) != 1)
+      return false;
+    checksum_.Update(data, bytes);
+    size_ += bytes;
+    return true;
+  }
+
+  std::FILE* file_;
+  uint64_t size_{0};
+  Checksum checksum_;
+};
+
+// Hands out the sections of a mapped payload in the order they were written.
+class PayloadReader {
+ public:
+  PayloadReader(uint8_t* data, uint64_t size) : data_(data), size_(size) {}
+
+  // nullptr once the payload is too short.
+  uint8_t* Section(size_t bytes) {
+    size_t aligned = AlignedSize(bytes);
+    if (aligned > size_ - offset_)
+      return nullptr;
+    uint8_t* section = data_ + offset_;
+    offset_ += aligned;
+    return section;
+  }
+  bool AtEnd() const { return offset_ == size_; }
+
+ private:
+  uint8_t* data_;
+  uint64_t size_;
+  uint64_t offset_{0};
+};
+
+template<class T>
+bool ReadSection(PayloadReader& reader, size_t count, std::vector<T>& values) {
+  const uint8_t* section = reader.Section(count * sizeof(T));
+  if (!section)
+    return false;
+  values.resize(count);
+  if (count)
+    std::memcpy(values.data(), section, count * sizeof(T));
+  return true;
+}
+
+}  // namespace
+
+int FeatureGallery::Save(const std::string& path, const GalleryFileKey& key,
+                         uint64_t log_sequence) const {
+  if (!initialized_ || key.model_version.size() >= kModelVersionSize)
+    return kInvalidArguments;
+  GalleryFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = kGalleryMagic;
+  header.version = kGalleryVersion;
+  header.recog_mode = key.recog_mode;
+  header.metric = static_cast<uint32_t>(metric_);
+  header.storage = static_cast<uint32_t>(storage_);
+  header.flags = 0;
+  if (grouped_)
+    header.flags |= kGroupedFlag;
+  if (partitioned_)
+    header.flags |= kPartitionedFlag;
+  if (keep_features_)
+    header.flags |= kKeepFeaturesFlag;
+  for (int c = 0; c < kChannelCount; ++c) {
+    header.dims[c] = static_cast<uint32_t>(channels_[c].dim());
+    header.code_bits[c] = static_cast<uint32_t>(code_bits_[c]);
+  }
+  header.geometry_dim = static_cast<uint32_t>(geometry_.dim());
+  header.prune_steps = static_cast<uint32_t>(kPruneSteps);
+  header.rows = ids_.size();
+  header.split = split_;
+  header.log_sequence = log_sequence;
+  std::memcpy(header.model_version, key.model_version.data(), key.model_version.size());
+
+  // Written next to the file and renamed over it, a reader never sees half a gallery.
+  std::string temp_path = path + ".tmp";
+  std::FILE* file = std::fopen(temp_path.c_str(), "wb");
+  if (!file)
+    return kFailedToOperateFile;
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  PayloadWriter writer(file);
+  size_t rows = ids_.size();
+  ok = ok && writer.Section(ids_.data(), rows * sizeof(int));
+  for (int c = 0; c < kChannelCount; ++c) {
+    ok = ok && writer.Section(sq_norms_[c].data(), rows * sizeof(float));
+    ok = ok && writer.Section(tail_sq_norms_[c].data(),
+                              tail_sq_norms_[c].size() * sizeof(float));
+    ok = ok && writer.Section(int8_scales_[c].data(), rows * sizeof(float));
+  }
+  ForEachRowMatrix([&](const auto& matrix) {
+    using Value = typename std::decay_t<decltype(matrix)>::Value;
+    ok = ok && writer.Section(matrix.Row(0), rows * matrix.stride() * sizeof(Value));
+  });
+  header.payload_size = writer.size();
+  header.checksum = writer.checksum();
+  ok = ok && std::fseek(file, 0, SEEK_SET) == 0 &&
+       std::fwrite(&header, sizeof(header), 1, file) == 1 && SyncFile(file);
+  ok = std::fclose(file) == 0 && ok;
+  if (!ok || !RenameOver(temp_path, path)) {
+    std::remove(temp_path.c_str());
+    return kFailedToOperateFile;
+  }
+  return kOk;
+}
+
+int FeatureGallery::Load(const std::string& path, const GalleryFileKey& key,
+                         uint64_t* log_sequence, bool read_only) {
+  if (initialized_)
+    return kInvalidArguments;
+  std::unique_ptr<MappedFile> mapping(new MappedFile);
+  int ret = mapping->Open(path, read_only);
+  if (ret)
+    return ret;
+  GalleryFileHeader header;
+  if (mapping->size() < sizeof(header))
+    return kCompareGalleryCorrupt;
+  std::memcpy(&header, mapping->data(), sizeof(header));
+  if (header.magic != kGalleryMagic || header.payload_size != mapping->size() - sizeof(header))
+    return kCompareGalleryCorrupt;
+  if (header.version != kGalleryVersion)
+    return kCompareGalleryMismatch;
+  // Reading every page also faults the mapping in ahead of the first scan.
+  uint8_t* payload = mapping->data() + sizeof(header);
+  Checksum checksum;
+  checksum.Update(payload, header.payload_size);
+  if (checksum.value() != header.checksum)
+    return kCompareGalleryCorrupt;
+  header.model_version[kModelVersionSize - 1] = '\0';
+  if (key.model_version != header.model_version || key.recog_mode != header.recog_mode ||
+      header.metric != static_cast<uint32_t>(metric_) ||
+      header.storage != static_cast<uint32_t>(storage_) || header.prune_steps != kPruneSteps)
+    return kCompareGalleryMismatch;
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (key.dims[c] && header.dims[c] != key.dims[c])
+      return kCompareGalleryMismatch;
+  }
+  if (header.rows > std::numeric_limits<uint32_t>::max() || header.split > header.rows ||
+      (header.flags & ~(kGroupedFlag | kPartitionedFlag | kKeepFeaturesFlag)))
+    return kCompareGalleryCorrupt;
+
+  // Read into a gallery of its own, this one is only replaced once the whole payload is read.
+  FeatureGallery loaded(metric_, storage_);
+  loaded.Init(header.dims[kIrChannel], header.dims[kRgbChannel]);
+  loaded.InitCodes(header.code_bits[kIrChannel], header.code_bits[kRgbChannel]);
+  loaded.InitGeometry(header.geometry_dim);
+  loaded.grouped_ = (header.flags & kGroupedFlag) != 0;
+  loaded.partitioned_ = (header.flags & kPartitionedFlag) != 0;
+  loaded.keep_features_ = (header.flags & kKeepFeaturesFlag) != 0;
+  loaded.split_ = header.split;
+  size_t rows = header.rows;
+  PayloadReader reader(payload, header.payload_size);
+  bool ok = ReadSection(reader, rows, loaded.ids_);
+  for (int c = 0; c < kChannelCount; ++c) {
+    ok = ok && ReadSection(reader, rows, loaded.sq_norms_[c]);
+    ok = ok && ReadSection(reader, rows * (kPruneSteps - 1), loaded.tail_sq_norms_[c]);
+    ok = ok && ReadSection(reader, rows, loaded.int8_scales_[c]);
+  }
+  loaded.ForEachRowMatrix([&](auto& matrix) {
+    using Value = typename std::decay_t<decltype(matrix)>::Value;
+    uint8_t* section = ok ? reader.Section(rows * matrix.stride() * sizeof(Value)) : nullptr;
+    ok = section != nullptr;
+    if (ok)
+      matrix.Borrow(reinterpret_cast<Value*>(section), rows);
+  });
+  if (!ok || !reader.AtEnd())
+    return kCompareGalleryCorrupt;
+  loaded.rows_.reserve(rows);
+  loaded.UpdateRowsFrom(0);
+  loaded.mapping_ = std::move(mapping);
+  *this = std::move(loaded);
+  if (log_sequence)
+    *log_sequence = header.log_sequence;
+  return kOk;
+}
+
+void FeatureGallery::Unmap() {
+  if (!mapping_)
+    return;
+  ForEachRowMatrix([](auto& matrix) { matrix.Own(); });
+  mapping_.reset();
+}
+
+}  // namespace StreamPalm
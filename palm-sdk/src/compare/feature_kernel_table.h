@@ -0,0 +1,70 @@
+#ifndef PALM_COMPARE_FEATURE_KERNEL_TABLE_H_
+#define PALM_COMPARE_FEATURE_KERNEL_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace StreamPalm {
+
+// Probes scored together by FeatureDotTile().
+constexpr size_t kTileQueries = 4;
+
+// Row strides in floats with kernels unrolled at compile time, the ir and rgb feature lengths
+// of the palm models padded to whole cache lines.
+constexpr size_t kFixedStrideCount = 4;
+constexpr size_t kFixedStrides[kFixedStrideCount] = {128, 256, 512, 1024};
+
+// Entries of FeatureKernels::fixed for a FixedDot<kStride>() and FixedDotBatch<kStride>()
+// template of a variant, in the order of kFixedStrides.
+#define PALM_FIXED_STRIDE_KERNELS(dot, dot_batch)                                  \
+  {{128, dot<128>, dot_batch<128>}, {256, dot<256>, dot_batch<256>},              \
+   {512, dot<512>, dot_batch<512>}, {1024, dot<1024>, dot_batch<1024>}}
+
+// Unroll the next loop completely, for a trip count known at compile time.
+#if defined(__clang__)
+#define PALM_UNROLL_LOOP _Pragma("unroll")
+#elif defined(__GNUC__)
+#define PALM_UNROLL_LOOP _Pragma("GCC unroll 8")
+#else
+#define PALM_UNROLL_LOOP
+#endif
+
+// dot and dot_batch for rows of one stride. The length argument of dot and the stride of
+// dot_batch are ignored, they are the stride.
+struct FixedStrideKernels {
+  size_t stride;
+  float (*dot)(const float* a, const float* b, size_t n);
+  void (*dot_batch)(const float* query, const float* base, size_t stride, size_t rows,
+                    float* scores);
+};
+
+// One instruction set variant of the kernels declared in feature_kernels.h, which documents
+// them. A variant is a translation unit of its own compiled for its instruction set, and
+// includes nothing but this header and the intrinsics: an inline or template function emitted
+// there could be the copy the linker keeps for callers on CPUs without that instruction set.
+// A nullptr entry falls back to the next slower variant.
+struct FeatureKernels {
+  const char* isa;
+  float (*dot)(const float* a, const float* b, size_t n);
+  void (*dot_batch)(const float* query, const float* base, size_t stride, size_t rows,
+                    float* scores);
+  void (*dot_tile)(const float* const queries[kTileQueries], const float* base, size_t stride,
+                   size_t rows, float* scores);
+  int32_t (*dot_int8)(const int8_t* a, const int8_t* b, size_t n);
+  float (*dot_half)(const float* a, const uint16_t* b, size_t n);
+  uint32_t (*hamming)(const uint64_t* a, const uint64_t* b, size_t words);
+  FixedStrideKernels fixed[kFixedStrideCount];
+};
+
+// The variants, nullptr when the build does not target the instruction set. The scalar one is
+// always built, it is the reference the others are checked against.
+const FeatureKernels* ScalarFeatureKernels();
+const FeatureKernels* Sse42FeatureKernels();
+const FeatureKernels* Avx2FeatureKernels();
+const FeatureKernels* Avx512FeatureKernels();
+// A VPOPCNTDQ Hamming kernel on top of Avx512FeatureKernels().
+const FeatureKernels* Avx512VpopcntdqFeatureKernels();
+const FeatureKernels* NeonFeatureKernels();
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_FEATURE_KERNEL_TABLE_H_
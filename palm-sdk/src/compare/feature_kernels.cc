@@ -0,0 +1,380 @@
+#include "feature_kernels.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#if defined(__x86_64__) || defined(_M_X64)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace StreamPalm {
+
+namespace {
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+void Cpuid(unsigned leaf, unsigned regs[4]) {
+#if defined(_MSC_VER)
+  int values[4];
+  __cpuidex(values, static_cast<int>(leaf), 0);
+  for (int i = 0; i < 4; ++i) {
+    regs[i] = static_cast<unsigned>(values[i]);
+  }
+#else
+  __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the OS saves on a context switch, XCR0.
+uint64_t OsSavedState() {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  uint32_t eax;
+  uint32_t edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+// Whether the CPU, and the OS for the wider registers, run the variant.
+bool CpuRuns(const char* isa) {
+  unsigned regs[4];
+  Cpuid(0, regs);
+  unsigned max_leaf = regs[0];
+  Cpuid(1, regs);
+  unsigned ecx1 = regs[2];
+  bool sse42 = (ecx1 >> 20) & 1;
+  bool popcnt = (ecx1 >> 23) & 1;
+  if (!std::strcmp(isa, "sse4.2"))
+    return sse42 && popcnt;
+  bool fma = (ecx1 >> 12) & 1;
+  bool osxsave = (ecx1 >> 27) & 1;
+  bool f16c = (ecx1 >> 29) & 1;
+  if (!osxsave || max_leaf < 7)
+    return false;
+  uint64_t state = OsSavedState();
+  Cpuid(7, regs);
+  unsigned ebx7 = regs[1];
+  bool avx2 = sse42 && popcnt && fma && f16c && ((ebx7 >> 5) & 1) && (state & 0x6) == 0x6;
+  if (!std::strcmp(isa, "avx2"))
+    return avx2;
+  // The opmask and upper zmm state on top of the ymm state.
+  bool avx512 = avx2 && ((ebx7 >> 16) & 1) && ((ebx7 >> 30) & 1) && (state & 0xe0) == 0xe0;
+  if (!std::strcmp(isa, "avx512"))
+    return avx512;
+  unsigned ecx7 = regs[2];
+  return !std::strcmp(isa, "avx512vpopcntdq") && avx512 && ((ecx7 >> 14) & 1);
+}
+
+#else
+
+// Every aarch64 CPU has NEON, the only variant besides the scalar one.
+bool CpuRuns(const char*) {
+  return true;
+}
+
+#endif
+
+// Kernel results of a variant within rounding of the scalar reference, on data that covers
+// the tails of the batched and tiled loops.
+bool MatchesReference(const FeatureKernels& kernels, const FeatureKernels& reference) {
+  constexpr size_t kDim = 4 * kFloatsPerLine;
+  constexpr size_t kRows = 2 * kTileQueries + 1;
+  // A whole block of eight words and a tail.
+  constexpr size_t kWords = 11;
+  AlignedBuffer<float> rows(kRows * kDim);
+  AlignedBuffer<int8_t> int8_rows(kRows * kDim);
+  AlignedBuffer<uint16_t> half_rows(kDim);
+  AlignedBuffer<uint64_t> codes(2 * kWords);
+  for (size_t i = 0; i < rows.size(); ++i) {
+    rows[i] = static_cast<float>((i * 37) % 101) / 50.0f - 1.0f;
+    int8_rows[i] = static_cast<int8_t>(static_cast<int>((i * 53) % 255) - 127);
+  }
+  for (size_t i = 0; i < kDim; ++i) {
+    half_rows[i] = FloatToHalf(rows[kDim + i]);
+  }
+  for (size_t i = 0; i < codes.size(); ++i) {
+    codes[i] = 0x9e3779b97f4a7c15ull * (i + 1);
+  }
+  auto close = [](float a, float b) {
+    return std::fabs(a - b) <= 1e-3f * (1.0f + std::fabs(b));
+  };
+  const float* queries[kTileQueries];
+  for (size_t q = 0; q < kTileQueries; ++q) {
+    queries[q] = rows.data() + q * kDim;
+  }
+  float scores[kTileQueries * kRows];
+  float expected[kTileQueries * kRows];
+  kernels.dot_tile(queries, rows.data(), kDim, kRows, scores);
+  reference.dot_tile(queries, rows.data(), kDim, kRows, expected);
+  for (size_t i = 0; i < kTileQueries * kRows; ++i) {
+    if (!close(scores[i], expected[i]))
+      return false;
+  }
+  kernels.dot_batch(rows.data(), rows.data(), kDim, kRows, scores);
+  reference.dot_batch(rows.data(), rows.data(), kDim, kRows, expected);
+  for (size_t i = 0; i < kRows; ++i) {
+    if (!close(scores[i], expected[i]))
+      return false;
+  }
+  // Two rows of the longest fixed stride, shorter strides use their head.
+  constexpr size_t kFixedRows = 2;
+  constexpr size_t kMaxStride = kFixedStrides[kFixedStrideCount - 1];
+  AlignedBuffer<float> fixed_rows(kFixedRows * kMaxStride);
+  for (size_t i = 0; i < fixed_rows.size(); ++i) {
+    fixed_rows[i] = rows[i % rows.size()];
+  }
+  for (const FixedStrideKernels& fixed : kernels.fixed) {
+    fixed.dot_batch(fixed_rows.data(), fixed_rows.data(), fixed.stride, kFixedRows, scores);
+    reference.dot_batch(fixed_rows.data(), fixed_rows.data(), fixed.stride, kFixedRows,
+                        expected);
+    for (size_t i = 0; i < kFixedRows; ++i) {
+      if (!close(scores[i], expected[i]))
+        return false;
+    }
+    if (!close(fixed.dot(fixed_rows.data(), fixed_rows.data() + fixed.stride, fixed.stride),
+               expected[1]))
+      return false;
+  }
+  return close(kernels.dot(rows.data(), rows.data() + kDim, kDim),
+               reference.dot(rows.data(), rows.data() + kDim, kDim)) &&
+         close(kernels.dot_half(rows.data(), half_rows.data(), kDim),
+               reference.dot_half(rows.data(), half_rows.data(), kDim)) &&
+         kernels.dot_int8(int8_rows.data(), int8_rows.data() + kDim, kDim) ==
+             reference.dot_int8(int8_rows.data(), int8_rows.data() + kDim, kDim) &&
+         kernels.hamming(codes.data(), codes.data() + kWords, kWords) ==
+             reference.hamming(codes.data(), codes.data() + kWords, kWords);
+}
+
+struct Variant {
+  const char* isa;
+  const FeatureKernels* (*kernels)();
+};
+
+// Fastest first.
+const Variant kVariants[] = {{"avx512vpopcntdq", Avx512VpopcntdqFeatureKernels},
+                             {"avx512", Avx512FeatureKernels},
+                             {"avx2", Avx2FeatureKernels},
+                             {"sse4.2", Sse42FeatureKernels},
+                             {"neon", NeonFeatureKernels}};
+constexpr size_t kVariantCount = sizeof(kVariants) / sizeof(kVariants[0]);
+
+// First variant of kVariants to load. PALM_COMPARE_KERNELS=<isa> leaves out the faster ones,
+// e.g. avx2 to run the path of CPUs without AVX-512 on one that has it.
+size_t FirstVariant() {
+  const char* isa = std::getenv("PALM_COMPARE_KERNELS");
+  if (!isa)
+    return 0;
+  if (!std::strcmp(isa, "scalar"))
+    return kVariantCount;
+  for (size_t i = 0; i < kVariantCount; ++i) {
+    if (!std::strcmp(kVariants[i].isa, isa))
+      return i;
+  }
+  return 0;
+}
+
+// Variants built in and supported by the CPU, fastest first, the scalar one last. The gaps of a
+// variant are filled from the next slower one loaded. A variant that disagrees with the scalar
+// reference is left out.
+std::vector<FeatureKernels> LoadKernels() {
+  const FeatureKernels& reference = *ScalarFeatureKernels();
+  std::vector<FeatureKernels> loaded(1, reference);
+  for (size_t v = kVariantCount; v-- > FirstVariant();) {
+    // Before the getter, which is compiled for the instruction set as well.
+    if (!CpuRuns(kVariants[v].isa))
+      continue;
+    const FeatureKernels* built = kVariants[v].kernels();
+    if (!built)
+      continue;
+    const FeatureKernels& slower = loaded.front();
+    FeatureKernels kernels = *built;
+    kernels.dot = kernels.dot ? kernels.dot : slower.dot;
+    kernels.dot_batch = kernels.dot_batch ? kernels.dot_batch : slower.dot_batch;
+    kernels.dot_tile = kernels.dot_tile ? kernels.dot_tile : slower.dot_tile;
+    kernels.dot_int8 = kernels.dot_int8 ? kernels.dot_int8 : slower.dot_int8;
+    kernels.dot_half = kernels.dot_half ? kernels.dot_half : slower.dot_half;
+    kernels.hamming = kernels.hamming ? kernels.hamming : slower.hamming;
+    for (size_t i = 0; i < kFixedStrideCount; ++i) {
+      if (!kernels.fixed[i].dot)
+        kernels.fixed[i] = slower.fixed[i];
+    }
+    if (MatchesReference(kernels, reference))
+      loaded.insert(loaded.begin(), kernels);
+  }
+  return loaded;
+}
+
+const std::vector<FeatureKernels>& AvailableKernels() {
+  static const std::vector<FeatureKernels> available = LoadKernels();
+  return available;
+}
+
+std::atomic<const FeatureKernels*>& ActiveKernels() {
+  static std::atomic<const FeatureKernels*> active{&AvailableKernels().front()};
+  return active;
+}
+
+inline const FeatureKernels& Kernels() {
+  return *ActiveKernels().load(std::memory_order_relaxed);
+}
+
+}  // namespace
+
+const FeatureKernels* FindFeatureKernels(const char* isa) {
+  for (const FeatureKernels& kernels : AvailableKernels()) {
+    if (!std::strcmp(kernels.isa, isa))
+      return &kernels;
+  }
+  return nullptr;
+}
+
+bool SelectFeatureKernels(const char* isa) {
+  const FeatureKernels* kernels = FindFeatureKernels(isa);
+  if (!kernels)
+    return false;
+  ActiveKernels().store(kernels);
+  return true;
+}
+
+const char* FeatureKernelIsa() {
+  return Kernels().isa;
+}
+
+FixedStrideKernels FindStrideKernels(size_t stride) {
+  const FeatureKernels& kernels = Kernels();
+  for (const FixedStrideKernels& fixed : kernels.fixed) {
+    if (fixed.stride == stride)
+      return fixed;
+  }
+  return {stride, kernels.dot, kernels.dot_batch};
+}
+
+float FeatureDot(const float* a, const float* b, size_t n) {
+  return Kernels().dot(a, b, n);
+}
+
+void FeatureDotBatch(const float* query, const float* base, size_t stride, size_t rows,
+                     float* scores) {
+  Kernels().dot_batch(query, base, stride, rows, scores);
+}
+
+void FeatureDotTile(const float* const queries[kTileQueries], const float* base, size_t stride,
+                    size_t rows, float* scores) {
+  Kernels().dot_tile(queries, base, stride, rows, scores);
+}
+
+int32_t FeatureDotInt8(const int8_t* a, const int8_t* b, size_t n) {
+  return Kernels().dot_int8(a, b, n);
+}
+
+float FeatureDotHalf(const float* a, const uint16_t* b, size_t n) {
+  return Kernels().dot_half(a, b, n);
+}
+
+uint32_t HammingDistance(const uint64_t* a, const uint64_t* b, size_t words) {
+  return Kernels().hamming(a, b, words);
+}
+
+void PackSignBits(const float* a, size_t n, uint64_t* dst) {
+  std::memset(dst, 0, (n + 63) / 64 * sizeof(uint64_t));
+  for (size_t i = 0; i < n; ++i) {
+    if (a[i] > 0.0f)
+      dst[i / 64] |= 1ull << (i % 64);
+  }
+}
+
+float NormalizeFeature(float* a, size_t n) {
+  float norm = std::sqrt(FeatureDot(a, a, n));
+  if (norm > 0.0f) {
+    float scale = 1.0f / norm;
+    for (size_t i = 0; i < n; ++i) {
+      a[i] *= scale;
+    }
+  }
+  return norm;
+}
+
+float QuantizeInt8(const float* a, size_t n, int8_t* dst) {
+  float max_abs = 0.0f;
+  for (size_t i = 0; i < n; ++i) {
+    max_abs = std::max(max_abs, std::fabs(a[i]));
+  }
+  if (max_abs == 0.0f) {
+    std::memset(dst, 0, n);
+    return 0.0f;
+  }
+  float scale = max_abs / 127.0f;
+  float inv_scale = 127.0f / max_abs;
+  for (size_t i = 0; i < n; ++i) {
+    dst[i] = static_cast<int8_t>(std::lround(a[i] * inv_scale));
+  }
+  return scale;
+}
+
+uint16_t FloatToHalf(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint32_t sign = (bits >> 16) & 0x8000u;
+  uint32_t float_exp = (bits >> 23) & 0xffu;
+  uint32_t mantissa = bits & 0x7fffffu;
+  if (float_exp == 0xffu)
+    return static_cast<uint16_t>(sign | 0x7c00u | (mantissa ? 0x200u : 0u));
+  int32_t exp = static_cast<int32_t>(float_exp) - 127 + 15;
+  if (exp >= 31)
+    return static_cast<uint16_t>(sign | 0x7c00u);
+  if (exp <= 0) {
+    // Subnormal half, or zero when even the subnormal range is too small.
+    if (exp < -10)
+      return static_cast<uint16_t>(sign);
+    mantissa |= 0x800000u;
+    uint32_t shift = static_cast<uint32_t>(14 - exp);
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t middle = 1u << (shift - 1);
+    if (rest > middle || (rest == middle && (half & 1u)))
+      ++half;
+    return static_cast<uint16_t>(sign | half);
+  }
+  uint32_t half = (static_cast<uint32_t>(exp) << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fffu;
+  // A carry out of the mantissa correctly bumps the exponent, up to infinity.
+  if (rest > 0x1000u || (rest == 0x1000u && (half & 1u)))
+    ++half;
+  return static_cast<uint16_t>(sign | half);
+}
+
+float HalfToFloat(uint16_t value) {
+  uint32_t sign = static_cast<uint32_t>(value & 0x8000u) << 16;
+  uint32_t exp = (value >> 10) & 0x1fu;
+  uint32_t mantissa = value & 0x3ffu;
+  uint32_t bits;
+  if (exp == 0) {
+    if (mantissa == 0) {
+      bits = sign;
+    } else {
+      exp = 127 - 15 + 1;
+      while (!(mantissa & 0x400u)) {
+        mantissa <<= 1;
+        --exp;
+      }
+      bits = sign | (exp << 23) | ((mantissa & 0x3ffu) << 13);
+    }
+  } else if (exp == 0x1fu) {
+    bits = sign | 0x7f800000u | (mantissa << 13);
+  } else {
+    bits = sign | ((exp + 127 - 15) << 23) | (mantissa << 13);
+  }
+  float result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+}  // namespace StreamPalm
@@ -0,0 +1,85 @@
+#ifndef PALM_COMPARE_FEATURE_KERNELS_H_
+#define PALM_COMPARE_FEATURE_KERNELS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include "aligned_buffer.h"
+#include "feature_kernel_table.h"
+
+namespace StreamPalm {
+
+// Floats per cache line. Rows are zero padded to a multiple of this, so kernels have no tail.
+constexpr size_t kFloatsPerLine = kFeatureAlignment / sizeof(float);
+
+inline size_t PaddedDim(size_t dim) {
+  return (dim + kFloatsPerLine - 1) / kFloatsPerLine * kFloatsPerLine;
+}
+
+// Elements of type T per cache line, rows of T are padded to a multiple of this.
+template<class T>
+constexpr size_t LaneOf() {
+  return kFeatureAlignment / sizeof(T);
+}
+
+// Probe length that covers the padded row of every storage type, from float down to int8.
+inline size_t ProbeDim(size_t dim) {
+  return (dim + LaneOf<int8_t>() - 1) / LaneOf<int8_t>() * LaneOf<int8_t>();
+}
+
+// Inner product of two 64-byte aligned vectors, n is a multiple of kFloatsPerLine.
+float FeatureDot(const float* a, const float* b, size_t n);
+
+// scores[i] = FeatureDot(query, base + i * stride, stride) for i in [0, rows).
+void FeatureDotBatch(const float* query, const float* base, size_t stride, size_t rows,
+                     float* scores);
+
+// scores[q * rows + i] = FeatureDot(queries[q], base + i * stride, stride) for q < kTileQueries.
+// Every row is loaded once for all the queries, which keeps a batch of probes compute bound.
+void FeatureDotTile(const float* const queries[kTileQueries], const float* base, size_t stride,
+                    size_t rows, float* scores);
+
+// Scale a to unit length in place, returns the original L2 norm.
+float NormalizeFeature(float* a, size_t n);
+
+// Integer inner product of two 64-byte aligned int8 vectors, n is a multiple of 64.
+int32_t FeatureDotInt8(const int8_t* a, const int8_t* b, size_t n);
+
+// Inner product of a float vector and a half precision vector, n is a multiple of 32.
+float FeatureDotHalf(const float* a, const uint16_t* b, size_t n);
+
+// Number of differing bits of two 64-byte aligned bit vectors, words is a multiple of 8.
+uint32_t HammingDistance(const uint64_t* a, const uint64_t* b, size_t words);
+
+// Pack the sign bits of a, bit i of the result is set when a[i] > 0. dst is zero padded.
+void PackSignBits(const float* a, size_t n, uint64_t* dst);
+
+// Symmetric int8 quantization with a single scale, a[i] ~= dst[i] * scale. Returns the scale.
+float QuantizeInt8(const float* a, size_t n, int8_t* dst);
+
+// IEEE 754 binary16 conversion, round to nearest even.
+uint16_t FloatToHalf(float value);
+float HalfToFloat(uint16_t value);
+
+// The kernels above run the fastest variant of feature_kernel_table.h that the CPU supports,
+// found with CPUID on the first call. The environment variable PALM_COMPARE_KERNELS=<isa> of
+// the process starts the search at that variant, e.g. avx2.
+
+// Variant of an instruction set: "avx512vpopcntdq", "avx512", "avx2", "sse4.2", "neon" or
+// "scalar". nullptr when it is not built in, the CPU lacks it or its results differ from the
+// scalar reference.
+const FeatureKernels* FindFeatureKernels(const char* isa);
+
+// Switch the kernels above to another variant, e.g. the scalar reference to validate results.
+// Kernels already returned by FindStrideKernels() keep their variant.
+bool SelectFeatureKernels(const char* isa);
+
+// FeatureDot() and FeatureDotBatch() of the variant in use for rows of stride floats, unrolled
+// at compile time when stride is one of kFixedStrides. Looked up once per gallery, when the
+// feature lengths of the model are known.
+FixedStrideKernels FindStrideKernels(size_t stride);
+
+// Instruction set of the variant in use.
+const char* FeatureKernelIsa();
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_FEATURE_KERNELS_H_
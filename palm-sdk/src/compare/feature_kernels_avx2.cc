@@ -0,0 +1,157 @@
+#include "feature_kernel_table.h"
+#if defined(__AVX2__) && ((defined(__FMA__) && defined(__F16C__) && defined(__POPCNT__)) || \
+                          defined(_MSC_VER))
+#include <immintrin.h>
+#define PALM_COMPARE_AVX2 1
+#endif
+
+namespace StreamPalm {
+
+#ifdef PALM_COMPARE_AVX2
+
+namespace {
+
+inline float HorizontalSum(__m256 v) {
+  __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+  lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 0x55));
+  return _mm_cvtss_f32(lo);
+}
+
+float Dot(const float* a, const float* b, size_t n) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  for (size_t i = 0; i < n; i += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_load_ps(a + i), _mm256_load_ps(b + i), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_load_ps(a + i + 8), _mm256_load_ps(b + i + 8), acc1);
+  }
+  return HorizontalSum(_mm256_add_ps(acc0, acc1));
+}
+
+void DotBatch(const float* query, const float* base, size_t stride, size_t rows,
+              float* scores) {
+  for (size_t i = 0; i < rows; ++i) {
+    scores[i] = Dot(query, base + i * stride, stride);
+  }
+}
+
+// Dot() of a length known at compile time, unrolled without the loop.
+template<size_t kStride>
+float FixedDot(const float* a, const float* b, size_t) {
+  static_assert(kStride % 16 == 0, "whole pairs of ymm registers");
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  PALM_UNROLL_LOOP
+  for (size_t i = 0; i < kStride; i += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_load_ps(a + i), _mm256_load_ps(b + i), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_load_ps(a + i + 8), _mm256_load_ps(b + i + 8), acc1);
+  }
+  return HorizontalSum(_mm256_add_ps(acc0, acc1));
+}
+
+template<size_t kStride>
+void FixedDotBatch(const float* query, const float* base, size_t, size_t rows, float* scores) {
+  for (size_t i = 0; i < rows; ++i) {
+    scores[i] = FixedDot<kStride>(query, base + i * kStride, kStride);
+  }
+}
+
+void DotTile(const float* const queries[kTileQueries], const float* base, size_t stride,
+             size_t rows, float* scores) {
+  const float* q0 = queries[0];
+  const float* q1 = queries[1];
+  const float* q2 = queries[2];
+  const float* q3 = queries[3];
+  size_t i = 0;
+  // 4 queries x 2 rows of accumulators, 11 of the 16 ymm registers.
+  for (; i + 2 <= rows; i += 2) {
+    const float* r0 = base + i * stride;
+    const float* r1 = r0 + stride;
+    __m256 a00 = _mm256_setzero_ps(), a01 = _mm256_setzero_ps();
+    __m256 a10 = _mm256_setzero_ps(), a11 = _mm256_setzero_ps();
+    __m256 a20 = _mm256_setzero_ps(), a21 = _mm256_setzero_ps();
+    __m256 a30 = _mm256_setzero_ps(), a31 = _mm256_setzero_ps();
+    for (size_t d = 0; d < stride; d += 8) {
+      __m256 x0 = _mm256_load_ps(r0 + d);
+      __m256 x1 = _mm256_load_ps(r1 + d);
+      __m256 q = _mm256_load_ps(q0 + d);
+      a00 = _mm256_fmadd_ps(q, x0, a00);
+      a01 = _mm256_fmadd_ps(q, x1, a01);
+      q = _mm256_load_ps(q1 + d);
+      a10 = _mm256_fmadd_ps(q, x0, a10);
+      a11 = _mm256_fmadd_ps(q, x1, a11);
+      q = _mm256_load_ps(q2 + d);
+      a20 = _mm256_fmadd_ps(q, x0, a20);
+      a21 = _mm256_fmadd_ps(q, x1, a21);
+      q = _mm256_load_ps(q3 + d);
+      a30 = _mm256_fmadd_ps(q, x0, a30);
+      a31 = _mm256_fmadd_ps(q, x1, a31);
+    }
+    scores[i] = HorizontalSum(a00);
+    scores[i + 1] = HorizontalSum(a01);
+    scores[rows + i] = HorizontalSum(a10);
+    scores[rows + i + 1] = HorizontalSum(a11);
+    scores[2 * rows + i] = HorizontalSum(a20);
+    scores[2 * rows + i + 1] = HorizontalSum(a21);
+    scores[3 * rows + i] = HorizontalSum(a30);
+    scores[3 * rows + i + 1] = HorizontalSum(a31);
+  }
+  for (; i < rows; ++i) {
+    for (size_t q = 0; q < kTileQueries; ++q) {
+      scores[q * rows + i] = Dot(queries[q], base + i * stride, stride);
+    }
+  }
+}
+
+int32_t DotInt8(const int8_t* a, const int8_t* b, size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  for (size_t i = 0; i < n; i += 16) {
+    __m256i va = _mm256_cvtepi8_epi16(_mm_load_si128(reinterpret_cast<const __m128i*>(a + i)));
+    __m256i vb = _mm256_cvtepi8_epi16(_mm_load_si128(reinterpret_cast<const __m128i*>(b + i)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+  }
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+  return _mm_cvtsi128_si32(sum);
+}
+
+float DotHalf(const float* a, const uint16_t* b, size_t n) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  for (size_t i = 0; i < n; i += 16) {
+    __m256 vb0 = _mm256_cvtph_ps(_mm_load_si128(reinterpret_cast<const __m128i*>(b + i)));
+    __m256 vb1 = _mm256_cvtph_ps(_mm_load_si128(reinterpret_cast<const __m128i*>(b + i + 8)));
+    acc0 = _mm256_fmadd_ps(_mm256_load_ps(a + i), vb0, acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_load_ps(a + i + 8), vb1, acc1);
+  }
+  return HorizontalSum(_mm256_add_ps(acc0, acc1));
+}
+
+uint32_t Hamming(const uint64_t* a, const uint64_t* b, size_t words) {
+  uint64_t count = 0;
+  for (size_t i = 0; i < words; ++i) {
+    count += _mm_popcnt_u64(a[i] ^ b[i]);
+  }
+  return static_cast<uint32_t>(count);
+}
+
+const FeatureKernels kAvx2Kernels = {
+    "avx2", Dot, DotBatch, DotTile, DotInt8, DotHalf, Hamming,
+    PALM_FIXED_STRIDE_KERNELS(FixedDot, FixedDotBatch)};
+
+}  // namespace
+
+const FeatureKernels* Avx2FeatureKernels() {
+  return &kAvx2Kernels;
+}
+
+#else
+
+const FeatureKernels* Avx2FeatureKernels() {
+  return nullptr;
+}
+
+#endif
+
+}  // namespace StreamPalm
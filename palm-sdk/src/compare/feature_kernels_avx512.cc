@@ -0,0 +1,151 @@
+#include "feature_kernel_table.h"
+#if defined(__AVX512F__) && defined(__AVX512BW__) && (defined(__POPCNT__) || defined(_MSC_VER))
+#include <immintrin.h>
+#define PALM_COMPARE_AVX512 1
+#endif
+
+namespace StreamPalm {
+
+#ifdef PALM_COMPARE_AVX512
+
+namespace {
+
+float Dot(const float* a, const float* b, size_t n) {
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    acc0 = _mm512_fmadd_ps(_mm512_load_ps(a + i), _mm512_load_ps(b + i), acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_load_ps(a + i + 16), _mm512_load_ps(b + i + 16), acc1);
+  }
+  if (i < n)
+    acc0 = _mm512_fmadd_ps(_mm512_load_ps(a + i), _mm512_load_ps(b + i), acc0);
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+void DotBatch(const float* query, const float* base, size_t stride, size_t rows,
+              float* scores) {
+  for (size_t i = 0; i < rows; ++i) {
+    scores[i] = Dot(query, base + i * stride, stride);
+  }
+}
+
+// Dot() of a length known at compile time, unrolled without the loop and the tail.
+template<size_t kStride>
+float FixedDot(const float* a, const float* b, size_t) {
+  static_assert(kStride % 32 == 0, "whole pairs of zmm registers");
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  PALM_UNROLL_LOOP
+  for (size_t i = 0; i < kStride; i += 32) {
+    acc0 = _mm512_fmadd_ps(_mm512_load_ps(a + i), _mm512_load_ps(b + i), acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_load_ps(a + i + 16), _mm512_load_ps(b + i + 16), acc1);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+template<size_t kStride>
+void FixedDotBatch(const float* query, const float* base, size_t, size_t rows, float* scores) {
+  for (size_t i = 0; i < rows; ++i) {
+    scores[i] = FixedDot<kStride>(query, base + i * kStride, kStride);
+  }
+}
+
+void DotTile(const float* const queries[kTileQueries], const float* base, size_t stride,
+             size_t rows, float* scores) {
+  const float* q0 = queries[0];
+  const float* q1 = queries[1];
+  const float* q2 = queries[2];
+  const float* q3 = queries[3];
+  size_t i = 0;
+  // 4 queries x 2 rows of accumulators.
+  for (; i + 2 <= rows; i += 2) {
+    const float* r0 = base + i * stride;
+    const float* r1 = r0 + stride;
+    __m512 a00 = _mm512_setzero_ps(), a01 = _mm512_setzero_ps();
+    __m512 a10 = _mm512_setzero_ps(), a11 = _mm512_setzero_ps();
+    __m512 a20 = _mm512_setzero_ps(), a21 = _mm512_setzero_ps();
+    __m512 a30 = _mm512_setzero_ps(), a31 = _mm512_setzero_ps();
+    for (size_t d = 0; d < stride; d += 16) {
+      __m512 x0 = _mm512_load_ps(r0 + d);
+      __m512 x1 = _mm512_load_ps(r1 + d);
+      __m512 q = _mm512_load_ps(q0 + d);
+      a00 = _mm512_fmadd_ps(q, x0, a00);
+      a01 = _mm512_fmadd_ps(q, x1, a01);
+      q = _mm512_load_ps(q1 + d);
+      a10 = _mm512_fmadd_ps(q, x0, a10);
+      a11 = _mm512_fmadd_ps(q, x1, a11);
+      q = _mm512_load_ps(q2 + d);
+      a20 = _mm512_fmadd_ps(q, x0, a20);
+      a21 = _mm512_fmadd_ps(q, x1, a21);
+      q = _mm512_load_ps(q3 + d);
+      a30 = _mm512_fmadd_ps(q, x0, a30);
+      a31 = _mm512_fmadd_ps(q, x1, a31);
+    }
+    scores[i] = _mm512_reduce_add_ps(a00);
+    scores[i + 1] = _mm512_reduce_add_ps(a01);
+    scores[rows + i] = _mm512_reduce_add_ps(a10);
+    scores[rows + i + 1] = _mm512_reduce_add_ps(a11);
+    scores[2 * rows + i] = _mm512_reduce_add_ps(a20);
+    scores[2 * rows + i + 1] = _mm512_reduce_add_ps(a21);
+    scores[3 * rows + i] = _mm512_reduce_add_ps(a30);
+    scores[3 * rows + i + 1] = _mm512_reduce_add_ps(a31);
+  }
+  for (; i < rows; ++i) {
+    for (size_t q = 0; q < kTileQueries; ++q) {
+      scores[q * rows + i] = Dot(queries[q], base + i * stride, stride);
+    }
+  }
+}
+
+int32_t DotInt8(const int8_t* a, const int8_t* b, size_t n) {
+  __m512i acc = _mm512_setzero_si512();
+  for (size_t i = 0; i < n; i += 32) {
+    __m512i va = _mm512_cvtepi8_epi16(_mm256_load_si256(reinterpret_cast<const __m256i*>(a + i)));
+    __m512i vb = _mm512_cvtepi8_epi16(_mm256_load_si256(reinterpret_cast<const __m256i*>(b + i)));
+    acc = _mm512_add_epi32(acc, _mm512_madd_epi16(va, vb));
+  }
+  return _mm512_reduce_add_epi32(acc);
+}
+
+float DotHalf(const float* a, const uint16_t* b, size_t n) {
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  for (size_t i = 0; i < n; i += 32) {
+    __m512 vb0 = _mm512_cvtph_ps(_mm256_load_si256(reinterpret_cast<const __m256i*>(b + i)));
+    __m512 vb1 = _mm512_cvtph_ps(_mm256_load_si256(reinterpret_cast<const __m256i*>(b + i + 16)));
+    acc0 = _mm512_fmadd_ps(_mm512_load_ps(a + i), vb0, acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_load_ps(a + i + 16), vb1, acc1);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+// Scalar popcnt for the CPUs without VPOPCNTDQ, e.g. Skylake-SP and Cascade Lake. The
+// avx512vpopcntdq variant replaces it on the others.
+uint32_t Hamming(const uint64_t* a, const uint64_t* b, size_t words) {
+  uint64_t count = 0;
+  for (size_t i = 0; i < words; ++i) {
+    count += _mm_popcnt_u64(a[i] ^ b[i]);
+  }
+  return static_cast<uint32_t>(count);
+}
+
+const FeatureKernels kAvx512Kernels = {
+    "avx512", Dot, DotBatch, DotTile, DotInt8, DotHalf, Hamming,
+    PALM_FIXED_STRIDE_KERNELS(FixedDot, FixedDotBatch)};
+
+}  // namespace
+
+const FeatureKernels* Avx512FeatureKernels() {
+  return &kAvx512Kernels;
+}
+
+#else
+
+const FeatureKernels* Avx512FeatureKernels() {
+  return nullptr;
+}
+
+#endif
+
+}  // namespace StreamPalm
@@ -0,0 +1,49 @@
+#include "feature_kernel_table.h"
+#if defined(__AVX512F__) && (defined(__AVX512VPOPCNTDQ__) || defined(_MSC_VER))
+#include <immintrin.h>
+#define PALM_COMPARE_AVX512_VPOPCNTDQ 1
+#endif
+
+namespace StreamPalm {
+
+#ifdef PALM_COMPARE_AVX512_VPOPCNTDQ
+
+namespace {
+
+// Eight words per VPOPCNTQ, the tail loaded under a mask.
+uint32_t Hamming(const uint64_t* a, const uint64_t* b, size_t words) {
+  __m512i acc = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 8 <= words; i += 8) {
+    __m512i bits = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(bits));
+  }
+  if (i < words) {
+    __mmask8 tail = static_cast<__mmask8>((1u << (words - i)) - 1);
+    __m512i bits = _mm512_xor_si512(_mm512_maskz_loadu_epi64(tail, a + i),
+                                    _mm512_maskz_loadu_epi64(tail, b + i));
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(bits));
+  }
+  return static_cast<uint32_t>(_mm512_reduce_add_epi64(acc));
+}
+
+// Only the Hamming kernel, the others are those of the avx512 variant. A constant table, so
+// that nothing built for AVX-512 runs before the dispatch has checked the CPU.
+const FeatureKernels kAvx512VpopcntdqKernels = {
+    "avx512vpopcntdq", nullptr, nullptr, nullptr, nullptr, nullptr, Hamming, {}};
+
+}  // namespace
+
+const FeatureKernels* Avx512VpopcntdqFeatureKernels() {
+  return &kAvx512VpopcntdqKernels;
+}
+
+#else
+
+const FeatureKernels* Avx512VpopcntdqFeatureKernels() {
+  return nullptr;
+}
+
+#endif
+
+}  // namespace StreamPalm
@@ -0,0 +1,118 @@
+#include "feature_kernel_table.h"
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define PALM_COMPARE_NEON 1
+#endif
+
+namespace StreamPalm {
+
+#ifdef PALM_COMPARE_NEON
+
+namespace {
+
+float Dot(const float* a, const float* b, size_t n) {
+  float32x4_t acc0 = vdupq_n_f32(0.0f);
+  float32x4_t acc1 = vdupq_n_f32(0.0f);
+  float32x4_t acc2 = vdupq_n_f32(0.0f);
+  float32x4_t acc3 = vdupq_n_f32(0.0f);
+  for (size_t i = 0; i < n; i += 16) {
+    acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    acc2 = vfmaq_f32(acc2, vld1q_f32(a + i + 8), vld1q_f32(b + i + 8));
+    acc3 = vfmaq_f32(acc3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+  }
+  return vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+}
+
+void DotBatch(const float* query, const float* base, size_t stride, size_t rows,
+              float* scores) {
+  for (size_t i = 0; i < rows; ++i) {
+    scores[i] = Dot(query, base + i * stride, stride);
+  }
+}
+
+// Dot() of a length known at compile time, unrolled without the loop.
+template<size_t kStride>
+float FixedDot(const float* a, const float* b, size_t) {
+  static_assert(kStride % 16 == 0, "whole groups of 4 q registers");
+  float32x4_t acc0 = vdupq_n_f32(0.0f);
+  float32x4_t acc1 = vdupq_n_f32(0.0f);
+  float32x4_t acc2 = vdupq_n_f32(0.0f);
+  float32x4_t acc3 = vdupq_n_f32(0.0f);
+  PALM_UNROLL_LOOP
+  for (size_t i = 0; i < kStride; i += 16) {
+    acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    acc2 = vfmaq_f32(acc2, vld1q_f32(a + i + 8), vld1q_f32(b + i + 8));
+    acc3 = vfmaq_f32(acc3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+  }
+  return vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+}
+
+template<size_t kStride>
+void FixedDotBatch(const float* query, const float* base, size_t, size_t rows, float* scores) {
+  for (size_t i = 0; i < rows; ++i) {
+    scores[i] = FixedDot<kStride>(query, base + i * kStride, kStride);
+  }
+}
+
+void DotTile(const float* const queries[kTileQueries], const float* base, size_t stride,
+             size_t rows, float* scores) {
+  for (size_t q = 0; q < kTileQueries; ++q) {
+    DotBatch(queries[q], base, stride, rows, scores + q * rows);
+  }
+}
+
+int32_t DotInt8(const int8_t* a, const int8_t* b, size_t n) {
+  int32x4_t acc = vdupq_n_s32(0);
+  for (size_t i = 0; i < n; i += 16) {
+    int8x16_t va = vld1q_s8(a + i);
+    int8x16_t vb = vld1q_s8(b + i);
+    acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+    acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+  }
+  return vaddvq_s32(acc);
+}
+
+float DotHalf(const float* a, const uint16_t* b, size_t n) {
+  float32x4_t acc0 = vdupq_n_f32(0.0f);
+  float32x4_t acc1 = vdupq_n_f32(0.0f);
+  for (size_t i = 0; i < n; i += 8) {
+    uint16x8_t vb = vld1q_u16(b + i);
+    float32x4_t vb0 = vcvt_f32_f16(vreinterpret_f16_u16(vget_low_u16(vb)));
+    float32x4_t vb1 = vcvt_f32_f16(vreinterpret_f16_u16(vget_high_u16(vb)));
+    acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vb0);
+    acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vb1);
+  }
+  return vaddvq_f32(vaddq_f32(acc0, acc1));
+}
+
+uint32_t Hamming(const uint64_t* a, const uint64_t* b, size_t words) {
+  uint32_t count = 0;
+  for (size_t i = 0; i < words; i += 2) {
+    uint8x16_t x = veorq_u8(vreinterpretq_u8_u64(vld1q_u64(a + i)),
+                            vreinterpretq_u8_u64(vld1q_u64(b + i)));
+    count += vaddvq_u8(vcntq_u8(x));
+  }
+  return count;
+}
+
+const FeatureKernels kNeonKernels = {
+    "neon", Dot, DotBatch, DotTile, DotInt8, DotHalf, Hamming,
+    PALM_FIXED_STRIDE_KERNELS(FixedDot, FixedDotBatch)};
+
+}  // namespace
+
+const FeatureKernels* NeonFeatureKernels() {
+  return &kNeonKernels;
+}
+
+#else
+
+const FeatureKernels* NeonFeatureKernels() {
+  return nullptr;
+}
+
+#endif
+
+}  // namespace StreamPalm
@@ -0,0 +1,92 @@
+#include "feature_kernel_table.h"
+#include "feature_kernels.h"
+
+namespace StreamPalm {
+
+namespace {
+
+float Dot(const float* a, const float* b, size_t n) {
+  float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  for (size_t i = 0; i < n; i += 4) {
+    acc[0] += a[i] * b[i];
+    acc[1] += a[i + 1] * b[i + 1];
+    acc[2] += a[i + 2] * b[i + 2];
+    acc[3] += a[i + 3] * b[i + 3];
+  }
+  return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+void DotBatch(const float* query, const float* base, size_t stride, size_t rows,
+              float* scores) {
+  for (size_t i = 0; i < rows; ++i) {
+    scores[i] = Dot(query, base + i * stride, stride);
+  }
+}
+
+// Dot() of a length known at compile time, unrolled without the loop.
+template<size_t kStride>
+float FixedDot(const float* a, const float* b, size_t) {
+  float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  PALM_UNROLL_LOOP
+  for (size_t i = 0; i < kStride; i += 4) {
+    acc[0] += a[i] * b[i];
+    acc[1] += a[i + 1] * b[i + 1];
+    acc[2] += a[i + 2] * b[i + 2];
+    acc[3] += a[i + 3] * b[i + 3];
+  }
+  return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+template<size_t kStride>
+void FixedDotBatch(const float* query, const float* base, size_t, size_t rows, float* scores) {
+  for (size_t i = 0; i < rows; ++i) {
+    scores[i] = FixedDot<kStride>(query, base + i * kStride, kStride);
+  }
+}
+
+void DotTile(const float* const queries[kTileQueries], const float* base, size_t stride,
+             size_t rows, float* scores) {
+  for (size_t q = 0; q < kTileQueries; ++q) {
+    DotBatch(queries[q], base, stride, rows, scores + q * rows);
+  }
+}
+
+int32_t DotInt8(const int8_t* a, const int8_t* b, size_t n) {
+  int32_t acc = 0;
+  for (size_t i = 0; i < n; ++i) {
+    acc += static_cast<int32_t>(a[i]) * b[i];
+  }
+  return acc;
+}
+
+float DotHalf(const float* a, const uint16_t* b, size_t n) {
+  float acc = 0.0f;
+  for (size_t i = 0; i < n; ++i) {
+    acc += a[i] * HalfToFloat(b[i]);
+  }
+  return acc;
+}
+
+uint32_t Hamming(const uint64_t* a, const uint64_t* b, size_t words) {
+  uint32_t count = 0;
+  for (size_t i = 0; i < words; ++i) {
+    uint64_t x = a[i] ^ b[i];
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    count += static_cast<uint32_t>((x * 0x0101010101010101ull) >> 56);
+  }
+  return count;
+}
+
+const FeatureKernels kScalarKernels = {
+    "scalar", Dot, DotBatch, DotTile, DotInt8, DotHalf, Hamming,
+    PALM_FIXED_STRIDE_KERNELS(FixedDot, FixedDotBatch)};
+
+}  // namespace
+
+const FeatureKernels* ScalarFeatureKernels() {
+  return &kScalarKernels;
+}
+
+}  // namespace StreamPalm
@@ -0,0 +1,116 @@
+#include "feature_kernel_table.h"
+#if (defined(__SSE4_2__) && defined(__POPCNT__) && defined(__x86_64__)) || defined(_M_X64)
+#include <immintrin.h>
+#include <nmmintrin.h>
+#define PALM_COMPARE_SSE42 1
+#endif
+
+namespace StreamPalm {
+
+#ifdef PALM_COMPARE_SSE42
+
+namespace {
+
+float Dot(const float* a, const float* b, size_t n) {
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  __m128 acc2 = _mm_setzero_ps();
+  __m128 acc3 = _mm_setzero_ps();
+  for (size_t i = 0; i < n; i += 16) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_load_ps(a + i), _mm_load_ps(b + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_load_ps(a + i + 4), _mm_load_ps(b + i + 4)));
+    acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_load_ps(a + i + 8), _mm_load_ps(b + i + 8)));
+    acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_load_ps(a + i + 12), _mm_load_ps(b + i + 12)));
+  }
+  __m128 acc = _mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3));
+  acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+  acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 0x55));
+  return _mm_cvtss_f32(acc);
+}
+
+void DotBatch(const float* query, const float* base, size_t stride, size_t rows,
+              float* scores) {
+  for (size_t i = 0; i < rows; ++i) {
+    scores[i] = Dot(query, base + i * stride, stride);
+  }
+}
+
+// Dot() of a length known at compile time, unrolled without the loop.
+template<size_t kStride>
+float FixedDot(const float* a, const float* b, size_t) {
+  static_assert(kStride % 16 == 0, "whole groups of 4 xmm registers");
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  __m128 acc2 = _mm_setzero_ps();
+  __m128 acc3 = _mm_setzero_ps();
+  PALM_UNROLL_LOOP
+  for (size_t i = 0; i < kStride; i += 16) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_load_ps(a + i), _mm_load_ps(b + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_load_ps(a + i + 4), _mm_load_ps(b + i + 4)));
+    acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_load_ps(a + i + 8), _mm_load_ps(b + i + 8)));
+    acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_load_ps(a + i + 12), _mm_load_ps(b + i + 12)));
+  }
+  __m128 acc = _mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3));
+  acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+  acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 0x55));
+  return _mm_cvtss_f32(acc);
+}
+
+template<size_t kStride>
+void FixedDotBatch(const float* query, const float* base, size_t, size_t rows, float* scores) {
+  for (size_t i = 0; i < rows; ++i) {
+    scores[i] = FixedDot<kStride>(query, base + i * kStride, kStride);
+  }
+}
+
+void DotTile(const float* const queries[kTileQueries], const float* base, size_t stride,
+             size_t rows, float* scores) {
+  for (size_t q = 0; q < kTileQueries; ++q) {
+    DotBatch(queries[q], base, stride, rows, scores + q * rows);
+  }
+}
+
+int32_t DotInt8(const int8_t* a, const int8_t* b, size_t n) {
+  __m128i acc0 = _mm_setzero_si128();
+  __m128i acc1 = _mm_setzero_si128();
+  for (size_t i = 0; i < n; i += 16) {
+    __m128i va = _mm_load_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i vb = _mm_load_si128(reinterpret_cast<const __m128i*>(b + i));
+    acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_cvtepi8_epi16(va), _mm_cvtepi8_epi16(vb)));
+    acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_cvtepi8_epi16(_mm_srli_si128(va, 8)),
+                                              _mm_cvtepi8_epi16(_mm_srli_si128(vb, 8))));
+  }
+  __m128i acc = _mm_add_epi32(acc0, acc1);
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+  return _mm_cvtsi128_si32(acc);
+}
+
+uint32_t Hamming(const uint64_t* a, const uint64_t* b, size_t words) {
+  uint64_t count = 0;
+  for (size_t i = 0; i < words; ++i) {
+    count += _mm_popcnt_u64(a[i] ^ b[i]);
+  }
+  return static_cast<uint32_t>(count);
+}
+
+// Without F16C the half rows are converted in software by the scalar variant.
+const FeatureKernels kSse42Kernels = {
+    "sse4.2", Dot, DotBatch, DotTile, DotInt8, nullptr, Hamming,
+    PALM_FIXED_STRIDE_KERNELS(FixedDot, FixedDotBatch)};
+
+}  // namespace
+
+const FeatureKernels* Sse42FeatureKernels() {
+  return &kSse42Kernels;
+}
+
+#else
+
+const FeatureKernels* Sse42FeatureKernels() {
+  return nullptr;
+}
+
+#endif
+
+}  // namespace StreamPalm
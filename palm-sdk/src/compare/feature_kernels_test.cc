@@ -0,0 +1,94 @@
+// Tests of the kernel dispatch, run by ctest once as the CPU allows and once limited to the
+// avx2 variant with PALM_COMPARE_KERNELS, the path of a CPU without AVX-512.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include "feature_kernels.h"
+
+using namespace StreamPalm;
+
+namespace {
+
+int failures = 0;
+
+void Expect(bool condition, const char* what) {
+  if (condition)
+    return;
+  std::fprintf(stderr, "FAILED: %s\n", what);
+  ++failures;
+}
+
+// Fastest first, as the dispatch tries them.
+const char* const kIsas[] = {"avx512vpopcntdq", "avx512", "avx2", "sse4.2", "neon", "scalar"};
+constexpr size_t kIsaCount = sizeof(kIsas) / sizeof(kIsas[0]);
+
+size_t IsaIndex(const char* isa) {
+  for (size_t i = 0; i < kIsaCount; ++i) {
+    if (!std::strcmp(kIsas[i], isa))
+      return i;
+  }
+  return kIsaCount;
+}
+
+// The variants ahead of PALM_COMPARE_KERNELS are neither used nor even loaded.
+void TestKernelLimit() {
+  const char* limit = std::getenv("PALM_COMPARE_KERNELS");
+  Expect(IsaIndex(FeatureKernelIsa()) < kIsaCount, "known variant in use");
+  if (!limit || IsaIndex(limit) == kIsaCount)
+    return;
+  Expect(IsaIndex(FeatureKernelIsa()) >= IsaIndex(limit), "no variant ahead of the limit");
+  for (size_t i = 0; i < IsaIndex(limit); ++i) {
+    Expect(!FindFeatureKernels(kIsas[i]), "variant ahead of the limit not loaded");
+  }
+}
+
+// Every loaded variant against the scalar reference, on lengths the dispatch check skips.
+void TestVariantsMatchScalar() {
+  const FeatureKernels* scalar = FindFeatureKernels("scalar");
+  Expect(scalar != nullptr, "scalar variant");
+  if (!scalar)
+    return;
+  std::mt19937_64 rng(3);
+  std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+  constexpr size_t kDim = 1024;
+  constexpr size_t kWords = 48;
+  AlignedBuffer<float> a(kDim);
+  AlignedBuffer<float> b(kDim);
+  AlignedBuffer<uint64_t> codes(2 * kWords);
+  for (size_t i = 0; i < kDim; ++i) {
+    a[i] = uniform(rng);
+    b[i] = uniform(rng);
+  }
+  for (size_t i = 0; i < codes.size(); ++i) {
+    codes[i] = rng();
+  }
+  for (const char* isa : kIsas) {
+    const FeatureKernels* kernels = FindFeatureKernels(isa);
+    if (!kernels)
+      continue;
+    for (size_t n = kFloatsPerLine; n <= kDim; n += kFloatsPerLine) {
+      float expected = scalar->dot(a.data(), b.data(), n);
+      float got = kernels->dot(a.data(), b.data(), n);
+      Expect(std::fabs(got - expected) <= 1e-3f * (1.0f + std::fabs(expected)), isa);
+    }
+    for (size_t words = 0; words <= kWords; ++words) {
+      Expect(kernels->hamming(codes.data(), codes.data() + kWords, words) ==
+                 scalar->hamming(codes.data(), codes.data() + kWords, words),
+             isa);
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  TestKernelLimit();
+  TestVariantsMatchScalar();
+  if (failures)
+    return 1;
+  std::printf("kernels %s, all tests passed\n", FeatureKernelIsa());
+  return 0;
+}
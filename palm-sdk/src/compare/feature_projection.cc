@@ -0,0 +1,273 @@
+#include "feature_projection.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+
+namespace StreamPalm {
+
+namespace {
+
+constexpr uint32_t kProjectionMagic = 0x4a4f5250;  // "PROJ"
+constexpr uint32_t kProjectionVersion = 1;
+constexpr int kJacobiSweeps = 64;
+
+// Components whose variance is below this fraction of the largest one are not amplified
+// further by the whitening, they are mostly noise.
+constexpr double kWhitenFloor = 1e-4;
+
+bool WriteValues(std::FILE* file, const void* data, size_t size, size_t count) {
+  return !count || std::fwrite(data, size, count, file) == count;
+}
+
+bool ReadValues(std::FILE* file, void* data, size_t size, size_t count) {
+  return !count || std::fread(data, size, count, file) == count;
+}
+
+// Rotate rows p and q of a row major matrix with n columns.
+void RotateRows(double* a, size_t n, size_t p, size_t q, double c, double s) {
+  double* row_p = a + p * n;
+  double* row_q = a + q * n;
+  for (size_t k = 0; k < n; ++k) {
+    double x = row_p[k];
+    double y = row_q[k];
+    row_p[k] = c * x - s * y;
+    row_q[k] = s * x + c * y;
+  }
+}
+
+// Cyclic Jacobi eigenvalue decomposition of a symmetric n x n matrix, which is destroyed.
+// values[i] is the eigenvalue of row i of vectors.
+void SymmetricEigen(std::vector<double>& a, size_t n, std::vector<double>& values,
+                    std::vector<double>& vectors) {
+  vectors.assign(n * n, 0.0);
+  for (size_t i = 0; i < n; ++i) {
+    vectors[i * n + i] = 1.0;
+  }
+  double total = 0.0;
+  for (double value : a) {
+    total += value * value;
+  }
+  for (int sweep = 0; sweep < kJacobiSweeps; ++sweep) {
+    double off = 0.0;
+    for (size_t p = 0; p < n; ++p) {
+      for (size_t q = p + 1; q < n; ++q) {
+        off += a[p * n + q] * a[p * n + q];
+      }
+    }
+    if (off <= 1e-24 * total)
+      break;
+    for (size_t p = 0; p < n; ++p) {
+      for (size_t q = p + 1; q < n; ++q) {
+        double apq = a[p * n + q];
+        if (std::fabs(apq) <= 1e-30)
+          continue;
+        double theta = (a[q * n + q] - a[p * n + p]) / (2.0 * apq);
+        double t = (theta >= 0.0 ? 1.0 : -1.0) /
+                   (std::fabs(theta) + std::sqrt(theta * theta + 1.0));
+        double c = 1.0 / std::sqrt(t * t + 1.0);
+        double s = t * c;
+        // A = J^T A J, the columns through the symmetric rows.
+        for (size_t k = 0; k < n; ++k) {
+          double x = a[k * n + p];
+          double y = a[k * n + q];
+          a[k * n + p] = c * x - s * y;
+          a[k * n + q] = s * x + c * y;
+        }
+        RotateRows(a.data(), n, p, q, c, s);
+        a[p * n + q] = 0.0;
+        a[q * n + p] = 0.0;
+        RotateRows(vectors.data(), n, p, q, c, s);
+      }
+    }
+  }
+  values.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    values[i] = a[i * n + i];
+  }
+}
+
+}  // namespace
+
+int FeatureProjection::Train(const size_t in_dims[kChannelCount],
+                             const size_t out_dims[kChannelCount], bool whiten,
+                             const std::vector<std::vector<float>>* const samples[kChannelCount]) {
+  size_t n = 0;
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (!in_dims[c])
+      continue;
+    if (!samples[c] || !out_dims[c] || out_dims[c] > in_dims[c])
+      return kInvalidArguments;
+    if (n && samples[c]->size() != n)
+      return kInvalidArguments;
+    n = samples[c]->size();
+  }
+  // Fewer samples than outputs leave some components undetermined.
+  if (!n || n <= std::max(out_dims[kIrChannel], out_dims[kRgbChannel]))
+    return kInvalidArguments;
+
+  whiten_ = whiten;
+  AlignedBuffer<float> scratch;
+  for (int c = 0; c < kChannelCount; ++c) {
+    size_t dim = in_dims[c];
+    in_dims_[c] = dim;
+    out_dims_[c] = dim ? out_dims[c] : 0;
+    means_[c].clear();
+    matrices_[c].Init(dim);
+    if (!dim)
+      continue;
+    std::vector<float> points(n * dim);
+    for (size_t i = 0; i < n; ++i) {
+      const std::vector<float>& sample = (*samples[c])[i];
+      if (sample.size() != dim)
+        return kCompareDimensionMismatch;
+      scratch.Resize(0);
+      scratch.Resize(ProbeDim(dim));
+      std::copy(sample.begin(), sample.end(), scratch.data());
+      if (metric_ == CompareMetric::kCosine)
+        NormalizeFeature(scratch.data(), scratch.size());
+      std::copy_n(scratch.data(), dim, &points[i * dim]);
+    }
+    std::vector<double> mean(dim, 0.0);
+    for (size_t i = 0; i < n; ++i) {
+      for (size_t d = 0; d < dim; ++d) {
+        mean[d] += points[i * dim + d];
+      }
+    }
+    means_[c].resize(dim);
+    for (size_t d = 0; d < dim; ++d) {
+      mean[d] /= n;
+      means_[c][d] = static_cast<float>(mean[d]);
+    }
+    // Covariance, upper triangle accumulated and mirrored.
+    std::vector<double> covariance(dim * dim, 0.0);
+    std::vector<double> centered(dim);
+    for (size_t i = 0; i < n; ++i) {
+      for (size_t d = 0; d < dim; ++d) {
+        centered[d] = points[i * dim + d] - mean[d];
+      }
+      for (size_t p = 0; p < dim; ++p) {
+        double* row = &covariance[p * dim];
+        for (size_t q = p; q < dim; ++q) {
+          row[q] += centered[p] * centered[q];
+        }
+      }
+    }
+    for (size_t p = 0; p < dim; ++p) {
+      for (size_t q = p; q < dim; ++q) {
+        covariance[p * dim + q] /= n;
+        covariance[q * dim + p] = covariance[p * dim + q];
+      }
+    }
+    std::vector<double> values;
+    std::vector<double> vectors;
+    SymmetricEigen(covariance, dim, values, vectors);
+    std::vector<size_t> order(dim);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&values](size_t x, size_t y) {
+      return values[x] > values[y];
+    });
+    double floor = std::max(values[order[0]], 0.0) * kWhitenFloor;
+    matrices_[c].Resize(out_dims_[c]);
+    for (size_t k = 0; k < out_dims_[c]; ++k) {
+      const double* vector = &vectors[order[k] * dim];
+      double scale = whiten ? 1.0 / std::sqrt(std::max(values[order[k]], floor) + 1e-30) : 1.0;
+      float* row = matrices_[c].MutableRow(k);
+      for (size_t d = 0; d < dim; ++d) {
+        row[d] = static_cast<float>(vector[d] * scale);
+      }
+    }
+  }
+  InitOffsets();
+  return kOk;
+}
+
+void FeatureProjection::InitOffsets() {
+  AlignedBuffer<float> mean;
+  for (int c = 0; c < kChannelCount; ++c) {
+    offsets_[c].assign(out_dims_[c], 0.0f);
+    if (!out_dims_[c])
+      continue;
+    mean.Resize(0);
+    mean.Resize(matrices_[c].stride());
+    std::copy(means_[c].begin(), means_[c].end(), mean.data());
+    FeatureDotBatch(mean.data(), matrices_[c].Row(0), matrices_[c].stride(), out_dims_[c],
+                    offsets_[c].data());
+  }
+}
+
+int FeatureProjection::Apply(int channel, const std::vector<float>& features,
+                             std::vector<float>& projected) const {
+  size_t dim = in_dims_[channel];
+  if (features.size() != dim || !dim)
+    return kCompareDimensionMismatch;
+  AlignedBuffer<float> buffer;
+  buffer.Resize(matrices_[channel].stride());
+  std::copy(features.begin(), features.end(), buffer.data());
+  if (metric_ == CompareMetric::kCosine)
+    NormalizeFeature(buffer.data(), buffer.size());
+  projected.resize(out_dims_[channel]);
+  FeatureDotBatch(buffer.data(), matrices_[channel].Row(0), matrices_[channel].stride(),
+                  out_dims_[channel], projected.data());
+  for (size_t k = 0; k < projected.size(); ++k) {
+    projected[k] -= offsets_[channel][k];
+  }
+  return kOk;
+}
+
+int FeatureProjection::Save(const std::string& path) const {
+  std::FILE* file = std::fopen(path.c_str(), "wb");
+  if (!file)
+    return kFailedToOperateFile;
+  uint32_t header[8] = {kProjectionMagic, kProjectionVersion, static_cast<uint32_t>(metric_),
+                        static_cast<uint32_t>(in_dims_[kIrChannel]),
+                        static_cast<uint32_t>(in_dims_[kRgbChannel]),
+                        static_cast<uint32_t>(out_dims_[kIrChannel]),
+                        static_cast<uint32_t>(out_dims_[kRgbChannel]), whiten_ ? 1u : 0u};
+  bool ok = WriteValues(file, header, sizeof(uint32_t), 8);
+  for (int c = 0; c < kChannelCount && ok; ++c) {
+    ok = WriteValues(file, means_[c].data(), sizeof(float), means_[c].size());
+    for (size_t k = 0; k < out_dims_[c] && ok; ++k) {
+      ok = WriteValues(file, matrices_[c].Row(k), sizeof(float), in_dims_[c]);
+    }
+  }
+  ok = std::fclose(file) == 0 && ok;
+  return ok ? kOk : kFailedToOperateFile;
+}
+
+int FeatureProjection::Load(const std::string& path) {
+  std::FILE* file = std::fopen(path.c_str(), "rb");
+  if (!file)
+    return kFileNotExist;
+  uint32_t header[8];
+  if (!ReadValues(file, header, sizeof(uint32_t), 8) || header[0] != kProjectionMagic ||
+      header[1] != kProjectionVersion) {
+    std::fclose(file);
+    return kFailedToOperateFile;
+  }
+  if (header[2] != static_cast<uint32_t>(metric_) || header[5] > header[3] ||
+      header[6] > header[4] || (header[3] && !header[5]) || (header[4] && !header[6])) {
+    std::fclose(file);
+    return kInvalidArguments;
+  }
+  whiten_ = header[7] != 0;
+  bool ok = true;
+  for (int c = 0; c < kChannelCount && ok; ++c) {
+    in_dims_[c] = header[3 + c];
+    out_dims_[c] = header[5 + c];
+    means_[c].resize(in_dims_[c]);
+    matrices_[c].Init(in_dims_[c]);
+    matrices_[c].Resize(out_dims_[c]);
+    ok = ReadValues(file, means_[c].data(), sizeof(float), in_dims_[c]);
+    for (size_t k = 0; k < out_dims_[c] && ok; ++k) {
+      ok = ReadValues(file, matrices_[c].MutableRow(k), sizeof(float), in_dims_[c]);
+    }
+  }
+  std::fclose(file);
+  if (!ok)
+    return kFailedToOperateFile;
+  InitOffsets();
+  return kOk;
+}
+
+}  // namespace StreamPalm
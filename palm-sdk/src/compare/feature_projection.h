@@ -0,0 +1,45 @@
+#ifndef PALM_COMPARE_FEATURE_PROJECTION_H_
+#define PALM_COMPARE_FEATURE_PROJECTION_H_
+
+#include <string>
+#include <vector>
+#include "feature_gallery.h"
+
+namespace StreamPalm {
+
+// Principal component projection of the features of each channel, optionally whitened. Trained
+// offline by Train() on enrolled templates, then applied to templates and probes alike before
+// they reach the gallery. Features are normalized first for kCosine, as the gallery would.
+class FeatureProjection {
+ public:
+  explicit FeatureProjection(CompareMetric metric) : metric_(metric) {}
+
+  // samples[c] is null for an unused channel, whose dims are zero.
+  int Train(const size_t in_dims[kChannelCount], const size_t out_dims[kChannelCount],
+            bool whiten, const std::vector<std::vector<float>>* const samples[kChannelCount]);
+  int Save(const std::string& path) const;
+  int Load(const std::string& path);
+
+  size_t in_dim(int channel) const { return in_dims_[channel]; }
+  size_t out_dim(int channel) const { return out_dims_[channel]; }
+
+  // projected = W (x - mean) for the features x of a channel, out_dim(channel) values.
+  int Apply(int channel, const std::vector<float>& features,
+            std::vector<float>& projected) const;
+
+ private:
+  void InitOffsets();
+
+  CompareMetric metric_;
+  size_t in_dims_[kChannelCount]{0, 0};
+  size_t out_dims_[kChannelCount]{0, 0};
+  bool whiten_{false};
+  std::vector<float> means_[kChannelCount];
+  // One row of in_dim values per output, the whitening scale folded in.
+  FeatureMatrix matrices_[kChannelCount];
+  // W mean, subtracted after the product so the input needs no centering pass.
+  std::vector<float> offsets_[kChannelCount];
+};
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_FEATURE_PROJECTION_H_
@@ -0,0 +1,334 @@
+#include "gallery_journal.h"
+#include <algorithm>
+#include <cstring>
+#include "durable_file.h"
+
+namespace StreamPalm {
+
+namespace {
+
+constexpr uint32_t kJournalMagic = 0x4c415750;  // "PWAL"
+constexpr uint32_t kJournalVersion = 1;
+
+// Larger records are taken for garbage at the end of the log.
+constexpr uint32_t kMaxRecordBytes = 1u << 26;
+
+enum RecordFlag : uint32_t {
+  kIrHashFlag = 1u << 0,
+  kRgbHashFlag = 1u << 1,
+  kSkeletonFlag = 1u << 2,
+};
+
+struct JournalFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recog_mode;
+  uint32_t reserved;
+  char model_version[kModelVersionSize];
+};
+
+// Every record is [RecordHeader][body of body_bytes][uint64 checksum of header and body].
+struct RecordHeader {
+  uint32_t body_bytes;
+  uint32_t op;
+  uint64_t sequence;
+};
+
+// The body of a kAdd record: AddRecordHead, the ir, rgb and skeleton floats, then the ir and
+// rgb hash bytes. That of a kDelete record is the int32 features id.
+struct AddRecordHead {
+  int32_t features_id;
+  int32_t palm_type;
+  uint32_t flags;
+  uint32_t counts[5];
+};
+
+void PutBytes(std::vector<uint8_t>& out, const void* data, size_t bytes) {
+  const uint8_t* begin = static_cast<const uint8_t*>(data);
+  out.insert(out.end(), begin, begin + bytes);
+}
+
+// Reads the fields of a record body in order, false once one runs past the end.
+class BodyReader {
+ public:
+  explicit BodyReader(const std::vector<uint8_t>& body) : body_(body) {}
+
+  bool Get(void* data, size_t bytes) {
+    if (bytes > body_.size() - offset_)
+      return false;
+    if (bytes)
+      std::memcpy(data, body_.data() + offset_, bytes);
+    offset_ += bytes;
+    return true;
+  }
+  bool AtEnd() const { return offset_ == body_.size(); }
+
+ private:
+  const std::vector<uint8_t>& body_;
+  size_t offset_{0};
+};
+
+bool DecodeBody(const std::vector<uint8_t>& body, JournalRecord& record) {
+  BodyReader reader(body);
+  if (record.op == JournalOp::kDelete) {
+    int32_t id;
+    if (!reader.Get(&id, sizeof(id)))
+      return false;
+    record.features_id = id;
+    return reader.AtEnd();
+  }
+  AddRecordHead head;
+  if (!reader.Get(&head, sizeof(head)))
+    return false;
+  record.features_id = head.features_id;
+  record.palm_type = head.palm_type;
+  record.has_hash[kIrChannel] = (head.flags & kIrHashFlag) != 0;
+  record.has_hash[kRgbChannel] = (head.flags & kRgbHashFlag) != 0;
+  record.has_skeleton = (head.flags & kSkeletonFlag) != 0;
+  std::vector<float>* floats[3] = {&record.features[kIrChannel], &record.features[kRgbChannel],
+                                   &record.skeleton};
+  for (int i = 0; i < 3; ++i) {
+    if (head.counts[i] > body.size() / sizeof(float))
+      return false;
+    floats[i]->resize(head.counts[i]);
+    if (!reader.Get(floats[i]->data(), head.counts[i] * sizeof(float)))
+      return false;
+  }
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (head.counts[3 + c] > body.size())
+      return false;
+    record.hashes[c].resize(head.counts[3 + c]);
+    if (!reader.Get(&record.hashes[c][0], head.counts[3 + c]))
+      return false;
+  }
+  return reader.AtEnd();
+}
+
+// Next intact record of the log, false at the end or at a torn or corrupt record.
+bool ReadRecord(std::FILE* file, std::vector<uint8_t>& body, JournalRecord& record,
+                uint64_t& bytes) {
+  RecordHeader header;
+  if (std::fread(&header, sizeof(header), 1, file) != 1 || header.body_bytes > kMaxRecordBytes)
+    return false;
+  if (header.op != static_cast<uint32_t>(JournalOp::kAdd) &&
+      header.op != static_cast<uint32_t>(JournalOp::kDelete))
+    return false;
+  body.resize(header.body_bytes);
+  uint64_t checksum;
+  if ((header.body_bytes && std::fread(body.data(), header.body_bytes, 1, file) != 1) ||
+      std::fread(&checksum, sizeof(checksum), 1, file) != 1)
+    return false;
+  Checksum expected;
+  expected.Update(&header, sizeof(header));
+  expected.Update(body.data(), body.size());
+  if (checksum != expected.value())
+    return false;
+  record = JournalRecord();
+  record.op = static_cast<JournalOp>(header.op);
+  record.sequence = header.sequence;
+  bytes = sizeof(header) + header.body_bytes + sizeof(checksum);
+  return DecodeBody(body, record);
+}
+
+}  // namespace
+
+int GalleryJournal::WriteEmpty() const {
+  JournalFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = kJournalMagic;
+  header.version = kJournalVersion;
+  header.recog_mode = key_.recog_mode;
+  std::memcpy(header.model_version, key_.model_version.data(), key_.model_version.size());
+  std::string temp_path = path_ + ".tmp";
+  std::FILE* file = std::fopen(temp_path.c_str(), "wb");
+  if (!file)
+    return kFailedToOperateFile;
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 && SyncFile(file);
+  ok = std::fclose(file) == 0 && ok;
+  if (!ok || !RenameOver(temp_path, path_)) {
+    std::remove(temp_path.c_str());
+    return kFailedToOperateFile;
+  }
+  return kOk;
+}
+
+int GalleryJournal::Open(const std::string& path, const GalleryFileKey& key, uint64_t after,
+                         const Replay& replay) {
+  Close();
+  if (key.model_version.size() >= kModelVersionSize)
+    return kInvalidArguments;
+  path_ = path;
+  key_ = key;
+  std::FILE* file = std::fopen(path.c_str(), "r+b");
+  if (!file) {
+    int ret = WriteEmpty();
+    if (ret)
+      return ret;
+    file = std::fopen(path.c_str(), "r+b");
+    if (!file)
+      return kFailedToOperateFile;
+  }
+  JournalFileHeader header;
+  if (std::fread(&header, sizeof(header), 1, file) != 1 || header.magic != kJournalMagic) {
+    std::fclose(file);
+    return kCompareGalleryCorrupt;
+  }
+  header.model_version[kModelVersionSize - 1] = '\0';
+  if (header.version != kJournalVersion || header.recog_mode != key.recog_mode ||
+      key.model_version != header.model_version) {
+    std::fclose(file);
+    return kCompareGalleryMismatch;
+  }
+  uint64_t end = sizeof(header);
+  uint64_t bytes = 0;
+  std::vector<uint8_t> body;
+  JournalRecord record;
+  appended_ = after;
+  records_ = 0;
+  while (ReadRecord(file, body, record, bytes)) {
+    if (record.sequence > after) {
+      int ret = replay(record);
+      if (ret) {
+        std::fclose(file);
+        return ret;
+      }
+    }
+    appended_ = std::max(appended_, record.sequence);
+    ++records_;
+    end += bytes;
+  }
+  bool ok = TruncateFile(file, end) && SyncFile(file);
+  ok = std::fclose(file) == 0 && ok;
+  if (!ok)
+    return kFailedToOperateFile;
+  file_ = std::fopen(path.c_str(), "ab");
+  if (!file_)
+    return kFailedToOperateFile;
+  durable_ = appended_;
+  failed_ = false;
+  return kOk;
+}
+
+void GalleryJournal::Close() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  synced_.wait(lock, [this] { return !syncing_; });
+  if (file_) {
+    std::fclose(file_);
+    file_ = nullptr;
+  }
+  pending_.clear();
+}
+
+uint64_t GalleryJournal::Append(JournalOp op, const std::vector<uint8_t>& body) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  RecordHeader header;
+  header.body_bytes = static_cast<uint32_t>(body.size());
+  header.op = static_cast<uint32_t>(op);
+  header.sequence = ++appended_;
+  Checksum checksum;
+  checksum.Update(&header, sizeof(header));
+  checksum.Update(body.data(), body.size());
+  uint64_t value = checksum.value();
+  PutBytes(pending_, &header, sizeof(header));
+  PutBytes(pending_, body.data(), body.size());
+  PutBytes(pending_, &value, sizeof(value));
+  ++records_;
+  return header.sequence;
+}
+
+uint64_t GalleryJournal::AppendAdd(int features_id, int palm_type,
+                                   const std::vector<float>* const features[kChannelCount],
+                                   const std::string* const hashes[kChannelCount],
+                                   const std::vector<float>* skeleton) {
+  AddRecordHead head;
+  head.features_id = features_id;
+  head.palm_type = palm_type;
+  head.flags = 0;
+  if (hashes[kIrChannel])
+    head.flags |= kIrHashFlag;
+  if (hashes[kRgbChannel])
+    head.flags |= kRgbHashFlag;
+  if (skeleton)
+    head.flags |= kSkeletonFlag;
+  const std::vector<float>* floats[3] = {features[kIrChannel], features[kRgbChannel], skeleton};
+  for (int i = 0; i < 3; ++i) {
+    head.counts[i] = floats[i] ? static_cast<uint32_t>(floats[i]->size()) : 0;
+  }
+  for (int c = 0; c < kChannelCount; ++c) {
+    head.counts[3 + c] = hashes[c] ? static_cast<uint32_t>(hashes[c]->size()) : 0;
+  }
+  std::vector<uint8_t> body;
+  PutBytes(body, &head, sizeof(head));
+  for (int i = 0; i < 3; ++i) {
+    if (floats[i])
+      PutBytes(body, floats[i]->data(), floats[i]->size() * sizeof(float));
+  }
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (hashes[c])
+      PutBytes(body, hashes[c]->data(), hashes[c]->size());
+  }
+  return Append(JournalOp::kAdd, body);
+}
+
+uint64_t GalleryJournal::AppendDelete(int features_id) {
+  int32_t id = features_id;
+  std::vector<uint8_t> body;
+  PutBytes(body, &id, sizeof(id));
+  return Append(JournalOp::kDelete, body);
+}
+
+int GalleryJournal::Commit(uint64_t sequence) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (durable_ < sequence && !failed_) {
+    if (syncing_) {
+      synced_.wait(lock);
+      continue;
+    }
+    // Write everything pending on behalf of the waiting callers.
+    syncing_ = true;
+    std::vector<uint8_t> records;
+    records.swap(pending_);
+    uint64_t target = appended_;
+    lock.unlock();
+    bool ok = file_ && std::fwrite(records.data(), records.size(), 1, file_) == 1 &&
+              SyncFile(file_);
+    lock.lock();
+    syncing_ = false;
+    if (ok)
+      durable_ = target;
+    else
+      failed_ = true;
+    synced_.notify_all();
+  }
+  return durable_ >= sequence ? kOk : kFailedToOperateFile;
+}
+
+int GalleryJournal::Reset() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  synced_.wait(lock, [this] { return !syncing_; });
+  if (!file_ || !pending_.empty() || failed_)
+    return kFailedToOperateFile;
+  std::fclose(file_);
+  file_ = nullptr;
+  int ret = WriteEmpty();
+  // The old log stays in place when the new one could not be written, it is still valid.
+  file_ = std::fopen(path_.c_str(), "ab");
+  if (!file_)
+    return kFailedToOperateFile;
+  if (ret)
+    return ret;
+  records_ = 0;
+  return kOk;
+}
+
+uint64_t GalleryJournal::sequence() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return appended_;
+}
+
+size_t GalleryJournal::records() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return records_;
+}
+
+}  // namespace StreamPalm
@@ -0,0 +1,89 @@
+#ifndef PALM_COMPARE_GALLERY_JOURNAL_H_
+#define PALM_COMPARE_GALLERY_JOURNAL_H_
+
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "feature_gallery.h"
+
+namespace StreamPalm {
+
+enum class JournalOp : uint32_t {
+  kAdd = 1,
+  kDelete,  // Tombstone of a features id.
+};
+
+// A logged change of the gallery with the inputs as given to PalmCompare, before projection.
+struct JournalRecord {
+  JournalOp op{JournalOp::kAdd};
+  uint64_t sequence{0};
+  int features_id{-1};
+  int palm_type{-1};
+  std::vector<float> features[kChannelCount];
+  bool has_hash[kChannelCount]{false, false};
+  std::string hashes[kChannelCount];
+  bool has_skeleton{false};
+  std::vector<float> skeleton;
+};
+
+// Write-ahead log of the changes to a gallery since its last snapshot. Records are appended in
+// the order the caller applies them, under the caller's lock, and made durable by Commit().
+// Callers that commit at the same time share one write and flush: the first one writes every
+// pending record while the others wait for it (group commit).
+class GalleryJournal {
+ public:
+  using Replay = std::function<int(const JournalRecord&)>;
+
+  GalleryJournal() = default;
+  GalleryJournal(const GalleryJournal&) = delete;
+  GalleryJournal& operator=(const GalleryJournal&) = delete;
+  ~GalleryJournal() { Close(); }
+
+  // Open or create the log and replay its records after sequence after, e.g. the last record a
+  // snapshot includes, in order. A torn record at the end, from a crash while writing, is cut off.
+  int Open(const std::string& path, const GalleryFileKey& key, uint64_t after,
+           const Replay& replay);
+  void Close();
+
+  // Sequence of the appended record. hashes[c] and skeleton may be null.
+  uint64_t AppendAdd(int features_id, int palm_type,
+                     const std::vector<float>* const features[kChannelCount],
+                     const std::string* const hashes[kChannelCount],
+                     const std::vector<float>* skeleton);
+  uint64_t AppendDelete(int features_id);
+
+  // Wait until the record of sequence and all before it are on disk.
+  int Commit(uint64_t sequence);
+
+  // Start an empty log once a snapshot includes every record, the file is replaced atomically.
+  // No record may be appended meanwhile.
+  int Reset();
+
+  const GalleryFileKey& key() const { return key_; }
+  uint64_t sequence() const;
+  // Records in the log, replayed or appended since the last Reset().
+  size_t records() const;
+
+ private:
+  uint64_t Append(JournalOp op, const std::vector<uint8_t>& body);
+  int WriteEmpty() const;
+
+  std::string path_;
+  GalleryFileKey key_;
+  std::FILE* file_{nullptr};
+  mutable std::mutex mutex_;
+  std::condition_variable synced_;
+  // Encoded records not written yet.
+  std::vector<uint8_t> pending_;
+  uint64_t appended_{0};
+  uint64_t durable_{0};
+  size_t records_{0};
+  bool syncing_{false};
+  bool failed_{false};
+};
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_GALLERY_JOURNAL_H_
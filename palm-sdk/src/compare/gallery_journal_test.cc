@@ -0,0 +1,173 @@
+// Tests of the write-ahead log replay, run by ctest when the library is built on its own.
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include "gallery_journal.h"
+
+using namespace StreamPalm;
+
+namespace {
+
+int failures = 0;
+
+void Expect(bool condition, const char* what) {
+  if (condition)
+    return;
+  std::fprintf(stderr, "FAILED: %s\n", what);
+  ++failures;
+}
+
+const char* const kPath = "gallery_journal_test.log";
+
+GalleryFileKey Key(const char* model_version) {
+  GalleryFileKey key;
+  key.model_version = model_version;
+  return key;
+}
+
+// Open the log and collect the records replayed after sequence after.
+int Replay(GalleryJournal& journal, uint64_t after, std::vector<JournalRecord>& records,
+           const char* model_version = "v1") {
+  records.clear();
+  return journal.Open(kPath, Key(model_version), after, [&](const JournalRecord& record) {
+    records.push_back(record);
+    return kOk;
+  });
+}
+
+std::vector<uint8_t> ReadBytes() {
+  std::vector<uint8_t> bytes;
+  std::FILE* file = std::fopen(kPath, "rb");
+  if (!file)
+    return bytes;
+  int c;
+  while ((c = std::fgetc(file)) != EOF) {
+    bytes.push_back(static_cast<uint8_t>(c));
+  }
+  std::fclose(file);
+  return bytes;
+}
+
+void WriteBytes(const std::vector<uint8_t>& bytes) {
+  std::FILE* file = std::fopen(kPath, "wb");
+  if (!file)
+    return;
+  std::fwrite(bytes.data(), 1, bytes.size(), file);
+  std::fclose(file);
+}
+
+// Two adds, the second with a hash and a skeleton, and a delete of the first.
+void WriteLog() {
+  std::remove(kPath);
+  GalleryJournal journal;
+  std::vector<JournalRecord> records;
+  Expect(Replay(journal, 0, records) == kOk && records.empty(), "new log");
+  std::vector<float> ir = {1.0f, 2.0f, 3.0f};
+  std::vector<float> rgb = {4.0f, 5.0f};
+  std::vector<float> skeleton = {0.5f};
+  std::string hash = "0f";
+  const std::vector<float>* features[kChannelCount] = {&ir, &rgb};
+  const std::string* no_hashes[kChannelCount] = {nullptr, nullptr};
+  const std::string* hashes[kChannelCount] = {&hash, nullptr};
+  journal.AppendAdd(1, -1, features, no_hashes, nullptr);
+  journal.AppendAdd(2, 1, features, hashes, &skeleton);
+  Expect(journal.Commit(journal.AppendDelete(1)) == kOk, "commit");
+}
+
+void TestReplay() {
+  WriteLog();
+  GalleryJournal journal;
+  std::vector<JournalRecord> records;
+  Expect(Replay(journal, 0, records) == kOk && records.size() == 3, "every record replayed");
+  if (records.size() != 3)
+    return;
+  Expect(records[0].op == JournalOp::kAdd && records[0].sequence == 1 &&
+             records[0].features_id == 1 && records[0].features[kRgbChannel].size() == 2 &&
+             !records[0].has_hash[kIrChannel] && !records[0].has_skeleton, "first add");
+  Expect(records[1].features_id == 2 && records[1].palm_type == 1 &&
+             records[1].features[kIrChannel][2] == 3.0f && records[1].has_hash[kIrChannel] &&
+             records[1].hashes[kIrChannel] == "0f" && !records[1].has_hash[kRgbChannel] &&
+             records[1].has_skeleton && records[1].skeleton[0] == 0.5f, "second add");
+  Expect(records[2].op == JournalOp::kDelete && records[2].sequence == 3 &&
+             records[2].features_id == 1, "delete");
+  Expect(journal.sequence() == 3 && journal.records() == 3, "sequence of the log");
+  journal.Close();
+  Expect(Replay(journal, 0, records, "v2") == kCompareGalleryMismatch, "other model version");
+  std::remove(kPath);
+}
+
+// The records a snapshot includes are not replayed again.
+void TestSequenceCutOff() {
+  WriteLog();
+  GalleryJournal journal;
+  std::vector<JournalRecord> records;
+  Expect(Replay(journal, 2, records) == kOk && records.size() == 1 && records[0].sequence == 3,
+         "records after the snapshot");
+  journal.Close();
+  // A snapshot newer than the log, written just before the log was reset.
+  Expect(Replay(journal, 5, records) == kOk && records.empty(), "log older than the snapshot");
+  Expect(journal.sequence() == 5, "sequence of the snapshot");
+  std::vector<float> ir = {1.0f};
+  const std::vector<float>* features[kChannelCount] = {&ir, nullptr};
+  const std::string* hashes[kChannelCount] = {nullptr, nullptr};
+  Expect(journal.AppendAdd(3, -1, features, hashes, nullptr) == 6, "sequence after the snapshot");
+  journal.Close();
+  std::remove(kPath);
+}
+
+// A record cut short by a crash is dropped and the log goes on after the last intact one.
+void TestTornTail() {
+  WriteLog();
+  std::vector<uint8_t> intact = ReadBytes();
+  std::vector<uint8_t> torn = intact;
+  // The little-endian header of a 64 byte add, then the first bytes of its body.
+  uint8_t header[16] = {64, 0, 0, 0, 1, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0};
+  torn.insert(torn.end(), header, header + sizeof(header));
+  torn.insert(torn.end(), 10, 0xab);
+  WriteBytes(torn);
+  GalleryJournal journal;
+  std::vector<JournalRecord> records;
+  Expect(Replay(journal, 0, records) == kOk && records.size() == 3, "torn record dropped");
+  Expect(journal.Commit(journal.AppendDelete(2)) == kOk, "append after the torn record");
+  journal.Close();
+  std::vector<uint8_t> bytes = ReadBytes();
+  Expect(bytes.size() > intact.size() && std::equal(intact.begin(), intact.end(), bytes.begin()),
+         "torn record cut off");
+  Expect(Replay(journal, 0, records) == kOk && records.size() == 4 &&
+             records[3].sequence == 4 && records[3].features_id == 2, "record after the cut");
+  journal.Close();
+  std::remove(kPath);
+}
+
+// A last record that fails its checksum is dropped like a torn one.
+void TestCorruptTail() {
+  WriteLog();
+  std::vector<uint8_t> bytes = ReadBytes();
+  // The features id of the delete, ahead of its checksum.
+  bytes[bytes.size() - 9] ^= 0x40;
+  WriteBytes(bytes);
+  GalleryJournal journal;
+  std::vector<JournalRecord> records;
+  Expect(Replay(journal, 0, records) == kOk && records.size() == 2, "corrupt record dropped");
+  Expect(journal.sequence() == 2, "sequence of the last intact record");
+  journal.Close();
+  // A replay that fails stops the recovery.
+  Expect(journal.Open(kPath, Key("v1"), 0,
+                      [](const JournalRecord&) { return kCompareGalleryCorrupt; }) ==
+             kCompareGalleryCorrupt, "replay error");
+  std::remove(kPath);
+}
+
+}  // namespace
+
+int main() {
+  TestReplay();
+  TestSequenceCutOff();
+  TestTornTail();
+  TestCorruptTail();
+  if (failures)
+    return 1;
+  std::printf("all tests passed\n");
+  return 0;
+}
@@ -0,0 +1,335 @@
+#include "hnsw_index.h"
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+namespace StreamPalm {
+
+namespace {
+
+struct LowerScore {
+  bool operator()(const std::pair<float, uint32_t>& a,
+                  const std::pair<float, uint32_t>& b) const {
+    return a.first < b.first;
+  }
+};
+
+struct HigherScore {
+  bool operator()(const std::pair<float, uint32_t>& a,
+                  const std::pair<float, uint32_t>& b) const {
+    return a.first > b.first;
+  }
+};
+
+// Visited marks, reset in O(1) by bumping the epoch. One per thread so searches can run
+// concurrently on the same graph.
+class VisitedSet {
+ public:
+  void Reset(size_t nodes) {
+    if (tags_.size() < nodes)
+      tags_.resize(nodes, 0);
+    if (++epoch_ == 0) {
+      std::fill(tags_.begin(), tags_.end(), 0);
+      epoch_ = 1;
+    }
+  }
+
+  // Returns false if the node was already visited.
+  bool Visit(uint32_t node) {
+    if (tags_[node] == epoch_)
+      return false;
+    tags_[node] = epoch_;
+    return true;
+  }
+
+ private:
+  std::vector<uint32_t> tags_;
+  uint32_t epoch_{0};
+};
+
+VisitedSet& LocalVisitedSet() {
+  static thread_local VisitedSet visited;
+  return visited;
+}
+
+}  // namespace
+
+constexpr uint32_t HnswIndex::kNoNode;
+
+HnswIndex::HnswIndex(const HnswParam& param, const float weight[kChannelCount]) :
+    param_(param),
+    rng_(0x5eed) {
+  param_.m = std::max<uint32_t>(param_.m, 2);
+  param_.ef_construction = std::max(param_.ef_construction, param_.m);
+  param_.ef_search = std::max<uint32_t>(param_.ef_search, 1);
+  for (int c = 0; c < kChannelCount; ++c) {
+    weight_[c] = weight[c];
+  }
+}
+
+void HnswIndex::GetLinks(uint32_t node, int level, const uint32_t*& links,
+                         size_t& count) const {
+  if (level == 0) {
+    const uint32_t* block = &links0_[node * (MaxLinks(0) + 1)];
+    count = block[0];
+    links = block + 1;
+  } else {
+    const std::vector<uint32_t>& list = upper_links_[node][level - 1];
+    count = list.size();
+    links = list.data();
+  }
+}
+
+void HnswIndex::SetLinks(uint32_t node, int level, const std::vector<uint32_t>& links) {
+  if (level == 0) {
+    uint32_t* block = &links0_[node * (MaxLinks(0) + 1)];
+    block[0] = static_cast<uint32_t>(links.size());
+    std::copy(links.begin(), links.end(), block + 1);
+  } else {
+    upper_links_[node][level - 1] = links;
+  }
+}
+
+float HnswIndex::Score(const FeatureGallery& gallery, const GalleryProbe& probe,
+                       uint32_t node) const {
+  float scores[kChannelCount];
+  return gallery.ScoreRow(probe, node_rows_[node], scores);
+}
+
+uint32_t HnswIndex::GreedyDescend(const FeatureGallery& gallery, const GalleryProbe& probe,
+                                  uint32_t entry, int from_level, int to_level) const {
+  uint32_t current = entry;
+  float best = Score(gallery, probe, current);
+  for (int level = from_level; level > to_level; --level) {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      const uint32_t* links;
+      size_t count;
+      GetLinks(current, level, links, count);
+      for (size_t i = 0; i < count; ++i) {
+        float score = Score(gallery, probe, links[i]);
+        if (score > best) {
+          best = score;
+          current = links[i];
+          changed = true;
+        }
+      }
+    }
+  }
+  return current;
+}
+
+std::vector<HnswIndex::ScoredNode> HnswIndex::SearchLayer(const FeatureGallery& gallery,
+                                                          const GalleryProbe& probe,
+                                                          uint32_t entry, size_t ef,
+                                                          int level) const {
+  VisitedSet& visited = LocalVisitedSet();
+  visited.Reset(node_rows_.size());
+  // Candidates to expand, best first, and the ef best results, worst on top.
+  std::priority_queue<ScoredNode, std::vector<ScoredNode>, LowerScore> candidates;
+  std::priority_queue<ScoredNode, std::vector<ScoredNode>, HigherScore> results;
+  float score = Score(gallery, probe, entry);
+  visited.Visit(entry);
+  candidates.emplace(score, entry);
+  results.emplace(score, entry);
+  while (!candidates.empty()) {
+    ScoredNode current = candidates.top();
+    if (current.first < results.top().first && results.size() >= ef)
+      break;
+    candidates.pop();
+    const uint32_t* links;
+    size_t count;
+    GetLinks(current.second, level, links, count);
+    for (size_t i = 0; i < count; ++i) {
+      uint32_t next = links[i];
+      if (!visited.Visit(next))
+        continue;
+      score = Score(gallery, probe, next);
+      if (results.size() < ef || score > results.top().first) {
+        candidates.emplace(score, next);
+        results.emplace(score, next);
+        if (results.size() > ef)
+          results.pop();
+      }
+    }
+  }
+  std::vector<ScoredNode> sorted;
+  sorted.reserve(results.size());
+  while (!results.empty()) {
+    sorted.push_back(results.top());
+    results.pop();
+  }
+  std::reverse(sorted.begin(), sorted.end());
+  return sorted;
+}
+
+std::vector<uint32_t> HnswIndex::SelectNeighbors(const FeatureGallery& gallery,
+                                                 const std::vector<ScoredNode>& candidates,
+                                                 size_t max_links) const {
+  // Keep a candidate only if it is closer to the base than to every neighbour kept so far,
+  // which spreads the links over several directions instead of one dense cluster.
+  std::vector<uint32_t> selected;
+  std::vector<ProbeBuffers> buffers(max_links);
+  std::vector<GalleryProbe> probes(max_links);
+  for (const ScoredNode& candidate : candidates) {
+    if (selected.size() >= max_links)
+      break;
+    bool keep = true;
+    for (size_t i = 0; i < selected.size() && keep; ++i) {
+      keep = Score(gallery, probes[i], candidate.second) < candidate.first;
+    }
+    if (!keep)
+      continue;
+    gallery.RowProbe(node_rows_[candidate.second], weight_, buffers[selected.size()],
+                     probes[selected.size()]);
+    selected.push_back(candidate.second);
+  }
+  // Fill up with the pruned candidates so sparse regions stay connected.
+  for (const ScoredNode& candidate : candidates) {
+    if (selected.size() >= max_links)
+      break;
+    if (std::find(selected.begin(), selected.end(), candidate.second) == selected.end())
+      selected.push_back(candidate.second);
+  }
+  return selected;
+}
+
+void HnswIndex::Relink(const FeatureGallery& gallery, uint32_t node, int level,
+                       const std::vector<uint32_t>& extra) {
+  const uint32_t* links;
+  size_t count;
+  GetLinks(node, level, links, count);
+  std::vector<uint32_t> pool(links, links + count);
+  for (uint32_t other : extra) {
+    if (other != node && std::find(pool.begin(), pool.end(), other) == pool.end())
+      pool.push_back(other);
+  }
+  if (pool.size() <= MaxLinks(level)) {
+    SetLinks(node, level, pool);
+    return;
+  }
+  ProbeBuffers buffers;
+  GalleryProbe probe;
+  gallery.RowProbe(node_rows_[node], weight_, buffers, probe);
+  std::vector<ScoredNode> candidates;
+  candidates.reserve(pool.size());
+  for (uint32_t other : pool) {
+    candidates.emplace_back(Score(gallery, probe, other), other);
+  }
+  std::sort(candidates.begin(), candidates.end(), HigherScore());
+  SetLinks(node, level, SelectNeighbors(gallery, candidates, MaxLinks(level)));
+}
+
+int HnswIndex::RandomLevel() {
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  double r = std::max(uniform(rng_), 1e-12);
+  return static_cast<int>(-std::log(r) / std::log(static_cast<double>(param_.m)));
+}
+
+void HnswIndex::Insert(const FeatureGallery& gallery, size_t row) {
+  uint32_t node;
+  if (!free_nodes_.empty()) {
+    node = free_nodes_.back();
+    free_nodes_.pop_back();
+  } else {
+    node = static_cast<uint32_t>(node_rows_.size());
+    node_rows_.push_back(kNoNode);
+    levels_.push_back(0);
+    upper_links_.emplace_back();
+    links0_.resize(node_rows_.size() * (MaxLinks(0) + 1), 0);
+  }
+  int level = RandomLevel();
+  node_rows_[node] = static_cast<uint32_t>(row);
+  levels_[node] = level;
+  upper_links_[node].assign(level, std::vector<uint32_t>());
+  links0_[node * (MaxLinks(0) + 1)] = 0;
+  if (row_nodes_.size() <= row)
+    row_nodes_.resize(row + 1, kNoNode);
+  row_nodes_[row] = node;
+
+  if (entry_ == kNoNode) {
+    entry_ = node;
+    max_level_ = level;
+    return;
+  }
+  ProbeBuffers buffers;
+  GalleryProbe probe;
+  gallery.RowProbe(row, weight_, buffers, probe);
+  uint32_t entry = GreedyDescend(gallery, probe, entry_, max_level_, level);
+  for (int l = std::min(level, max_level_); l >= 0; --l) {
+    std::vector<ScoredNode> found = SearchLayer(gallery, probe, entry, param_.ef_construction, l);
+    std::vector<uint32_t> neighbors = SelectNeighbors(gallery, found, param_.m);
+    SetLinks(node, l, neighbors);
+    for (uint32_t neighbor : neighbors) {
+      Relink(gallery, neighbor, l, std::vector<uint32_t>(1, node));
+    }
+    entry = found.front().second;
+  }
+  if (level > max_level_) {
+    entry_ = node;
+    max_level_ = level;
+  }
+}
+
+void HnswIndex::Remove(const FeatureGallery& gallery, size_t row) {
+  uint32_t node = row_nodes_[row];
+  int level = levels_[node];
+  // Every node that pointed at the removed one is relinked through its neighbours.
+  for (int l = 0; l <= level; ++l) {
+    const uint32_t* links;
+    size_t count;
+    GetLinks(node, l, links, count);
+    std::vector<uint32_t> orphan_links(links, links + count);
+    for (uint32_t other = 0; other < node_rows_.size(); ++other) {
+      if (other == node || node_rows_[other] == kNoNode || levels_[other] < l)
+        continue;
+      GetLinks(other, l, links, count);
+      if (std::find(links, links + count, node) == links + count)
+        continue;
+      std::vector<uint32_t> kept;
+      for (size_t i = 0; i < count; ++i) {
+        if (links[i] != node)
+          kept.push_back(links[i]);
+      }
+      SetLinks(other, l, kept);
+      Relink(gallery, other, l, orphan_links);
+    }
+  }
+  node_rows_[node] = kNoNode;
+  levels_[node] = 0;
+  upper_links_[node].clear();
+  links0_[node * (MaxLinks(0) + 1)] = 0;
+  free_nodes_.push_back(node);
+
+  if (entry_ == node) {
+    entry_ = kNoNode;
+    max_level_ = -1;
+    for (uint32_t other = 0; other < node_rows_.size(); ++other) {
+      if (node_rows_[other] != kNoNode && levels_[other] > max_level_) {
+        entry_ = other;
+        max_level_ = levels_[other];
+      }
+    }
+  }
+  // Follow the swap with the last row done by FeatureGallery::Remove().
+  size_t last = row_nodes_.size() - 1;
+  if (row != last) {
+    row_nodes_[row] = row_nodes_[last];
+    node_rows_[row_nodes_[row]] = static_cast<uint32_t>(row);
+  }
+  row_nodes_.pop_back();
+}
+
+void HnswIndex::Search(const FeatureGallery& gallery, const GalleryProbe& probe, size_t top_k,
+                       TopKHeap& heap) const {
+  if (entry_ == kNoNode)
+    return;
+  uint32_t entry = GreedyDescend(gallery, probe, entry_, max_level_, 0);
+  size_t ef = std::max<size_t>(param_.ef_search, top_k);
+  for (const ScoredNode& item : SearchLayer(gallery, probe, entry, ef, 0)) {
+    heap.Push(item.first, node_rows_[item.second]);
+  }
+}
+
+}  // namespace StreamPalm
@@ -0,0 +1,68 @@
+#ifndef PALM_COMPARE_HNSW_INDEX_H_
+#define PALM_COMPARE_HNSW_INDEX_H_
+
+#include <random>
+#include <utility>
+#include <vector>
+#include "feature_gallery.h"
+
+namespace StreamPalm {
+
+// Hierarchical navigable small world graph over the rows of a FeatureGallery. Nodes are scored
+// with the same fused score as the exhaustive scan, so it works for every metric and storage.
+// Node ids are stable while gallery rows move on removal, node_rows_/row_nodes_ map between them.
+class HnswIndex {
+ public:
+  HnswIndex(const HnswParam& param, const float weight[kChannelCount]);
+
+  void SetEfSearch(uint32_t ef_search) { param_.ef_search = ef_search; }
+  const HnswParam& param() const { return param_; }
+  size_t size() const { return row_nodes_.size(); }
+
+  // Link a row that was just added to the gallery.
+  void Insert(const FeatureGallery& gallery, size_t row);
+
+  // Unlink a row. Must be called before FeatureGallery::Remove() moves the last row into it.
+  void Remove(const FeatureGallery& gallery, size_t row);
+
+  // Offer the approximate top_k rows to the heap.
+  void Search(const FeatureGallery& gallery, const GalleryProbe& probe, size_t top_k,
+              TopKHeap& heap) const;
+
+ private:
+  using ScoredNode = std::pair<float, uint32_t>;
+
+  size_t MaxLinks(int level) const { return level == 0 ? param_.m * 2 : param_.m; }
+  void GetLinks(uint32_t node, int level, const uint32_t*& links, size_t& count) const;
+  void SetLinks(uint32_t node, int level, const std::vector<uint32_t>& links);
+
+  float Score(const FeatureGallery& gallery, const GalleryProbe& probe, uint32_t node) const;
+  uint32_t GreedyDescend(const FeatureGallery& gallery, const GalleryProbe& probe,
+                         uint32_t entry, int from_level, int to_level) const;
+  std::vector<ScoredNode> SearchLayer(const FeatureGallery& gallery, const GalleryProbe& probe,
+                                      uint32_t entry, size_t ef, int level) const;
+  // Diversity heuristic of the HNSW paper, candidates sorted by descending score.
+  std::vector<uint32_t> SelectNeighbors(const FeatureGallery& gallery,
+                                        const std::vector<ScoredNode>& candidates,
+                                        size_t max_links) const;
+  void Relink(const FeatureGallery& gallery, uint32_t node, int level,
+              const std::vector<uint32_t>& extra);
+  int RandomLevel();
+
+  static constexpr uint32_t kNoNode = 0xffffffffu;
+
+  HnswParam param_;
+  float weight_[kChannelCount];
+  std::mt19937 rng_;
+  uint32_t entry_{kNoNode};
+  int max_level_{-1};
+  std::vector<int> levels_;
+  std::vector<uint32_t> links0_;  // (count, links[2m]) per node
+  std::vector<std::vector<std::vector<uint32_t>>> upper_links_;
+  std::vector<uint32_t> node_rows_;
+  std::vector<uint32_t> row_nodes_;
+  std::vector<uint32_t> free_nodes_;
+};
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_HNSW_INDEX_H_
@@ -0,0 +1,70 @@
+#include "hot_tier.h"
+
+namespace StreamPalm {
+
+int HotTier::Promote(const FeatureGallery& whole, size_t row) {
+  int features_id = whole.id(row);
+  if (entries_.count(features_id)) {
+    Touch(features_id);
+    return kOk;
+  }
+  if (!capacity_)
+    return kOk;
+  if (!gallery_.IsInitialized()) {
+    gallery_.Init(whole.dim(kIrChannel), whole.dim(kRgbChannel));
+    gallery_.SetPartitioned(whole.partitioned());
+    gallery_.Reserve(capacity_);
+  }
+  if (entries_.size() >= capacity_) {
+    gallery_.Remove(order_.back());
+    entries_.erase(order_.back());
+    order_.pop_back();
+  }
+  // Decoded from the stored row, quantized rows are stored again as they were.
+  static const float kWeight[kChannelCount] = {1.0f, 1.0f};
+  ProbeBuffers buffers;
+  GalleryProbe probe;
+  whole.RowProbe(row, kWeight, buffers, probe);
+  size_t begin = 0;
+  size_t end = 0;
+  whole.PartitionRange(1, begin, end);
+  int partition = whole.partitioned() && row >= begin ? 1 : 0;
+  int ret = gallery_.Add(features_id, probe.features, nullptr, partition);
+  if (ret)
+    return ret;
+  order_.push_front(features_id);
+  entries_[features_id] = order_.begin();
+  return kOk;
+}
+
+void HotTier::Touch(int features_id) {
+  auto it = entries_.find(features_id);
+  if (it != entries_.end())
+    order_.splice(order_.begin(), order_, it->second);
+}
+
+void HotTier::Remove(int features_id) {
+  auto it = entries_.find(features_id);
+  if (it == entries_.end())
+    return;
+  gallery_.Remove(features_id);
+  order_.erase(it->second);
+  entries_.erase(it);
+}
+
+void HotTier::Clear() {
+  gallery_ = FeatureGallery(gallery_.metric(), gallery_.storage());
+  order_.clear();
+  entries_.clear();
+}
+
+void HotTier::Range(int palm_type, size_t& begin, size_t& end) const {
+  if (palm_type < 0 || !gallery_.partitioned()) {
+    begin = 0;
+    end = gallery_.size();
+    return;
+  }
+  gallery_.PartitionRange(palm_type, begin, end);
+}
+
+}  // namespace StreamPalm
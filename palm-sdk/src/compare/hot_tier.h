@@ -0,0 +1,44 @@
+#ifndef PALM_COMPARE_HOT_TIER_H_
+#define PALM_COMPARE_HOT_TIER_H_
+
+#include <list>
+#include <unordered_map>
+#include "feature_gallery.h"
+
+namespace StreamPalm {
+
+// Copies of the templates of the most recently matched ids, a gallery small enough to stay in
+// the cache that is searched ahead of the whole one. Once capacity ids are kept, the least
+// recently matched one makes room for a new one. Only for galleries with one template per id.
+class HotTier {
+ public:
+  HotTier(CompareMetric metric, FeatureStorage storage, size_t capacity) :
+      gallery_(metric, storage),
+      capacity_(capacity) {}
+
+  // Copy the template at row of the whole gallery, into the same palm type partition.
+  int Promote(const FeatureGallery& whole, size_t row);
+  // Mark a kept id as matched.
+  void Touch(int features_id);
+  void Remove(int features_id);
+  void Clear();
+
+  // Rows of the palm type partition, or all of them for a negative palm type.
+  void Range(int palm_type, size_t& begin, size_t& end) const;
+
+  const FeatureGallery& gallery() const { return gallery_; }
+  size_t size() const { return gallery_.size(); }
+  size_t capacity() const { return capacity_; }
+  // Kept ids, the most recently matched first.
+  const std::list<int>& order() const { return order_; }
+
+ private:
+  FeatureGallery gallery_;
+  size_t capacity_;
+  // Most recently matched first.
+  std::list<int> order_;
+  std::unordered_map<int, std::list<int>::iterator> entries_;
+};
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_HOT_TIER_H_
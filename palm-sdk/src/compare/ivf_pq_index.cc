@@ -0,0 +1,436 @@
+#include "ivf_pq_index.h"
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <random>
+
+namespace StreamPalm {
+
+namespace {
+
+constexpr uint32_t kCodebookMagic = 0x51505649;  // "IVPQ"
+constexpr uint32_t kCodebookVersion = 1;
+constexpr int kKMeansIterations = 12;
+
+float Dot(const float* a, const float* b, size_t n) {
+  float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    sum[0] += a[i] * b[i];
+    sum[1] += a[i + 1] * b[i + 1];
+    sum[2] += a[i + 2] * b[i + 2];
+    sum[3] += a[i + 3] * b[i + 3];
+  }
+  for (; i < n; ++i) {
+    sum[0] += a[i] * b[i];
+  }
+  return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+// Nearest of k centroids by euclidean distance, sq_norms are the centroid squared norms.
+size_t Nearest(const float* x, const std::vector<float>& centroids,
+               const std::vector<float>& sq_norms, size_t dim) {
+  size_t best = 0;
+  float best_score = -std::numeric_limits<float>::infinity();
+  for (size_t j = 0; j < sq_norms.size(); ++j) {
+    float score = 2.0f * Dot(x, &centroids[j * dim], dim) - sq_norms[j];
+    if (score > best_score) {
+      best_score = score;
+      best = j;
+    }
+  }
+  return best;
+}
+
+// Lloyd's k-means on n row major points. Empty clusters are re-seeded with a random point.
+void KMeans(const std::vector<float>& points, size_t n, size_t dim, size_t k,
+            std::mt19937& rng, std::vector<float>& centroids, std::vector<uint32_t>& assign) {
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; ++i) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), rng);
+  centroids.resize(k * dim);
+  for (size_t j = 0; j < k; ++j) {
+    std::copy_n(&points[order[j] * dim], dim, &centroids[j * dim]);
+  }
+  assign.assign(n, 0);
+  std::vector<float> sq_norms(k);
+  std::vector<size_t> counts(k);
+  for (int iteration = 0; iteration < kKMeansIterations; ++iteration) {
+    for (size_t j = 0; j < k; ++j) {
+      sq_norms[j] = Dot(&centroids[j * dim], &centroids[j * dim], dim);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      assign[i] = static_cast<uint32_t>(Nearest(&points[i * dim], centroids, sq_norms, dim));
+    }
+    std::fill(centroids.begin(), centroids.end(), 0.0f);
+    std::fill(counts.begin(), counts.end(), 0);
+    for (size_t i = 0; i < n; ++i) {
+      float* centroid = &centroids[assign[i] * dim];
+      const float* point = &points[i * dim];
+      for (size_t d = 0; d < dim; ++d) {
+        centroid[d] += point[d];
+      }
+      ++counts[assign[i]];
+    }
+    for (size_t j = 0; j < k; ++j) {
+      if (!counts[j]) {
+        std::copy_n(&points[(rng() % n) * dim], dim, &centroids[j * dim]);
+        continue;
+      }
+      for (size_t d = 0; d < dim; ++d) {
+        centroids[j * dim + d] /= counts[j];
+      }
+    }
+  }
+}
+
+bool WriteValues(std::FILE* file, const void* data, size_t size, size_t count) {
+  return !count || std::fwrite(data, size, count, file) == count;
+}
+
+bool ReadValues(std::FILE* file, void* data, size_t size, size_t count) {
+  return !count || std::fread(data, size, count, file) == count;
+}
+
+}  // namespace
+
+int IvfPqIndex::Train(const size_t dims[kChannelCount],
+                      const std::vector<std::vector<float>>* const samples[kChannelCount],
+                      uint32_t nlist, uint32_t pq_m) {
+  size_t n = 0;
+  size_t joint_dim = 0;
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (!dims[c])
+      continue;
+    if (!samples[c] || !pq_m || dims[c] % pq_m)
+      return kInvalidArguments;
+    if (n && samples[c]->size() != n)
+      return kInvalidArguments;
+    n = samples[c]->size();
+    joint_dim += dims[c];
+  }
+  if (!joint_dim || !nlist || n < nlist || n < kPqCentroids)
+    return kInvalidArguments;
+
+  // Coarse quantizer on the concatenation of the used channels.
+  std::vector<float> points(n * joint_dim);
+  AlignedBuffer<float> scratch;
+  for (size_t i = 0; i < n; ++i) {
+    size_t offset = 0;
+    for (int c = 0; c < kChannelCount; ++c) {
+      if (!dims[c])
+        continue;
+      const std::vector<float>& sample = (*samples[c])[i];
+      if (sample.size() != dims[c])
+        return kCompareDimensionMismatch;
+      scratch.Resize(0);
+      scratch.Resize(ProbeDim(dims[c]));
+      std::copy(sample.begin(), sample.end(), scratch.data());
+      if (metric_ == CompareMetric::kCosine)
+        NormalizeFeature(scratch.data(), scratch.size());
+      std::copy_n(scratch.data(), dims[c], &points[i * joint_dim + offset]);
+      offset += dims[c];
+    }
+  }
+  std::mt19937 rng(0x5eed);
+  std::vector<float> coarse;
+  std::vector<uint32_t> assign;
+  KMeans(points, n, joint_dim, nlist, rng, coarse, assign);
+
+  nlist_ = nlist;
+  pq_m_ = pq_m;
+  size_t offset = 0;
+  for (int c = 0; c < kChannelCount; ++c) {
+    dims_[c] = dims[c];
+    centroids_[c].Init(dims[c]);
+    codebooks_[c].clear();
+    if (!dims[c])
+      continue;
+    centroids_[c].Resize(nlist);
+    for (size_t j = 0; j < nlist; ++j) {
+      std::copy_n(&coarse[j * joint_dim + offset], dims[c], centroids_[c].MutableRow(j));
+    }
+    // One codebook per sub-space, trained on the residuals to the coarse centroids.
+    size_t sub_dim = SubDim(c);
+    codebooks_[c].resize(pq_m * kPqCentroids * sub_dim);
+    std::vector<float> residuals(n * sub_dim);
+    std::vector<float> codebook;
+    std::vector<uint32_t> codes;
+    for (uint32_t m = 0; m < pq_m; ++m) {
+      size_t column = offset + m * sub_dim;
+      for (size_t i = 0; i < n; ++i) {
+        for (size_t d = 0; d < sub_dim; ++d) {
+          residuals[i * sub_dim + d] = points[i * joint_dim + column + d] -
+                                       coarse[assign[i] * joint_dim + column + d];
+        }
+      }
+      KMeans(residuals, n, sub_dim, kPqCentroids, rng, codebook, codes);
+      float* transposed = &codebooks_[c][m * kPqCentroids * sub_dim];
+      for (size_t k = 0; k < kPqCentroids; ++k) {
+        for (size_t d = 0; d < sub_dim; ++d) {
+          transposed[d * kPqCentroids + k] = codebook[k * sub_dim + d];
+        }
+      }
+    }
+    offset += dims[c];
+  }
+  InitLists();
+  return kOk;
+}
+
+void IvfPqIndex::InitLists() {
+  code_size_ = 0;
+  for (int c = 0; c < kChannelCount; ++c) {
+    centroid_sq_norms_[c].assign(dims_[c] ? nlist_ : 0, 0.0f);
+    for (size_t j = 0; j < centroid_sq_norms_[c].size(); ++j) {
+      const float* centroid = centroids_[c].Row(j);
+      centroid_sq_norms_[c][j] = FeatureDot(centroid, centroid, centroids_[c].stride());
+    }
+    if (dims_[c])
+      code_size_ += pq_m_;
+  }
+  lists_.assign(nlist_, InvertedList());
+  slots_.clear();
+}
+
+int IvfPqIndex::Save(const std::string& path) const {
+  std::FILE* file = std::fopen(path.c_str(), "wb");
+  if (!file)
+    return kFailedToOperateFile;
+  uint32_t header[7] = {kCodebookMagic, kCodebookVersion, static_cast<uint32_t>(metric_),
+                        static_cast<uint32_t>(dims_[kIrChannel]),
+                        static_cast<uint32_t>(dims_[kRgbChannel]), nlist_, pq_m_};
+  bool ok = WriteValues(file, header, sizeof(uint32_t), 7);
+  for (int c = 0; c < kChannelCount && ok; ++c) {
+    for (size_t j = 0; j < centroid_sq_norms_[c].size() && ok; ++j) {
+      ok = WriteValues(file, centroids_[c].Row(j), sizeof(float), dims_[c]);
+    }
+    ok = ok && WriteValues(file, codebooks_[c].data(), sizeof(float), codebooks_[c].size());
+  }
+  ok = std::fclose(file) == 0 && ok;
+  return ok ? kOk : kFailedToOperateFile;
+}
+
+int IvfPqIndex::Load(const std::string& path) {
+  std::FILE* file = std::fopen(path.c_str(), "rb");
+  if (!file)
+    return kFileNotExist;
+  uint32_t header[7];
+  if (!ReadValues(file, header, sizeof(uint32_t), 7) || header[0] != kCodebookMagic ||
+      header[1] != kCodebookVersion) {
+    std::fclose(file);
+    return kFailedToOperateFile;
+  }
+  if (header[2] != static_cast<uint32_t>(metric_) || !header[5] || !header[6]) {
+    std::fclose(file);
+    return kInvalidArguments;
+  }
+  dims_[kIrChannel] = header[3];
+  dims_[kRgbChannel] = header[4];
+  nlist_ = header[5];
+  pq_m_ = header[6];
+  bool ok = true;
+  for (int c = 0; c < kChannelCount && ok; ++c) {
+    centroids_[c].Init(dims_[c]);
+    codebooks_[c].clear();
+    if (!dims_[c])
+      continue;
+    centroids_[c].Resize(nlist_);
+    for (size_t j = 0; j < nlist_ && ok; ++j) {
+      ok = ReadValues(file, centroids_[c].MutableRow(j), sizeof(float), dims_[c]);
+    }
+    codebooks_[c].resize(pq_m_ * kPqCentroids * SubDim(c));
+    ok = ok && ReadValues(file, codebooks_[c].data(), sizeof(float), codebooks_[c].size());
+  }
+  std::fclose(file);
+  if (!ok)
+    return kFailedToOperateFile;
+  InitLists();
+  return kOk;
+}
+
+uint32_t IvfPqIndex::NearestList(const AlignedBuffer<float> features[kChannelCount]) const {
+  std::vector<float> scores(nlist_, 0.0f);
+  std::vector<float> dots(nlist_);
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (!dims_[c])
+      continue;
+    FeatureDotBatch(features[c].data(), centroids_[c].Row(0), centroids_[c].stride(), nlist_,
+                    dots.data());
+    for (size_t j = 0; j < nlist_; ++j) {
+      scores[j] += 2.0f * dots[j] - centroid_sq_norms_[c][j];
+    }
+  }
+  return static_cast<uint32_t>(std::max_element(scores.begin(), scores.end()) -
+                               scores.begin());
+}
+
+void IvfPqIndex::Insert(const FeatureGallery& gallery, size_t row,
+                        const float* const features[kChannelCount]) {
+  AlignedBuffer<float> scratch[kChannelCount];
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (!dims_[c])
+      continue;
+    scratch[c].Resize(ProbeDim(dims_[c]));
+    std::copy_n(features[c], dims_[c], scratch[c].data());
+    gallery.NormalizeIfCosine(scratch[c].data(), scratch[c].size());
+  }
+  uint32_t list = NearestList(scratch);
+  InvertedList& inverted = lists_[list];
+  size_t position = inverted.rows.size();
+  inverted.codes.resize((position + 1) * code_size_);
+  uint8_t* code = &inverted.codes[position * code_size_];
+  std::vector<float> residual;
+  for (int c = 0; c < kChannelCount; ++c) {
+    if (!dims_[c])
+      continue;
+    size_t sub_dim = SubDim(c);
+    const float* centroid = centroids_[c].Row(list);
+    residual.resize(sub_dim);
+    for (uint32_t m = 0; m < pq_m_; ++m) {
+      for (size_t d = 0; d < sub_dim; ++d) {
+        residual[d] = scratch[c][m * sub_dim + d] - centroid[m * sub_dim + d];
+      }
+      const float* codebook = &codebooks_[c][m * kPqCentroids * sub_dim];
+      float distances[kPqCentroids] = {0.0f};
+      for (size_t d = 0; d < sub_dim; ++d) {
+        const float* column = codebook + d * kPqCentroids;
+        for (size_t k = 0; k < kPqCentroids; ++k) {
+          float diff = residual[d] - column[k];
+          distances[k] += diff * diff;
+        }
+      }
+      *code++ = static_cast<uint8_t>(std::min_element(distances, distances + kPqCentroids) -
+                                     distances);
+    }
+  }
+  inverted.rows.push_back(static_cast<uint32_t>(row));
+  if (slots_.size() <= row)
+    slots_.resize(row + 1);
+  slots_[row] = std::make_pair(list, static_cast<uint32_t>(position));
+}
+
+void IvfPqIndex::Remove(const FeatureGallery& gallery, size_t row) {
+  std::pair<uint32_t, uint32_t> slot = slots_[row];
+  InvertedList& inverted = lists_[slot.first];
+  size_t end = inverted.rows.size() - 1;
+  if (slot.second != end) {
+    std::copy_n(&inverted.codes[end * code_size_], code_size_,
+                &inverted.codes[slot.second * code_size_]);
+    inverted.rows[slot.second] = inverted.rows[end];
+    slots_[inverted.rows[slot.second]].second = slot.second;
+  }
+  inverted.rows.pop_back();
+  inverted.codes.resize(end * code_size_);
+  // Follow the swap with the last row done by FeatureGallery::Remove().
+  size_t last = gallery.size() - 1;
+  if (row != last) {
+    slots_[row] = slots_[last];
+    lists_[slots_[row].first].rows[slots_[row].second] = static_cast<uint32_t>(row);
+  }
+  slots_.pop_back();
+}
+
+void IvfPqIndex::PrepareQuery(const FeatureGallery& gallery, const GalleryProbe& probe,
+                              IvfPqQuery& query) const {
+  query.probe = &probe;
+  std::vector<float> list_scores(nlist_, 0.0f);
+  for (int c = 0; c < kChannelCount; ++c) {
+    query.list_dots[c].clear();
+    query.tables[c].clear();
+    if (!probe.features[c] || !dims_[c])
+      continue;
+    query.list_dots[c].resize(nlist_);
+    FeatureDotBatch(probe.features[c], centroids_[c].Row(0), centroids_[c].stride(), nlist_,
+                    query.list_dots[c].data());
+    for (size_t j = 0; j < nlist_; ++j) {
+      float dot = query.list_dots[c][j];
+      float score = gallery.metric() == CompareMetric::kCosine ?
+                    dot : 2.0f * dot - centroid_sq_norms_[c][j];
+      list_scores[j] += probe.weight[c] * score;
+    }
+    size_t sub_dim = SubDim(c);
+    query.tables[c].resize(pq_m_ * kPqCentroids);
+    for (uint32_t m = 0; m < pq_m_; ++m) {
+      const float* sub_probe = probe.features[c] + m * sub_dim;
+      const float* codebook = &codebooks_[c][m * kPqCentroids * sub_dim];
+      // Column wise over the transposed codebook, so the inner loop vectorizes.
+      float table[kPqCentroids] = {0.0f};
+      for (size_t d = 0; d < sub_dim; ++d) {
+        const float* column = codebook + d * kPqCentroids;
+        float value = sub_probe[d];
+        for (size_t k = 0; k < kPqCentroids; ++k) {
+          table[k] += value * column[k];
+        }
+      }
+      std::copy_n(table, kPqCentroids, &query.tables[c][m * kPqCentroids]);
+    }
+  }
+  query.lists.resize(nlist_);
+  for (uint32_t j = 0; j < nlist_; ++j) {
+    query.lists[j] = j;
+  }
+  size_t visit = std::min<size_t>(std::max<uint32_t>(nprobe_, 1), nlist_);
+  std::partial_sort(query.lists.begin(), query.lists.begin() + visit, query.lists.end(),
+                    [&list_scores](uint32_t a, uint32_t b) {
+                      return list_scores[a] > list_scores[b];
+                    });
+  query.lists.resize(visit);
+}
+
+float IvfPqIndex::ScoreCode(const FeatureGallery& gallery, const IvfPqQuery& query,
+                            uint32_t list, const uint8_t* code, size_t row,
+                            float channel_scores[kChannelCount]) const {
+  const GalleryProbe& probe = *query.probe;
+  float fused = 0.0f;
+  for (int c = 0; c < kChannelCount; ++c) {
+    channel_scores[c] = 0.0f;
+    if (!dims_[c])
+      continue;
+    if (!probe.features[c]) {
+      code += pq_m_;
+      continue;
+    }
+    // Independent accumulators hide the latency of the table loads.
+    const float* table = query.tables[c].data();
+    float sum[4] = {query.list_dots[c][list], 0.0f, 0.0f, 0.0f};
+    uint32_t m = 0;
+    for (; m + 4 <= pq_m_; m += 4, code += 4, table += 4 * kPqCentroids) {
+      sum[0] += table[code[0]];
+      sum[1] += table[kPqCentroids + code[1]];
+      sum[2] += table[2 * kPqCentroids + code[2]];
+      sum[3] += table[3 * kPqCentroids + code[3]];
+    }
+    for (; m < pq_m_; ++m, table += kPqCentroids) {
+      sum[0] += table[*code++];
+    }
+    float dot = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    channel_scores[c] = gallery.ChannelScore(probe, c, row, dot);
+    fused += probe.weight[c] * channel_scores[c];
+  }
+  return fused;
+}
+
+void IvfPqIndex::Search(const FeatureGallery& gallery, const IvfPqQuery& query,
+                        TopKHeap& heap) const {
+  float scores[kChannelCount];
+  for (uint32_t list : query.lists) {
+    const InvertedList& inverted = lists_[list];
+    const uint8_t* code = inverted.codes.data();
+    for (size_t i = 0; i < inverted.rows.size(); ++i, code += code_size_) {
+      heap.Push(ScoreCode(gallery, query, list, code, inverted.rows[i], scores),
+                inverted.rows[i]);
+    }
+  }
+}
+
+float IvfPqIndex::ScoreRow(const FeatureGallery& gallery, const IvfPqQuery& query, size_t row,
+                           float channel_scores[kChannelCount]) const {
+  std::pair<uint32_t, uint32_t> slot = slots_[row];
+  const uint8_t* code = &lists_[slot.first].codes[slot.second * code_size_];
+  return ScoreCode(gallery, query, slot.first, code, row, channel_scores);
+}
+
+}  // namespace StreamPalm
@@ -0,0 +1,86 @@
+#ifndef PALM_COMPARE_IVF_PQ_INDEX_H_
+#define PALM_COMPARE_IVF_PQ_INDEX_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "feature_gallery.h"
+
+namespace StreamPalm {
+
+// Centroids per sub-quantizer, one byte per code.
+constexpr size_t kPqCentroids = 256;
+
+// Lookup tables of one probe, built once per query.
+struct IvfPqQuery {
+  const GalleryProbe* probe{nullptr};
+  // Inner product of the probe with every coarse centroid, per channel.
+  std::vector<float> list_dots[kChannelCount];
+  // Inner product of every probe sub-vector with every code word, [pq_m][kPqCentroids].
+  std::vector<float> tables[kChannelCount];
+  // Lists visited, best first.
+  std::vector<uint32_t> lists;
+};
+
+// Inverted file with product quantization. The coarse quantizer assigns a template to a list,
+// the residual to the list centroid is encoded with pq_m one byte codes per channel. Codebooks
+// are trained offline by Train() and shared by every list.
+class IvfPqIndex {
+ public:
+  explicit IvfPqIndex(CompareMetric metric) : metric_(metric) {}
+
+  // samples[c] is null for an unused channel. Features are normalized for kCosine.
+  int Train(const size_t dims[kChannelCount],
+            const std::vector<std::vector<float>>* const samples[kChannelCount],
+            uint32_t nlist, uint32_t pq_m);
+  int Save(const std::string& path) const;
+  int Load(const std::string& path);
+
+  size_t dim(int channel) const { return dims_[channel]; }
+  size_t code_size() const { return code_size_; }
+  void SetNprobe(uint32_t nprobe) { nprobe_ = nprobe; }
+
+  // Encode a row that was just added to the gallery, features as given to the gallery.
+  void Insert(const FeatureGallery& gallery, size_t row,
+              const float* const features[kChannelCount]);
+
+  // Drop a row. Must be called before FeatureGallery::Remove() moves the last row into it.
+  void Remove(const FeatureGallery& gallery, size_t row);
+
+  void PrepareQuery(const FeatureGallery& gallery, const GalleryProbe& probe,
+                    IvfPqQuery& query) const;
+
+  // Offer every row of the visited lists to the heap.
+  void Search(const FeatureGallery& gallery, const IvfPqQuery& query, TopKHeap& heap) const;
+
+  // Approximate per channel and fused score of a row.
+  float ScoreRow(const FeatureGallery& gallery, const IvfPqQuery& query, size_t row,
+                 float channel_scores[kChannelCount]) const;
+
+ private:
+  struct InvertedList {
+    std::vector<uint8_t> codes;
+    std::vector<uint32_t> rows;
+  };
+
+  size_t SubDim(int channel) const { return dims_[channel] / pq_m_; }
+  uint32_t NearestList(const AlignedBuffer<float> features[kChannelCount]) const;
+  float ScoreCode(const FeatureGallery& gallery, const IvfPqQuery& query, uint32_t list,
+                  const uint8_t* code, size_t row, float channel_scores[kChannelCount]) const;
+  void InitLists();
+
+  CompareMetric metric_;
+  size_t dims_[kChannelCount]{0, 0};
+  uint32_t nlist_{0};
+  uint32_t pq_m_{0};
+  uint32_t nprobe_{1};
+  size_t code_size_{0};
+  FeatureMatrix centroids_[kChannelCount];
+  std::vector<float> centroid_sq_norms_[kChannelCount];
+  std::vector<float> codebooks_[kChannelCount];  // [pq_m][sub_dim][kPqCentroids]
+  std::vector<InvertedList> lists_;
+  std::vector<std::pair<uint32_t, uint32_t>> slots_;  // (list, position) per row
+};
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_IVF_PQ_INDEX_H_
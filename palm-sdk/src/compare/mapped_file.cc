@@ -0,0 +1,116 @@
+#include "mapped_file.h"
+#if _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "palm/compare_arithmetic.h"
+
+namespace StreamPalm {
+
+namespace {
+
+#if _WIN32
+HANDLE OpenForMapping(const std::string& path) {
+  return CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+}
+
+bool StampOf(HANDLE file, FileStamp& stamp) {
+  BY_HANDLE_FILE_INFORMATION info;
+  if (!GetFileInformationByHandle(file, &info))
+    return false;
+  stamp.device = info.dwVolumeSerialNumber;
+  stamp.index = static_cast<uint64_t>(info.nFileIndexHigh) << 32 | info.nFileIndexLow;
+  stamp.size = static_cast<uint64_t>(info.nFileSizeHigh) << 32 | info.nFileSizeLow;
+  stamp.modified = static_cast<int64_t>(info.ftLastWriteTime.dwHighDateTime) << 32 |
+                   info.ftLastWriteTime.dwLowDateTime;
+  return true;
+}
+#else
+void StampOf(const struct stat& info, FileStamp& stamp) {
+  stamp.device = static_cast<uint64_t>(info.st_dev);
+  stamp.index = static_cast<uint64_t>(info.st_ino);
+  stamp.size = static_cast<uint64_t>(info.st_size);
+  stamp.modified = static_cast<int64_t>(info.st_mtime);
+}
+#endif
+
+}  // namespace
+
+bool StatFile(const std::string& path, FileStamp& stamp) {
+#if _WIN32
+  HANDLE file = OpenForMapping(path);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+  bool ok = StampOf(file, stamp);
+  CloseHandle(file);
+  return ok;
+#else
+  struct stat info;
+  if (stat(path.c_str(), &info))
+    return false;
+  StampOf(info, stamp);
+  return true;
+#endif
+}
+
+int MappedFile::Open(const std::string& path, bool read_only) {
+  Close();
+#if _WIN32
+  HANDLE file = OpenForMapping(path);
+  if (file == INVALID_HANDLE_VALUE)
+    return kFileNotExist;
+  if (!StampOf(file, stamp_) || !stamp_.size) {
+    CloseHandle(file);
+    return kFailedToOperateFile;
+  }
+  HANDLE mapping = CreateFileMappingA(file, nullptr, read_only ? PAGE_READONLY : PAGE_WRITECOPY,
+                                      0, 0, nullptr);
+  CloseHandle(file);
+  if (!mapping)
+    return kFailedToOperateFile;
+  void* data = MapViewOfFile(mapping, read_only ? FILE_MAP_READ : FILE_MAP_COPY, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!data)
+    return kFailedToOperateFile;
+  size_ = static_cast<size_t>(stamp_.size);
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return kFileNotExist;
+  struct stat info;
+  if (fstat(fd, &info) || !info.st_size) {
+    close(fd);
+    return kFailedToOperateFile;
+  }
+  StampOf(info, stamp_);
+  size_t size = static_cast<size_t>(info.st_size);
+  int protection = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+  void* data = mmap(nullptr, size, protection, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return kFailedToOperateFile;
+  size_ = size;
+#endif
+  data_ = static_cast<uint8_t*>(data);
+  return kOk;
+}
+
+void MappedFile::Close() {
+  if (!data_)
+    return;
+#if _WIN32
+  UnmapViewOfFile(data_);
+#else
+  munmap(data_, size_);
+#endif
+  data_ = nullptr;
+  size_ = 0;
+}
+
+}  // namespace StreamPalm
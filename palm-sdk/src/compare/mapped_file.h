@@ -0,0 +1,53 @@
+#ifndef PALM_COMPARE_MAPPED_FILE_H_
+#define PALM_COMPARE_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace StreamPalm {
+
+// Identity of the file at a path, another file renamed over it has another one.
+struct FileStamp {
+  uint64_t device{0};
+  uint64_t index{0};
+  uint64_t size{0};
+  int64_t modified{0};
+
+  bool operator==(const FileStamp& other) const {
+    return device == other.device && index == other.index && size == other.size &&
+           modified == other.modified;
+  }
+  bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+
+// false when there is no file at path.
+bool StatFile(const std::string& path, FileStamp& stamp);
+
+// Private copy-on-write mapping of a whole file. Pages are read from the page cache on first
+// touch and copied only when written, the file itself never changes. A read-only mapping is
+// never copied, every process mapping the file shares the same physical pages.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() { Close(); }
+
+  int Open(const std::string& path, bool read_only = false);
+  void Close();
+
+  // Page aligned, writing to a read-only mapping faults.
+  uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+  // Of the mapped file, which may no longer be the one at the path.
+  const FileStamp& stamp() const { return stamp_; }
+
+ private:
+  uint8_t* data_{nullptr};
+  size_t size_{0};
+  FileStamp stamp_;
+};
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_MAPPED_FILE_H_
@@ -0,0 +1,47 @@
+#include "palm_geometry.h"
+#include <algorithm>
+#include <cmath>
+#include "palm/compare_arithmetic.h"
+
+namespace StreamPalm {
+
+namespace {
+
+float PointDistance(const float* a, const float* b) {
+  return std::hypot(a[0] - b[0], a[1] - b[1]);
+}
+
+}  // namespace
+
+int SkeletonGeometry(const std::vector<float>& skeleton, std::vector<float>& descriptor) {
+  descriptor.clear();
+  if (skeleton.size() % 2)
+    return kDataSizeError;
+  size_t points = std::min(skeleton.size() / 2, kMaxSkeletonPoints);
+  if (points < 3)
+    return kDataSizeError;
+  const float* point = skeleton.data();
+  for (size_t i = 1; i < points; ++i) {
+    descriptor.push_back(PointDistance(point + 2 * (i - 1), point + 2 * i));
+  }
+  // The segment from the first keypoint to the second is already in.
+  for (size_t i = 2; i < points; ++i) {
+    descriptor.push_back(PointDistance(point, point + 2 * i));
+  }
+  float sum = 0.0f;
+  for (float length : descriptor) {
+    sum += length;
+  }
+  // All keypoints on one spot, or not numbers.
+  if (!(sum > 0.0f) || !std::isfinite(sum)) {
+    descriptor.clear();
+    return kInvalidArguments;
+  }
+  float scale = descriptor.size() / sum;
+  for (float& length : descriptor) {
+    length *= scale;
+  }
+  return kOk;
+}
+
+}  // namespace StreamPalm
@@ -0,0 +1,19 @@
+#ifndef PALM_COMPARE_PALM_GEOMETRY_H_
+#define PALM_COMPARE_PALM_GEOMETRY_H_
+
+#include <cstddef>
+#include <vector>
+
+namespace StreamPalm {
+
+// Keypoints of a skeleton that enter the descriptor, later ones are ignored.
+constexpr size_t kMaxSkeletonPoints = 24;
+
+// Shape of a palm skeleton of (x, y) keypoints that does not depend on the hand's distance,
+// position or rotation in the image: the lengths between consecutive keypoints, e.g. finger
+// segments, and from the first keypoint to every other one, e.g. palm width and finger reach,
+// each divided by the mean of them all. A skeleton of n >= 3 keypoints gives 2n - 3 values.
+int SkeletonGeometry(const std::vector<float>& skeleton, std::vector<float>& descriptor);
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_PALM_GEOMETRY_H_
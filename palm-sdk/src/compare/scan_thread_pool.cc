@@ -0,0 +1,180 @@
+#include "scan_thread_pool.h"
+#include <algorithm>
+#if _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace StreamPalm {
+
+namespace {
+
+void PinCurrentThread(const std::vector<int>& cpus) {
+  if (cpus.empty())
+    return;
+#if _WIN32
+  DWORD_PTR mask = 0;
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < static_cast<int>(sizeof(DWORD_PTR) * 8))
+      mask |= static_cast<DWORD_PTR>(1) << cpu;
+  }
+  if (mask)
+    SetThreadAffinityMask(GetCurrentThread(), mask);
+#elif defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// Cores the process may run on, e.g. those of its cpuset, or every core when unknown.
+std::vector<int> ProcessCpus() {
+  std::vector<int> cpus;
+#if _WIN32
+  DWORD_PTR process_mask = 0;
+  DWORD_PTR system_mask = 0;
+  if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+    for (int cpu = 0; cpu < static_cast<int>(sizeof(DWORD_PTR) * 8); ++cpu) {
+      if ((process_mask >> cpu) & 1)
+        cpus.push_back(cpu);
+    }
+  }
+#elif defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set))
+        cpus.push_back(cpu);
+    }
+  }
+#endif
+  if (cpus.empty()) {
+    int count = static_cast<int>(std::thread::hardware_concurrency());
+    for (int cpu = 0; cpu < count; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+}  // namespace
+
+ScanThreadPool::ScanThreadPool(size_t threads, const std::vector<int>& cpus) {
+  for (size_t i = 0; i < threads; ++i) {
+    queues_.emplace_back(new Queue());
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    workers_.emplace_back(&ScanThreadPool::WorkerLoop, this, i, cpus);
+  }
+}
+
+ScanThreadPool::~ScanThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+std::vector<int> ScanThreadPool::AllowedCpus(const std::vector<int>& cpus,
+                                             const std::vector<int>& excluded_cpus) {
+  std::vector<int> process = ProcessCpus();
+  const std::vector<int>& allowed = cpus.empty() ? process : cpus;
+  std::vector<int> result;
+  for (int cpu : allowed) {
+    if (std::find(process.begin(), process.end(), cpu) != process.end() &&
+        std::find(excluded_cpus.begin(), excluded_cpus.end(), cpu) == excluded_cpus.end() &&
+        std::find(result.begin(), result.end(), cpu) == result.end())
+      result.push_back(cpu);
+  }
+  return result;
+}
+
+bool ScanThreadPool::PopTask(size_t home, Task& task) {
+  size_t count = queues_.size();
+  for (size_t i = 0; i < count; ++i) {
+    Queue& queue = *queues_[(home + i) % count];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+      continue;
+    // Own tasks in order, stolen ones from the far end.
+    if (i == 0) {
+      task = queue.tasks.front();
+      queue.tasks.pop_front();
+    } else {
+      task = queue.tasks.back();
+      queue.tasks.pop_back();
+    }
+    --pending_;
+    return true;
+  }
+  return false;
+}
+
+void ScanThreadPool::Run(const Task& task) {
+  (*task.job->task)(task.index);
+  Job* job = task.job;
+  // The job lives on the stack of ParallelFor(), it may go away as soon as the lock is released.
+  std::lock_guard<std::mutex> lock(job->mutex);
+  if (--job->remaining == 0)
+    job->done.notify_all();
+}
+
+void ScanThreadPool::WorkerLoop(size_t id, const std::vector<int>& cpus) {
+  PinCurrentThread(cpus);
+  for (;;) {
+    Task task;
+    if (PopTask(id, task)) {
+      Run(task);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    wake_.wait(lock, [this] { return stop_ || pending_ > 0; });
+    if (stop_ && pending_ == 0)
+      return;
+  }
+}
+
+void ScanThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& task) {
+  if (workers_.empty() || count < 2) {
+    for (size_t i = 0; i < count; ++i) {
+      task(i);
+    }
+    return;
+  }
+  Job job;
+  job.task = &task;
+  job.remaining = count;
+  size_t start = next_queue_++;
+  for (size_t i = 0; i < count; ++i) {
+    Queue& queue = *queues_[(start + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back({&job, i});
+    // Counted with the task in the queue, under the lock PopTask() takes it with.
+    ++pending_;
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+  }
+  wake_.notify_all();
+
+  // The calling thread works too instead of sleeping on the result.
+  Task next;
+  while (job.remaining > 0 && PopTask(start, next)) {
+    Run(next);
+  }
+  std::unique_lock<std::mutex> lock(job.mutex);
+  job.done.wait(lock, [&job] { return job.remaining == 0; });
+}
+
+}  // namespace StreamPalm
@@ -0,0 +1,71 @@
+#ifndef PALM_COMPARE_SCAN_THREAD_POOL_H_
+#define PALM_COMPARE_SCAN_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace StreamPalm {
+
+// Work-stealing pool for gallery shards. Every worker owns a deque, takes its own tasks from the
+// front and steals from the back of the others when it runs dry. Workers are pinned to a CPU
+// set, so they stay off the cores the model inference threads use.
+class ScanThreadPool {
+ public:
+  // cpus empty leaves the affinity to the OS.
+  ScanThreadPool(size_t threads, const std::vector<int>& cpus);
+  ~ScanThreadPool();
+
+  ScanThreadPool(const ScanThreadPool&) = delete;
+  ScanThreadPool& operator=(const ScanThreadPool&) = delete;
+
+  size_t size() const { return workers_.size(); }
+
+  // Run task(i) for every i in [0, count) on the workers and the calling thread, returns once
+  // all of them finished. Safe to call from several threads at once.
+  void ParallelFor(size_t count, const std::function<void(size_t)>& task);
+
+  // Cores the scan may use: cpus, or every core when empty, minus the excluded ones and those
+  // outside the affinity of the process.
+  static std::vector<int> AllowedCpus(const std::vector<int>& cpus,
+                                      const std::vector<int>& excluded_cpus);
+
+ private:
+  struct Job {
+    const std::function<void(size_t)>* task;
+    std::atomic<size_t> remaining;
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+
+  struct Task {
+    Job* job;
+    size_t index;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  bool PopTask(size_t home, Task& task);
+  void Run(const Task& task);
+  void WorkerLoop(size_t id, const std::vector<int>& cpus);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> pending_{0};
+  std::atomic<size_t> next_queue_{0};
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  bool stop_{false};
+};
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_SCAN_THREAD_POOL_H_
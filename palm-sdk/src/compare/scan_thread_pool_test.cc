@@ -0,0 +1,85 @@
+// Tests of ScanThreadPool, run by ctest when the library is built on its own.
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "scan_thread_pool.h"
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+using namespace StreamPalm;
+
+namespace {
+
+int failures = 0;
+
+void Expect(bool condition, const char* what) {
+  if (condition)
+    return;
+  std::fprintf(stderr, "FAILED: %s\n", what);
+  ++failures;
+}
+
+// Every task runs exactly once, with several callers sharing the pool.
+void TestParallelFor() {
+  ScanThreadPool pool(4, {});
+  std::vector<std::thread> callers;
+  std::atomic<int> wrong{0};
+  for (int c = 0; c < 4; ++c) {
+    callers.emplace_back([&] {
+      for (int round = 0; round < 200; ++round) {
+        std::vector<std::atomic<int>> runs(37);
+        for (std::atomic<int>& count : runs) {
+          count = 0;
+        }
+        pool.ParallelFor(runs.size(), [&](size_t i) { ++runs[i]; });
+        for (std::atomic<int>& count : runs) {
+          wrong += count != 1;
+        }
+      }
+    });
+  }
+  for (std::thread& caller : callers) {
+    caller.join();
+  }
+  Expect(wrong == 0, "every task once");
+}
+
+// Cores outside the affinity of the process are never handed to the workers.
+void TestAllowedCpusFollowAffinity() {
+#if defined(__linux__)
+  cpu_set_t saved;
+  if (sched_getaffinity(0, sizeof(saved), &saved))
+    return;
+  int first = -1;
+  for (int cpu = 0; cpu < CPU_SETSIZE && first < 0; ++cpu) {
+    if (CPU_ISSET(cpu, &saved))
+      first = cpu;
+  }
+  cpu_set_t one;
+  CPU_ZERO(&one);
+  CPU_SET(first, &one);
+  if (sched_setaffinity(0, sizeof(one), &one))
+    return;
+  std::vector<int> all = ScanThreadPool::AllowedCpus({}, {});
+  std::vector<int> listed = ScanThreadPool::AllowedCpus({first, first + 1}, {});
+  std::vector<int> excluded = ScanThreadPool::AllowedCpus({}, {first});
+  sched_setaffinity(0, sizeof(saved), &saved);
+  Expect(all.size() == 1 && all[0] == first, "every core of the affinity");
+  Expect(listed.size() == 1 && listed[0] == first, "listed cores within the affinity");
+  Expect(excluded.empty(), "excluded core");
+#endif
+}
+
+}  // namespace
+
+int main() {
+  TestParallelFor();
+  TestAllowedCpusFollowAffinity();
+  if (failures)
+    return 1;
+  std::printf("all tests passed\n");
+  return 0;
+}
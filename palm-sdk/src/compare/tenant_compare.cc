@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include "palm/compare_arithmetic.h"
+
+namespace StreamPalm {
+
+namespace {
+
+class TenantCompareImpl : public TenantCompare {
+ public:
+  int AddTenant(const std::string& company_id, const CompareConfig& config) override {
+    if (company_id.empty())
+      return kInvalidArguments;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (tenants_.count(company_id))
+        return kCompareIdExists;
+    }
+    // Created outside the lock, e.g. loading a projection, while the other tenants are served.
+    std::shared_ptr<PalmCompare> compare;
+    int ret = PalmCompare::Create(config, &compare);
+    if (ret)
+      return ret;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!tenants_.emplace(company_id, std::move(compare)).second)
+      return kCompareIdExists;
+    return kOk;
+  }
+
+  int RemoveTenant(const std::string& company_id) override {
+    std::shared_ptr<PalmCompare> removed;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = tenants_.find(company_id);
+      if (it == tenants_.end())
+        return kCompareIdNotFound;
+      removed = std::move(it->second);
+      tenants_.erase(it);
+    }
+    // Released outside the lock, a large gallery takes a while to free.
+    removed.reset();
+    return kOk;
+  }
+
+  int GetTenant(const std::string& company_id,
+                std::shared_ptr<PalmCompare>* compare) override {
+    if (!compare)
+      return kAccessToNullPointer;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tenants_.find(company_id);
+    if (it == tenants_.end())
+      return kCompareIdNotFound;
+    *compare = it->second;
+    return kOk;
+  }
+
+  int GetTenants(std::vector<std::string>& company_ids) override {
+    company_ids.clear();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& tenant : tenants_) {
+        company_ids.push_back(tenant.first);
+      }
+    }
+    std::sort(company_ids.begin(), company_ids.end());
+    return kOk;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<PalmCompare>> tenants_;
+};
+
+}  // namespace
+
+int TenantCompare::Create(std::shared_ptr<TenantCompare>* tenants) {
+  if (!tenants)
+    return kAccessToNullPointer;
+  *tenants = std::make_shared<TenantCompareImpl>();
+  return kOk;
+}
+
+}  // namespace StreamPalm
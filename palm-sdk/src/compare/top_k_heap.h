@@ -0,0 +1,60 @@
+#ifndef PALM_COMPARE_TOP_K_HEAP_H_
+#define PALM_COMPARE_TOP_K_HEAP_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace StreamPalm {
+
+struct ScoredRow {
+  float score;
+  uint32_t row;
+};
+
+// Keeps the K highest scores seen so far in a min-heap.
+class TopKHeap {
+ public:
+  explicit TopKHeap(size_t k) : k_(k) { heap_.reserve(k); }
+
+  // Lowest score that still enters the heap.
+  float Bound() const {
+    return heap_.size() < k_ ? -std::numeric_limits<float>::infinity() : heap_.front().score;
+  }
+
+  void Push(float score, uint32_t row) {
+    if (k_ == 0)
+      return;
+    if (heap_.size() < k_) {
+      heap_.push_back({score, row});
+      std::push_heap(heap_.begin(), heap_.end(), Greater);
+    } else if (score > heap_.front().score) {
+      std::pop_heap(heap_.begin(), heap_.end(), Greater);
+      heap_.back() = {score, row};
+      std::push_heap(heap_.begin(), heap_.end(), Greater);
+    }
+  }
+
+  size_t size() const { return heap_.size(); }
+  size_t capacity() const { return k_; }
+
+  // Sorted by descending score, empties the heap.
+  std::vector<ScoredRow> Take() {
+    std::sort_heap(heap_.begin(), heap_.end(), Greater);
+    std::vector<ScoredRow> result;
+    result.swap(heap_);
+    return result;
+  }
+
+ private:
+  static bool Greater(const ScoredRow& a, const ScoredRow& b) {
+    return a.score > b.score || (a.score == b.score && a.row < b.row);
+  }
+
+  size_t k_;
+  std::vector<ScoredRow> heap_;
+};
+
+}  // namespace StreamPalm
+#endif  // PALM_COMPARE_TOP_K_HEAP_H_